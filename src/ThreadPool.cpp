@@ -0,0 +1,189 @@
+#include "ThreadPool.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+
+/// The pool of the calling worker (nullptr outside of pools)
+thread_local ThreadPool *current_pool = nullptr;
+/// The queue index of the calling worker
+thread_local size_t current_index = 0;
+
+}
+
+// the constructor just launches some amount of workers
+ThreadPool::ThreadPool(size_t threads, const std::vector<int> &cpus,
+                       const std::vector<int> &nodes)
+    :   cpus(cpus), nodes(nodes), queues(new WorkQueue[threads + 1])
+{
+    for(size_t i = 0;i<threads;++i)
+        workers.emplace_back(&ThreadPool::run, this, i);
+}
+
+// the destructor joins all threads
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stop = true;
+    }
+    condition.notify_all();
+    for(std::thread &worker: workers)
+        worker.join();
+}
+
+// the queue the calling thread pushes to
+ThreadPool::WorkQueue &ThreadPool::localQueue()
+{
+    return current_pool == this ? queues[current_index] : queues[workers.size()];
+}
+
+// push a task of the calling thread
+void ThreadPool::push(const Task &task)
+{
+    task.group->pending_.fetch_add(1, std::memory_order_relaxed);
+    auto &queue = localQueue();
+    queue.lock.lock();
+    queue.tasks.push_back(task);
+    queue.size.store(queue.tasks.size(), std::memory_order_relaxed);
+    queue.lock.unlock();
+
+    queued.fetch_add(1);
+    if (sleeping.load() > 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        condition.notify_one();
+    }
+}
+
+// pop a task from the back (own queue) or the front (stealing)
+bool ThreadPool::pop(WorkQueue &queue, Task &task, bool back)
+{
+    if (queue.size.load(std::memory_order_relaxed) == 0)
+        return false;
+    queue.lock.lock();
+    if (queue.tasks.empty()) {
+        queue.lock.unlock();
+        return false;
+    }
+    if (back) {
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+    } else {
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+    }
+    queue.size.store(queue.tasks.size(), std::memory_order_relaxed);
+    queue.lock.unlock();
+    queued.fetch_sub(1);
+    return true;
+}
+
+// pop a local task or steal one
+bool ThreadPool::findTask(Task &task)
+{
+    if (queued.load(std::memory_order_relaxed) <= 0)
+        return false;
+
+    // own work first (newest, still warm in cache)
+    bool is_worker = current_pool == this;
+    if (is_worker && pop(queues[current_index], task, true))
+        return true;
+    // then the injection queue
+    if (pop(queues[workers.size()], task, false))
+        return true;
+    // then the oldest (largest) task of the other workers, same node first
+    size_t first = is_worker ? current_index + 1 : 0;
+    bool by_node = is_worker && current_index < nodes.size();
+    for (int pass = by_node ? 0 : 1; pass < 2; ++pass) {
+        for (size_t i = 0; i < workers.size(); ++i) {
+            size_t victim = (first + i) % workers.size();
+            if (is_worker && victim == current_index)
+                continue;
+            if (by_node && victim < nodes.size() &&
+                (nodes[victim] == nodes[current_index]) != (pass == 0))
+                continue;
+            if (pop(queues[victim], task, false))
+                return true;
+        }
+    }
+    return false;
+}
+
+// run a task, splitting ranges on the way
+void ThreadPool::execute(Task &task)
+{
+    auto group = task.group;
+    try {
+        if (task.grain) {
+            uint64_t begin = task.begin, end = task.end;
+            bool is_worker = current_pool == this;
+            auto &queue = localQueue();
+            // the rest of a failed group is not worth running
+            while (begin < end && !group->failed_.load(std::memory_order_relaxed)) {
+                // lazy splitting: workers only hand out work when their deque ran
+                // dry, other threads cannot be stolen from and always split
+                if (end - begin > task.grain &&
+                    (!is_worker || queue.size.load(std::memory_order_relaxed) == 0)) {
+                    uint64_t mid = begin + (end - begin) / 2;
+                    push(Task{task.invoke, task.callable, mid, end, task.grain, group});
+                    end = mid;
+                    continue;
+                }
+                uint64_t chunk_end = std::min(end, begin + task.grain);
+                task.invoke(task.callable, begin, chunk_end);
+                begin = chunk_end;
+            }
+        } else if (!group->failed_.load(std::memory_order_relaxed)) {
+            task.invoke(task.callable, 0, 0);
+        }
+    } catch (...) {
+        // the first error wins, the joining thread rethrows it
+        if (!group->failed_.exchange(true))
+            group->error_ = std::current_exception();
+    }
+    group->pending_.fetch_sub(1, std::memory_order_release);
+}
+
+// join: run tasks until the group is done
+void ThreadPool::wait(TaskGroup &group)
+{
+    Task task;
+    while (!group.done()) {
+        if (findTask(task))
+            execute(task);
+        else
+            std::this_thread::yield();
+    }
+    if (group.error_)
+        std::rethrow_exception(group.error_);
+}
+
+// worker main loop
+void ThreadPool::run(size_t index)
+{
+    current_pool = this;
+    current_index = index;
+    if (index < cpus.size()) {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(cpus[index], &mask);
+        pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+    }
+    Task task;
+    for(;;)
+    {
+        if (findTask(task)) {
+            execute(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleeping.fetch_add(1);
+        condition.wait(lock,
+            [this]{ return stop.load() || queued.load() > 0; });
+        sleeping.fetch_sub(1);
+        if (stop.load() && queued.load() <= 0)
+            return;
+    }
+}
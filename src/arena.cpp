@@ -0,0 +1,241 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <new>
+#include <sys/mman.h>
+#include <unordered_map>
+
+#include "runtime.h"
+
+namespace {
+
+/// Blocks of finished queries placed on one NUMA node
+struct NodePool {
+  /// Chunks
+  std::vector<char *> chunks;
+  /// Freed large blocks by size class (log2 of their size)
+  std::vector<char *> large[64];
+};
+
+/// Protects the pools
+std::mutex pool_mutex;
+/// The pools by node
+std::vector<NodePool> node_pools;
+/// The chunks in all pools
+uint64_t pooled_chunks = 0;
+/// The bytes of the large blocks in all pools
+uint64_t pooled_large_bytes = 0;
+/// The node of every mapped block (only with more than one pool)
+std::unordered_map<char *, unsigned> block_nodes;
+
+// The number of pools: one per node if memory is placed, otherwise one
+unsigned numPools()
+{
+  static const unsigned pools = Runtime::get().numaEnabled()
+                                    ? std::max(Runtime::get().topology().num_nodes, 1u)
+                                    : 1;
+  return pools;
+}
+
+// The pool of a node (pool_mutex must be held)
+NodePool &nodePool(unsigned node)
+{
+  if (node_pools.empty())
+    node_pools.resize(numPools());
+  return node_pools[node];
+}
+
+// The node the calling thread allocates on
+unsigned allocationNode()
+{
+  return numPools() > 1 ? std::min(Runtime::get().currentNode(), numPools() - 1) : 0;
+}
+
+// Map a block placed on a node. The policy is set before the first touch,
+// so the block stays on the node for as long as it is recycled
+char *mapBlock(uint64_t size, unsigned node)
+{
+  void *block = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block == MAP_FAILED)
+    throw std::bad_alloc();
+  if (numPools() > 1)
+  {
+    Runtime::get().placeOnNode(block, size, node);
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    block_nodes[static_cast<char *>(block)] = node;
+  }
+  return static_cast<char *>(block);
+}
+
+// The node a block was placed on (pool_mutex must be held)
+unsigned blockNode(char *block)
+{
+  if (numPools() == 1)
+    return 0;
+  auto it = block_nodes.find(block);
+  return it != block_nodes.end() ? it->second : 0;
+}
+
+// Unmap a block (pool_mutex must not be held)
+void unmapBlock(char *block, uint64_t size)
+{
+  if (numPools() > 1)
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    block_nodes.erase(block);
+  }
+  munmap(block, size);
+}
+
+// Take a chunk of the calling thread's node from the pool, or a fresh one
+char *acquireChunk()
+{
+  auto node = allocationNode();
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    auto &chunks = nodePool(node).chunks;
+    if (!chunks.empty())
+    {
+      auto chunk = chunks.back();
+      chunks.pop_back();
+      --pooled_chunks;
+      return chunk;
+    }
+  }
+  return mapBlock(Arena::kChunkSize, node);
+}
+
+// Return chunks to the pools of their nodes, unmap the ones that don't fit
+void releaseChunks(std::vector<char *> &chunks)
+{
+  std::unique_lock<std::mutex> lock(pool_mutex);
+  while (!chunks.empty() && pooled_chunks < Arena::kMaxPooledChunks)
+  {
+    nodePool(blockNode(chunks.back())).chunks.push_back(chunks.back());
+    ++pooled_chunks;
+    chunks.pop_back();
+  }
+  lock.unlock();
+  for (auto chunk : chunks)
+    unmapBlock(chunk, Arena::kChunkSize);
+  chunks.clear();
+}
+
+// The size class of a large block: its size rounded up to a power of two
+unsigned largeClass(size_t bytes)
+{
+  return 64 - __builtin_clzll(bytes - 1);
+}
+
+// Take a large block of the calling thread's node from its free list, or
+// map a fresh one
+char *acquireLarge(unsigned size_class)
+{
+  uint64_t size = uint64_t(1) << size_class;
+  auto node = allocationNode();
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    auto &blocks = nodePool(node).large[size_class];
+    if (!blocks.empty())
+    {
+      auto block = blocks.back();
+      blocks.pop_back();
+      pooled_large_bytes -= size;
+      return block;
+    }
+  }
+  return mapBlock(size, node);
+}
+
+// Put a large block on the free list of its node, unmap it if the lists
+// are full
+void releaseLarge(char *block, unsigned size_class)
+{
+  uint64_t size = uint64_t(1) << size_class;
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (pooled_large_bytes + size <= Arena::kMaxPooledLargeBytes)
+    {
+      nodePool(blockNode(block)).large[size_class].push_back(block);
+      pooled_large_bytes += size;
+      return;
+    }
+  }
+  unmapBlock(block, size);
+}
+
+// The lane of the calling thread
+unsigned laneIndex(unsigned lanes)
+{
+  static std::atomic<unsigned> next_lane{0};
+  thread_local unsigned lane = next_lane++;
+  return lane % lanes;
+}
+
+} // namespace
+
+// Returns the chunks to the pool
+Arena::~Arena()
+{
+  for (auto &lane : lanes_)
+    releaseChunks(lane.chunks);
+}
+
+// Allocate a block
+void *Arena::allocate(size_t bytes, size_t alignment)
+{
+  bytes = std::max<size_t>(bytes, 1);
+  if (bytes > kLargeSize)
+  {
+    auto size_class = largeClass(bytes);
+    auto block = acquireLarge(size_class);
+    bytes_.fetch_add(uint64_t(1) << size_class, std::memory_order_relaxed);
+    return block;
+  }
+
+  auto &lane = lanes_[laneIndex(kLanes)];
+  std::lock_guard<std::mutex> lock(lane.mutex);
+  auto aligned = reinterpret_cast<char *>(
+      (reinterpret_cast<uintptr_t>(lane.cursor) + alignment - 1) & ~uintptr_t(alignment - 1));
+  if (!lane.cursor || aligned + bytes > lane.end)
+  {
+    auto chunk = acquireChunk();
+    lane.chunks.push_back(chunk);
+    bytes_.fetch_add(kChunkSize, std::memory_order_relaxed);
+    lane.end = chunk + kChunkSize;
+    aligned = chunk;
+  }
+  lane.cursor = aligned + bytes;
+  return aligned;
+}
+
+// Free a block
+void Arena::deallocate(void *block, size_t bytes)
+{
+  // Small blocks live until the arena dies
+  if (std::max<size_t>(bytes, 1) <= kLargeSize)
+    return;
+  auto size_class = largeClass(bytes);
+  releaseLarge(static_cast<char *>(block), size_class);
+  bytes_.fetch_sub(uint64_t(1) << size_class, std::memory_order_relaxed);
+}
+
+// The number of chunks in the pool
+size_t Arena::pooledChunks()
+{
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  return pooled_chunks;
+}
+
+// The number of large blocks on the free lists
+size_t Arena::pooledLargeBlocks()
+{
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  size_t blocks = 0;
+  for (auto &pool : node_pools)
+  {
+    for (auto &list : pool.large)
+      blocks += list.size();
+  }
+  return blocks;
+}
@@ -0,0 +1,61 @@
+#include "batch.h"
+
+// Key of the build side of a scan on a key column
+std::string BatchContext::buildKey(const std::string &scan_signature,
+                                   unsigned col_id)
+{
+  return "build:" + scan_signature + "." + std::to_string(col_id);
+}
+
+// Announce that a query of the batch joins on the build side
+void BatchContext::expectBuild(const std::string &key)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++expected_builds_[key];
+}
+
+// Whether several queries of the batch join on the build side
+bool BatchContext::isShared(const std::string &key)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = expected_builds_.find(key);
+  return it != expected_builds_.end() && it->second > 1;
+}
+
+// Get the table of a build side
+std::shared_ptr<const BuildTable> BatchContext::getOrBuild(
+    const std::string &key,
+    const std::function<std::shared_ptr<const BuildTable>()> &build)
+{
+  std::promise<std::shared_ptr<const BuildTable>> promise;
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = tables_.find(key);
+  if (it != tables_.end())
+  {
+    auto table = it->second;
+    lock.unlock();
+    return table.get();
+  }
+  tables_.emplace(key, promise.get_future().share());
+  lock.unlock();
+
+  try
+  {
+    auto table = build();
+    promise.set_value(table);
+    return table;
+  }
+  catch (...)
+  {
+    promise.set_exception(std::current_exception());
+    throw;
+  }
+}
+
+// Release all shared state
+void BatchContext::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  expected_builds_.clear();
+  tables_.clear();
+}
@@ -0,0 +1,92 @@
+#include "cache.h"
+
+#include <algorithm>
+
+// The memory footprint of the result
+uint64_t CachedResult::bytes() const
+{
+  uint64_t bytes = sizeof(CachedResult) + checksums.size();
+  bytes += row_ids.size() * sizeof(uint64_t);
+  for (auto &column : columns)
+    bytes += column.size() * sizeof(uint64_t);
+  return bytes;
+}
+
+// Priority of an entry given the current inflation
+double ResultCache::priority(const Entry &entry) const
+{
+  return inflation_ + entry.cost / std::max<uint64_t>(entry.bytes, 1);
+}
+
+// Look up a result
+std::shared_ptr<const CachedResult> ResultCache::lookup(const std::string &key)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end())
+    return nullptr;
+  // Refresh the priority of the hit entry
+  auto &entry = it->second;
+  eviction_order_.erase(entry.position);
+  entry.position = eviction_order_.emplace(priority(entry), key);
+  return entry.result;
+}
+
+// Evict entries until bytes fit
+void ResultCache::makeRoom(uint64_t bytes)
+{
+  while (used_ + bytes > capacity_ && !eviction_order_.empty())
+  {
+    auto victim = eviction_order_.begin();
+    inflation_ = victim->first;
+    auto it = entries_.find(victim->second);
+    used_ -= it->second.bytes;
+    entries_.erase(it);
+    eviction_order_.erase(victim);
+  }
+}
+
+// Insert a result
+void ResultCache::insert(const std::string &key,
+                         std::shared_ptr<const CachedResult> result,
+                         double cost)
+{
+  uint64_t bytes = result->bytes() + key.size();
+  if (bytes > capacity_)
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (entries_.count(key))
+    // A concurrent query computed the same result
+    return;
+  makeRoom(bytes);
+
+  Entry entry{std::move(result), cost, bytes, eviction_order_.end()};
+  entry.position = eviction_order_.emplace(priority(entry), key);
+  entries_.emplace(key, std::move(entry));
+  used_ += bytes;
+}
+
+// Drop all entries
+void ResultCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  eviction_order_.clear();
+  used_ = 0;
+  inflation_ = 0;
+}
+
+// The number of cached bytes
+uint64_t ResultCache::usedBytes()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return used_;
+}
+
+// The number of cached entries
+size_t ResultCache::size()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
@@ -0,0 +1,250 @@
+#include "compression.h"
+
+#include <algorithm>
+
+namespace {
+
+// The narrowest code width for codes up to max_code, 8 if none fits
+unsigned codeWidth(uint64_t max_code)
+{
+  if (max_code <= UINT8_MAX)
+    return 1;
+  if (max_code <= UINT16_MAX)
+    return 2;
+  if (max_code <= UINT32_MAX)
+    return 4;
+  return 8;
+}
+
+// Store the codes of all values with the given width
+template <typename Code, typename F>
+void storeCodes(std::vector<uint8_t> &codes, const uint64_t *values,
+                uint64_t size, const F &encode)
+{
+  codes.resize(size * sizeof(Code));
+  auto out = reinterpret_cast<Code *>(codes.data());
+  for (uint64_t i = 0; i < size; ++i)
+    out[i] = encode(values[i]);
+}
+
+} // namespace
+
+// Encode a column
+std::shared_ptr<const EncodedColumn> EncodedColumn::encode(
+    const uint64_t *values, uint64_t size, uint64_t min, uint64_t max,
+    uint64_t distinct)
+{
+  if (size == 0)
+    return nullptr;
+  auto column = std::make_shared<EncodedColumn>();
+  column->size_ = size;
+  column->base_ = min;
+  column->max_code_ = max - min;
+  column->kind_ = Kind::FrameOfReference;
+  column->width_ = codeWidth(max - min);
+
+  // A dictionary pays off if it allows for narrower codes
+  if (distinct <= 2 * kMaxDictionary && codeWidth(distinct) < column->width_)
+  {
+    std::vector<uint64_t> dictionary(values, values + size);
+    std::sort(dictionary.begin(), dictionary.end());
+    dictionary.erase(std::unique(dictionary.begin(), dictionary.end()),
+                     dictionary.end());
+    if (dictionary.size() <= kMaxDictionary &&
+        codeWidth(dictionary.size() - 1) < column->width_)
+    {
+      column->kind_ = Kind::Dictionary;
+      column->width_ = codeWidth(dictionary.size() - 1);
+      column->dictionary_ = std::move(dictionary);
+    }
+  }
+  if (column->width_ == 8)
+    return nullptr;
+
+  auto &dictionary = column->dictionary_;
+  auto encode = [&](uint64_t value) -> uint64_t {
+    if (column->kind_ == Kind::Dictionary)
+      return std::lower_bound(dictionary.begin(), dictionary.end(), value) -
+             dictionary.begin();
+    return value - min;
+  };
+  switch (column->width_)
+  {
+  case 1:
+    storeCodes<uint8_t>(column->codes_, values, size, encode);
+    break;
+  case 2:
+    storeCodes<uint16_t>(column->codes_, values, size, encode);
+    break;
+  default:
+    storeCodes<uint32_t>(column->codes_, values, size, encode);
+    break;
+  }
+  column->code_data_ = column->codes_.data();
+  return column;
+}
+
+// Wrap stored codes
+std::shared_ptr<const EncodedColumn> EncodedColumn::fromStorage(
+    Kind kind, unsigned width, uint64_t size, uint64_t base, uint64_t max_code,
+    std::vector<uint64_t> dictionary, const uint8_t *code_data)
+{
+  auto column = std::make_shared<EncodedColumn>();
+  column->kind_ = kind;
+  column->width_ = width;
+  column->size_ = size;
+  column->base_ = base;
+  column->max_code_ = max_code;
+  column->dictionary_ = std::move(dictionary);
+  column->code_data_ = code_data;
+  return column;
+}
+
+// Dispatch on the code width
+template <typename F>
+void EncodedColumn::withCodes(const F &f) const
+{
+  switch (width_)
+  {
+  case 1:
+    f(codes<uint8_t>());
+    break;
+  case 2:
+    f(codes<uint16_t>());
+    break;
+  default:
+    f(codes<uint32_t>());
+    break;
+  }
+}
+
+// Translate a comparison into a code range
+bool EncodedColumn::codeRange(char comparison, uint64_t constant,
+                              uint32_t &lo, uint32_t &hi) const
+{
+  if (kind_ == Kind::Dictionary)
+  {
+    auto begin = dictionary_.begin(), end = dictionary_.end();
+    switch (comparison)
+    {
+    case '=':
+    {
+      auto it = std::lower_bound(begin, end, constant);
+      if (it == end || *it != constant)
+        return false;
+      lo = hi = it - begin;
+      return true;
+    }
+    case '<':
+    {
+      auto first_not_less = std::lower_bound(begin, end, constant) - begin;
+      if (first_not_less == 0)
+        return false;
+      lo = 0;
+      hi = first_not_less - 1;
+      return true;
+    }
+    case '>':
+    {
+      auto first_greater = std::upper_bound(begin, end, constant) - begin;
+      if (first_greater == (long)dictionary_.size())
+        return false;
+      lo = first_greater;
+      hi = dictionary_.size() - 1;
+      return true;
+    }
+    }
+    return false;
+  }
+
+  uint64_t max = base_ + max_code_;
+  switch (comparison)
+  {
+  case '=':
+    if (constant < base_ || constant > max)
+      return false;
+    lo = hi = constant - base_;
+    return true;
+  case '<':
+    if (constant <= base_)
+      return false;
+    lo = 0;
+    hi = std::min(constant - 1, max) - base_;
+    return true;
+  case '>':
+    if (constant >= max)
+      return false;
+    lo = std::max(constant + 1, base_) - base_;
+    hi = max_code_;
+    return true;
+  }
+  return false;
+}
+
+// Append the qualifying rows of a range
+void EncodedColumn::select(uint64_t begin, uint64_t end, uint32_t lo,
+                           uint32_t hi, std::vector<uint64_t> &row_ids) const
+{
+  withCodes([&](auto codes) {
+    // Write every row and only advance past the qualifying ones: no branch
+    uint64_t n = row_ids.size();
+    row_ids.resize(n + (end - begin));
+    uint32_t span = hi - lo;
+    for (uint64_t i = begin; i < end; ++i)
+    {
+      row_ids[n] = i;
+      n += uint32_t(codes[i] - lo) <= span;
+    }
+    row_ids.resize(n);
+  });
+}
+
+// Keep the qualifying rows
+void EncodedColumn::refine(uint32_t lo, uint32_t hi,
+                           std::vector<uint64_t> &row_ids,
+                           uint64_t first) const
+{
+  withCodes([&](auto codes) {
+    uint64_t n = first;
+    uint32_t span = hi - lo;
+    for (uint64_t i = first; i < row_ids.size(); ++i)
+    {
+      auto row_id = row_ids[i];
+      row_ids[n] = row_id;
+      n += uint32_t(codes[row_id] - lo) <= span;
+    }
+    row_ids.resize(n);
+  });
+}
+
+// Decode a value
+uint64_t EncodedColumn::get(uint64_t row_id) const
+{
+  switch (width_)
+  {
+  case 1:
+    return decode(codes<uint8_t>()[row_id]);
+  case 2:
+    return decode(codes<uint16_t>()[row_id]);
+  default:
+    return decode(codes<uint32_t>()[row_id]);
+  }
+}
+
+// Decode the values of some rows
+void EncodedColumn::gather(const uint64_t *row_ids, uint64_t count,
+                           uint64_t *out) const
+{
+  withCodes([&](auto codes) {
+    if (kind_ == Kind::Dictionary)
+    {
+      for (uint64_t i = 0; i < count; ++i)
+        out[i] = dictionary_[codes[row_ids[i]]];
+    }
+    else
+    {
+      for (uint64_t i = 0; i < count; ++i)
+        out[i] = base_ + codes[row_ids[i]];
+    }
+  });
+}
@@ -0,0 +1,314 @@
+#include "format.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "relation.h"
+
+namespace {
+
+/// Words of the v2 header
+enum HeaderWord { Magic, Version, Size, NumColumns, FooterOffset, FooterLength, NumHeaderWords };
+
+/// Words of the snapshot header
+enum SnapshotWord { SnapMagic, SnapVersion, SnapFileSize, SnapMtime, SnapChecksum,
+                    SnapFooterOffset, SnapFooterLength, NumSnapshotWords };
+
+/// First word of a snapshot
+constexpr uint64_t kSnapshotMagic = 0x0070616e732d4244ull; // "DB-snap"
+
+/// Words sampled for the checksum of a file
+constexpr uint64_t kChecksumSamples = 1024;
+
+/// Flags of a column in the footer
+constexpr uint64_t HasStats = 1, HasEncoding = 2;
+
+// Appends words to a footer
+class FooterWriter
+{
+public:
+  void put(uint64_t word) { words_.push_back(word); }
+  void put(const std::vector<uint64_t> &words)
+  {
+    put(words.size());
+    words_.insert(words_.end(), words.begin(), words.end());
+  }
+  const std::vector<uint64_t> &words() const { return words_; }
+
+private:
+  std::vector<uint64_t> words_;
+};
+
+// Reads words of a footer, fails instead of reading past its end
+class FooterReader
+{
+public:
+  FooterReader(const uint64_t *words, uint64_t count) : words_(words), count_(count) {}
+  bool get(uint64_t &word)
+  {
+    if (position_ >= count_)
+      return false;
+    word = words_[position_++];
+    return true;
+  }
+  bool get(std::vector<uint64_t> &words)
+  {
+    uint64_t size;
+    if (!get(size) || size > count_ - position_)
+      return false;
+    words.assign(words_ + position_, words_ + position_ + size);
+    position_ += size;
+    return true;
+  }
+
+private:
+  const uint64_t *words_;
+  uint64_t count_;
+  uint64_t position_ = 0;
+};
+
+} // namespace
+
+// The key of a mapped file
+FileKey FileKey::of(uint64_t size, uint64_t mtime, const char *data)
+{
+  // Sample words spread over the file, reading all of it would cost as
+  // much as recomputing the statistics
+  FileKey key{size, mtime, size};
+  uint64_t words = size / sizeof(uint64_t);
+  for (uint64_t i = 0; i < std::min(words, kChecksumSamples); ++i)
+  {
+    uint64_t word;
+    memcpy(&word, data + (i * (words / std::min(words, kChecksumSamples))) * sizeof(uint64_t), sizeof(word));
+    key.checksum = (key.checksum ^ word) * 0x100000001b3ull;
+  }
+  return key;
+}
+
+// Write zeros up to the next page boundary
+void RelationFile::pad(std::ostream &out, uint64_t &offset)
+{
+  static const char zeros[kPageSize] = {};
+  uint64_t padding = (kPageSize - offset % kPageSize) % kPageSize;
+  out.write(zeros, padding);
+  offset += padding;
+}
+
+// Whether a mapped file is in format v2
+bool RelationFile::isV2(const char *data, uint64_t length)
+{
+  return length >= NumHeaderWords * sizeof(uint64_t) &&
+         reinterpret_cast<const uint64_t *>(data)[Magic] == kMagic;
+}
+
+// Write the code chunks and the footer
+void RelationFile::writeMetadata(std::ostream &out, uint64_t &offset,
+                                 const std::vector<uint64_t> &column_offsets,
+                                 const std::vector<StoredColumn> &columns,
+                                 uint64_t &footer_offset,
+                                 uint64_t &footer_length)
+{
+  FooterWriter footer;
+  footer.put(column_offsets.size());
+  for (unsigned c = 0; c < column_offsets.size(); ++c)
+  {
+    auto stats = c < columns.size() ? columns[c].stats : nullptr;
+    auto encoded = c < columns.size() ? columns[c].encoded : nullptr;
+    footer.put(column_offsets[c]);
+    footer.put((stats ? HasStats : 0) | (encoded ? HasEncoding : 0));
+    if (stats)
+    {
+      footer.put(stats->size);
+      footer.put(stats->min);
+      footer.put(stats->max);
+      footer.put(stats->distinct);
+      footer.put(stats->sorted);
+      footer.put(stats->keys_checked);
+      footer.put(stats->unique);
+      footer.put(stats->zone_min);
+      footer.put(stats->zone_max);
+    }
+    if (encoded)
+    {
+      pad(out, offset);
+      footer.put(static_cast<uint64_t>(encoded->kind()));
+      footer.put(encoded->width());
+      footer.put(encoded->size());
+      footer.put(encoded->base());
+      footer.put(encoded->maxCode());
+      footer.put(encoded->dictionary());
+      footer.put(offset);
+      out.write(reinterpret_cast<const char *>(encoded->codeData()), encoded->codeBytes());
+      offset += encoded->codeBytes();
+    }
+  }
+
+  pad(out, offset);
+  footer_offset = offset;
+  footer_length = footer.words().size() * sizeof(uint64_t);
+  out.write(reinterpret_cast<const char *>(footer.words().data()), footer_length);
+  offset += footer_length;
+}
+
+// Parse the footer of mapped metadata
+bool RelationFile::readMetadata(const char *data, uint64_t length,
+                                uint64_t footer_offset, uint64_t footer_length,
+                                std::vector<uint64_t> &column_offsets,
+                                std::vector<StoredColumn> &columns)
+{
+  if (footer_offset % sizeof(uint64_t) || footer_offset > length ||
+      footer_length > length - footer_offset)
+    return false;
+  FooterReader footer(reinterpret_cast<const uint64_t *>(data + footer_offset),
+                      footer_length / sizeof(uint64_t));
+  uint64_t num_columns;
+  if (!footer.get(num_columns) || num_columns > footer_length)
+    return false;
+  column_offsets.resize(num_columns);
+  columns.assign(num_columns, StoredColumn());
+  for (unsigned c = 0; c < num_columns; ++c)
+  {
+    uint64_t flags;
+    if (!footer.get(column_offsets[c]) || !footer.get(flags))
+      return false;
+    if (flags & HasStats)
+    {
+      auto stats = std::make_shared<ColumnStats>();
+      uint64_t sorted, keys_checked, unique;
+      if (!footer.get(stats->size) || !footer.get(stats->min) ||
+          !footer.get(stats->max) || !footer.get(stats->distinct) ||
+          !footer.get(sorted) || !footer.get(keys_checked) ||
+          !footer.get(unique) || !footer.get(stats->zone_min) ||
+          !footer.get(stats->zone_max))
+        return false;
+      stats->sorted = sorted;
+      stats->keys_checked = keys_checked;
+      stats->unique = unique;
+      columns[c].stats = move(stats);
+    }
+    if (flags & HasEncoding)
+    {
+      uint64_t kind, width, size, base, max_code, codes_offset;
+      std::vector<uint64_t> dictionary;
+      if (!footer.get(kind) || !footer.get(width) || !footer.get(size) ||
+          !footer.get(base) || !footer.get(max_code) ||
+          !footer.get(dictionary) || !footer.get(codes_offset))
+        return false;
+      if ((width != 1 && width != 2 && width != 4) || codes_offset > length ||
+          size > (length - codes_offset) / width)
+        return false;
+      columns[c].encoded = EncodedColumn::fromStorage(
+          static_cast<EncodedColumn::Kind>(kind), width, size, base, max_code,
+          move(dictionary), reinterpret_cast<const uint8_t *>(data + codes_offset));
+    }
+  }
+  return true;
+}
+
+// Store a relation in format v2
+void RelationFile::store(const std::string &file_name, const Relation &relation,
+                         const std::vector<StoredColumn> &columns)
+{
+  std::ofstream out(file_name, std::ios::out | std::ios::binary);
+  uint64_t header[NumHeaderWords] = {kMagic, kVersion, relation.size(),
+                                     relation.columns().size(), 0, 0};
+  out.write(reinterpret_cast<const char *>(header), sizeof(header));
+  uint64_t offset = sizeof(header);
+
+  std::vector<uint64_t> column_offsets;
+  for (auto column : relation.columns())
+  {
+    pad(out, offset);
+    column_offsets.push_back(offset);
+    out.write(reinterpret_cast<const char *>(column), relation.size() * sizeof(uint64_t));
+    offset += relation.size() * sizeof(uint64_t);
+  }
+  writeMetadata(out, offset, column_offsets, columns, header[FooterOffset],
+                header[FooterLength]);
+
+  // Now that the footer is placed, complete the header
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(header), sizeof(header));
+}
+
+// Parse a mapped v2 file
+bool RelationFile::load(const char *data, uint64_t length, uint64_t &size,
+                        std::vector<uint64_t *> &columns,
+                        std::vector<StoredColumn> &stored)
+{
+  if (!isV2(data, length))
+    return false;
+  auto header = reinterpret_cast<const uint64_t *>(data);
+  if (header[Version] != kVersion)
+    return false;
+  std::vector<uint64_t> column_offsets;
+  if (!readMetadata(data, length, header[FooterOffset], header[FooterLength],
+                    column_offsets, stored) ||
+      column_offsets.size() != header[NumColumns])
+    return false;
+
+  size = header[Size];
+  columns.clear();
+  for (auto offset : column_offsets)
+  {
+    if (offset > length || size > (length - offset) / sizeof(uint64_t))
+      return false;
+    columns.push_back(reinterpret_cast<uint64_t *>(const_cast<char *>(data) + offset));
+  }
+  return true;
+}
+
+// Store the snapshot of a relation file
+bool RelationFile::storeSnapshot(const std::string &file_name,
+                                 const FileKey &key,
+                                 const std::vector<StoredColumn> &columns)
+{
+  auto name = snapshotName(file_name);
+  {
+    std::ofstream out(name + ".tmp", std::ios::out | std::ios::binary);
+    if (!out)
+      return false;
+    uint64_t header[NumSnapshotWords] = {kSnapshotMagic, kVersion, key.size,
+                                         key.mtime, key.checksum, 0, 0};
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    uint64_t offset = sizeof(header);
+    // The columns stay in the relation file
+    writeMetadata(out, offset, std::vector<uint64_t>(columns.size(), 0), columns,
+                  header[SnapFooterOffset], header[SnapFooterLength]);
+    out.seekp(0);
+    out.write(reinterpret_cast<const char *>(header), sizeof(header));
+    if (!out)
+      return false;
+  }
+  // Readers see the old snapshot or the complete new one
+  return std::rename((name + ".tmp").c_str(), name.c_str()) == 0;
+}
+
+// Parse a mapped snapshot
+bool RelationFile::loadSnapshot(const char *data, uint64_t length,
+                                const FileKey &key, uint64_t size,
+                                std::vector<StoredColumn> &columns)
+{
+  if (length < NumSnapshotWords * sizeof(uint64_t))
+    return false;
+  auto header = reinterpret_cast<const uint64_t *>(data);
+  if (header[SnapMagic] != kSnapshotMagic || header[SnapVersion] != kVersion ||
+      !(FileKey{header[SnapFileSize], header[SnapMtime], header[SnapChecksum]} == key))
+    return false;
+  std::vector<uint64_t> column_offsets;
+  std::vector<StoredColumn> stored;
+  if (!readMetadata(data, length, header[SnapFooterOffset],
+                    header[SnapFooterLength], column_offsets, stored) ||
+      stored.size() != columns.size())
+    return false;
+  for (auto &column : stored)
+  {
+    if ((column.stats && column.stats->size != size) ||
+        (column.encoded && column.encoded->size() != size))
+      return false;
+  }
+  columns = move(stored);
+  return true;
+}
@@ -0,0 +1,111 @@
+#include "governor.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/magic.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "runtime.h"
+
+// The governor of the process
+MemoryGovernor &MemoryGovernor::get()
+{
+  static MemoryGovernor governor(Runtime::get().memoryBudget(),
+                                 Runtime::get().queryMemoryBudget(),
+                                 Runtime::get().spillDir());
+  return governor;
+}
+
+// Reserve bytes of the budget
+bool MemoryGovernor::reserve(uint64_t bytes)
+{
+  auto reserved = reserved_.load(std::memory_order_relaxed);
+  do
+  {
+    if (bytes > budget_ - std::min(reserved, budget_))
+      return false;
+  } while (!reserved_.compare_exchange_weak(reserved, reserved + bytes,
+                                            std::memory_order_relaxed));
+  return true;
+}
+
+// Return reserved bytes
+void MemoryGovernor::release(uint64_t bytes)
+{
+  reserved_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+// Reserve bytes more
+bool Reservation::grow(uint64_t bytes, const Arena *arena)
+{
+  uint64_t query_bytes = arena ? arena->bytes() : bytes_;
+  if (query_bytes + bytes > governor_->queryBudget() || !governor_->reserve(bytes))
+    return false;
+  bytes_ += bytes;
+  return true;
+}
+
+// Return bytes that are no longer needed
+void Reservation::shrink(uint64_t bytes)
+{
+  bytes = std::min(bytes, bytes_);
+  governor_->release(bytes);
+  bytes_ -= bytes;
+}
+
+// Create an empty spill file
+SpillFile::SpillFile(const std::string &dir)
+{
+  std::string name = dir + "/db-spill-XXXXXX";
+  fd_ = mkstemp(&name[0]);
+  if (fd_ == -1)
+    throw SpillError("cannot create a spill file in " + dir + ": " + strerror(errno));
+  unlink(name.c_str());
+
+  // Spilling to memory only moves the problem, say so once
+  static std::once_flag checked;
+  std::call_once(checked, [&] {
+    struct statfs fs
+    {
+    };
+    if (fstatfs(fd_, &fs) == 0 && fs.f_type == TMPFS_MAGIC)
+      std::cerr << "spill directory " << dir << " is a tmpfs, set DB_SPILL_DIR to a directory on a disk" << std::endl;
+  });
+}
+
+// Unmaps and closes the file
+SpillFile::~SpillFile()
+{
+  if (data_)
+    munmap(data_, capacity_ * sizeof(uint64_t));
+  close(fd_);
+}
+
+// Resize to count values
+void SpillFile::resize(uint64_t count)
+{
+  if (count > capacity_)
+  {
+    // Grow geometrically, results are appended to partition by partition
+    uint64_t capacity = std::max(count, 2 * capacity_);
+    if (int error = posix_fallocate(fd_, 0, capacity * sizeof(uint64_t)))
+      throw SpillError("cannot grow a spill file to " + std::to_string(capacity * sizeof(uint64_t)) +
+                       " bytes: " + strerror(error));
+    void *mapping = data_ ? mremap(data_, capacity_ * sizeof(uint64_t),
+                                   capacity * sizeof(uint64_t), MREMAP_MAYMOVE)
+                          : mmap(nullptr, capacity * sizeof(uint64_t),
+                                 PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (mapping == MAP_FAILED)
+      throw SpillError("cannot map a spill file of " + std::to_string(capacity * sizeof(uint64_t)) +
+                       " bytes: " + strerror(errno));
+    data_ = static_cast<uint64_t *>(mapping);
+    capacity_ = capacity;
+  }
+  size_ = count;
+}
@@ -0,0 +1,34 @@
+#include "hashtable.h"
+
+#include <numeric>
+
+// Build over the tuples
+void JoinHashTable::build(const uint64_t *keys, const uint64_t *row_ids, uint64_t size,
+                          const std::vector<uint64_t *> &payload)
+{
+  // About one tuple per bucket, at least two buckets
+  unsigned bits = 1;
+  while ((uint64_t(1) << bits) < size)
+    ++bits;
+  shift_ = 64 - bits;
+  uint64_t num_buckets = uint64_t(1) << bits;
+
+  // Count the tuples of every bucket, then place them
+  offsets_.assign(num_buckets + 1, 0);
+  for (uint64_t i = 0; i < size; ++i)
+    ++offsets_[bucketOf(keys[row_ids ? row_ids[i] : i]) + 1];
+  std::partial_sum(offsets_.begin(), offsets_.end(), offsets_.begin());
+
+  stride_ = 2 + std::min<unsigned>(payload.size(), kMaxPayload);
+  entries_.resize(stride_ * size);
+  ArenaVector positions(offsets_.begin(), offsets_.end() - 1, offsets_.get_allocator());
+  for (uint64_t i = 0; i < size; ++i)
+  {
+    uint64_t row = row_ids ? row_ids[i] : i;
+    auto entry = &entries_[stride_ * positions[bucketOf(keys[row])]++];
+    entry[0] = keys[row];
+    entry[1] = row;
+    for (unsigned c = 2; c < stride_; ++c)
+      entry[c] = payload[c - 2][row];
+  }
+}
@@ -1,98 +1,152 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
-#include <vector>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <memory>
-#include <thread>
 #include <mutex>
-#include <condition_variable>
-#include <future>
-#include <functional>
-#include <stdexcept>
+#include <thread>
+#include <vector>
+
+/// Tracks the outstanding tasks of one fork-join section. The first
+/// exception a task throws is kept and rethrown by the join
+class TaskGroup {
+public:
+    /// Whether all tasks of the group finished
+    bool done() const { return pending_.load(std::memory_order_acquire) == 0; }
+private:
+    friend class ThreadPool;
+    std::atomic<uint64_t> pending_{0};
+    /// Set by the first task that threw, the others skip their work
+    std::atomic<bool> failed_{false};
+    /// What it threw (written once, read after the group is done)
+    std::exception_ptr error_;
+};
 
+/// Work-stealing fork-join pool. Every worker owns a deque: it pushes and
+/// pops at the back, idle workers steal from the front (where the largest
+/// ranges are). Threads outside of the pool push to a shared injection
+/// queue. Tasks are plain function pointers to callables owned by the
+/// forking frame, so forking does not allocate. Joining never blocks: the
+/// joining thread runs other tasks until its group is done.
+///
+/// Thieves prefer victims on their own NUMA node, so split ranges stay
+/// close to the memory the victim was working on.
 class ThreadPool {
 public:
-    ThreadPool(size_t);
-    template<class F, class... Args>
-    auto enqueue(F&& f, Args&&... args) 
-        -> std::future<typename std::result_of<F(Args...)>::type>;
+    /// worker i is pinned to cpus[i] if given, nodes[i] is its NUMA node
+    explicit ThreadPool(size_t threads, const std::vector<int> &cpus = {},
+                        const std::vector<int> &nodes = {});
     ~ThreadPool();
+
+    /// Fork: run f() as part of the group. f must outlive wait(group)
+    template<class F>
+    void spawn(TaskGroup &group, F &f);
+    /// Join: run tasks until all tasks of the group finished. Rethrows the
+    /// first exception of a task of the group
+    void wait(TaskGroup &group);
+
+    /// Run f(i) for all i in [begin, end). Ranges are split lazily (only
+    /// while the local deque is empty) down to grain; grain 0 picks one
+    /// from the range size and the number of workers. If f throws, the
+    /// remaining iterations may be skipped and the exception is rethrown
+    template<class F>
+    void parallel_for(uint64_t begin, uint64_t end, const F &f, uint64_t grain = 0);
+
+    /// The number of workers
+    size_t size() const { return workers.size(); }
+
 private:
+    struct Task {
+        /// Runs the callable on [begin, end)
+        void (*invoke)(const void *callable, uint64_t begin, uint64_t end);
+        const void *callable;
+        uint64_t begin, end;
+        /// Split ranges down to grain (0: not a range)
+        uint64_t grain;
+        TaskGroup *group;
+    };
+
+    class SpinLock {
+    public:
+        void lock() { while (flag.test_and_set(std::memory_order_acquire)) std::this_thread::yield(); }
+        void unlock() { flag.clear(std::memory_order_release); }
+    private:
+        std::atomic_flag flag = ATOMIC_FLAG_INIT;
+    };
+
+    struct alignas(64) WorkQueue {
+        SpinLock lock;
+        std::deque<Task> tasks;
+        /// size of tasks, readable without the lock
+        std::atomic<size_t> size{0};
+    };
+
+    template<class F>
+    static void invokeTask(const void *callable, uint64_t, uint64_t)
+    { (*static_cast<F *>(const_cast<void *>(callable)))(); }
+    template<class F>
+    static void invokeRange(const void *callable, uint64_t begin, uint64_t end)
+    {
+        auto &f = *static_cast<const F *>(callable);
+        for (uint64_t i = begin; i < end; ++i)
+            f(i);
+    }
+
+    /// The queue the calling thread pushes to
+    WorkQueue &localQueue();
+    /// Push a task of the calling thread
+    void push(const Task &task);
+    /// Pop a task from the back (own queue) or the front (stealing)
+    bool pop(WorkQueue &queue, Task &task, bool back);
+    /// Pop a local task or steal one
+    bool findTask(Task &task);
+    /// Run a task, splitting ranges on the way. An exception is kept in the
+    /// group of the task
+    void execute(Task &task);
+    /// Worker main loop
+    void run(size_t index);
+
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
-    // the task queue
-    std::queue< std::function<void()> > tasks;
-    
-    // synchronization
-    std::mutex queue_mutex;
+    // the cpus the workers are pinned to
+    std::vector<int> cpus;
+    // the NUMA nodes of the workers (empty: unknown)
+    std::vector<int> nodes;
+    // one deque per worker, the last one is the injection queue
+    std::unique_ptr<WorkQueue[]> queues;
+    // number of queued tasks
+    std::atomic<int64_t> queued{0};
+
+    // sleeping workers
+    std::mutex sleep_mutex;
     std::condition_variable condition;
-    bool stop;
+    std::atomic<int> sleeping{0};
+    std::atomic<bool> stop{false};
 };
- 
-// the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads)
-    :   stop(false)
-{
-    for(size_t i = 0;i<threads;++i)
-        workers.emplace_back(
-            [this]
-            {
-                for(;;)
-                {
-                    std::function<void()> task;
-
-                    {
-                        std::unique_lock<std::mutex> lock(this->queue_mutex);
-                        this->condition.wait(lock,
-                            [this]{ return this->stop || !this->tasks.empty(); });
-                        if(this->stop && this->tasks.empty())
-                            return;
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
-                    }
-
-                    task();
-                }
-            }
-        );
-}
 
-// add new work item to the pool
-template<class F, class... Args>
-auto ThreadPool::enqueue(F&& f, Args&&... args) 
-    -> std::future<typename std::result_of<F(Args...)>::type>
+template<class F>
+void ThreadPool::spawn(TaskGroup &group, F &f)
 {
-    using return_type = typename std::result_of<F(Args...)>::type;
-
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-        );
-        
-    std::future<return_type> res = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-
-        // don't allow enqueueing after stopping the pool
-        if(stop)
-            throw std::runtime_error("enqueue on stopped ThreadPool");
-
-        tasks.emplace([task](){ (*task)(); });
-    }
-    condition.notify_one();
-    return res;
+    push(Task{&invokeTask<F>, &f, 0, 0, 0, &group});
 }
 
-// the destructor joins all threads
-inline ThreadPool::~ThreadPool()
+template<class F>
+void ThreadPool::parallel_for(uint64_t begin, uint64_t end, const F &f, uint64_t grain)
 {
-    {
-        std::unique_lock<std::mutex> lock(queue_mutex);
-        stop = true;
-    }
-    condition.notify_all();
-    for(std::thread &worker: workers)
-        worker.join();
+    if (begin >= end)
+        return;
+    if (grain == 0)
+        grain = std::max<uint64_t>(1, (end - begin) / (8 * (size() + 1)));
+    TaskGroup group;
+    group.pending_.store(1, std::memory_order_relaxed);
+    Task task{&invokeRange<F>, &f, begin, end, grain, &group};
+    execute(task);
+    wait(group);
 }
 
 #endif
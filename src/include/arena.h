@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/// Region allocator for the intermediates of one query. Small blocks are
+/// bumped out of chunks and only freed when the arena dies; every thread
+/// bumps in a lane of its own, so workers of one query rarely share a
+/// lock. Chunks go back to a process-wide pool when the arena dies and are
+/// handed to the next query instead of being returned to the OS. Large
+/// blocks (column growth) are rounded up to a power of two; deallocate
+/// puts them on a process-wide free list of their size, where the next
+/// growing column of any query finds them. With NUMA placement on, chunks
+/// and large blocks are placed on the node of the thread that maps them and
+/// pooled by node: a worker gets memory of its own node back.
+class Arena {
+ public:
+  /// Size of a chunk
+  static constexpr uint64_t kChunkSize = 1 << 20;
+  /// Blocks above this size bypass the chunks
+  static constexpr uint64_t kLargeSize = kChunkSize / 4;
+  /// Chunks kept in the pool at most
+  static constexpr uint64_t kMaxPooledChunks = 256;
+  /// Bytes of large blocks kept on the free lists at most
+  static constexpr uint64_t kMaxPooledLargeBytes = kMaxPooledChunks * kChunkSize;
+
+  Arena() = default;
+  Arena(const Arena &other) = delete;
+  /// Returns the chunks to the pool
+  ~Arena();
+
+  /// Allocate bytes with the given alignment (at most alignof(max_align_t))
+  void *allocate(size_t bytes, size_t alignment);
+  /// Free a block (only large blocks are freed right away)
+  void deallocate(void *block, size_t bytes);
+
+  /// The number of bytes held in chunks and large blocks
+  uint64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+  /// The number of chunks in the pool
+  static size_t pooledChunks();
+  /// The number of large blocks on the free lists
+  static size_t pooledLargeBlocks();
+
+ private:
+  /// Lanes per arena
+  static constexpr unsigned kLanes = 16;
+
+  struct alignas(64) Lane {
+    /// Protects the members below
+    std::mutex mutex;
+    /// The free part of the current chunk
+    char *cursor = nullptr, *end = nullptr;
+    /// The chunks of the lane
+    std::vector<char *> chunks;
+  };
+
+  /// The lanes, picked by thread
+  Lane lanes_[kLanes];
+  /// The bytes held
+  std::atomic<uint64_t> bytes_{0};
+};
+
+/// Allocator of standard containers backed by an arena, or by the heap if
+/// the arena is nullptr (results that outlive the query)
+template <typename T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  /// The constructor
+  ArenaAllocator(Arena *arena = nullptr) noexcept : arena_(arena) {}
+  /// Rebinding constructor
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) noexcept : arena_(other.arena()) {}
+
+  T *allocate(size_t n)
+  {
+    if (!arena_)
+      return std::allocator<T>().allocate(n);
+    return static_cast<T *>(arena_->allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *block, size_t n)
+  {
+    if (!arena_)
+      std::allocator<T>().deallocate(block, n);
+    else
+      arena_->deallocate(block, n * sizeof(T));
+  }
+
+  /// Default-initialize, so resized columns are not zeroed before they are
+  /// written
+  template <typename U>
+  void construct(U *p) noexcept(std::is_nothrow_default_constructible<U>::value)
+  {
+    ::new (static_cast<void *>(p)) U;
+  }
+  template <typename U, typename... Args>
+  void construct(U *p, Args &&...args)
+  {
+    ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+  }
+
+  /// The arena, nullptr for the heap
+  Arena *arena() const { return arena_; }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U> &other) const { return arena_ == other.arena(); }
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U> &other) const { return arena_ != other.arena(); }
+
+ private:
+  /// The arena
+  Arena *arena_;
+};
+
+/// A column of intermediate results
+using ArenaVector = std::vector<uint64_t, ArenaAllocator<uint64_t>>;
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "hashtable.h"
+
+/// Hash table from join key to tuple id of a (filtered) base relation (on
+/// the heap, it outlives the queries)
+using BuildTable = JoinHashTable;
+
+/// State shared by the queries of one batch. Released once the batch is done
+class BatchContext {
+ public:
+  /// Key of the build side of a scan (by signature) on a key column
+  static std::string buildKey(const std::string &scan_signature,
+                              unsigned col_id);
+
+  /// Announce that a query of the batch joins on the build side
+  void expectBuild(const std::string &key);
+  /// Whether several queries of the batch join on the build side
+  bool isShared(const std::string &key);
+  /// Get the table of a build side. The first caller builds it, concurrent
+  /// callers wait for it
+  std::shared_ptr<const BuildTable> getOrBuild(
+      const std::string &key,
+      const std::function<std::shared_ptr<const BuildTable>()> &build);
+
+  /// Release all shared state
+  void clear();
+
+ private:
+  /// Protects all members below
+  std::mutex mutex_;
+  /// Number of joins per build side
+  std::unordered_map<std::string, unsigned> expected_builds_;
+  /// Tables that are built or being built
+  std::unordered_map<std::string,
+                     std::shared_future<std::shared_ptr<const BuildTable>>>
+      tables_;
+};
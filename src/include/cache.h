@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// A materialized subplan result that can be reused across queries
+struct CachedResult {
+  /// Surviving row ids of a filtered scan
+  std::vector<uint64_t> row_ids;
+  /// Materialized result columns (e.g. of a join of two filtered inputs)
+  std::vector<std::vector<uint64_t>> columns;
+  /// The number of tuples in columns
+  uint64_t size = 0;
+  /// Output line of a whole query
+  std::string checksums;
+
+  /// The memory footprint of the result
+  uint64_t bytes() const;
+};
+
+/// Memory-bounded cache of subplan results keyed by normalized expression.
+/// Eviction is cost-aware (GreedyDual-Size): the entry with the smallest
+/// recompute cost per byte goes first, and an inflation value ages entries
+/// that have not been hit for a while. Relations only change by appends,
+/// which bump their version: keys include it, so stale entries are never
+/// hit again and age out.
+class ResultCache {
+ public:
+  /// Default capacity in bytes
+  static constexpr uint64_t kDefaultCapacity = 2ull << 30;
+
+  /// The constructor
+  explicit ResultCache(uint64_t capacity = kDefaultCapacity)
+      : capacity_(capacity) {}
+
+  /// Look up a result, nullptr if it is not cached
+  std::shared_ptr<const CachedResult> lookup(const std::string &key);
+  /// Insert a result that took cost microseconds to compute
+  void insert(const std::string &key,
+              std::shared_ptr<const CachedResult> result,
+              double cost);
+  /// Drop all entries
+  void clear();
+
+  /// The capacity in bytes
+  uint64_t capacity() const { return capacity_; }
+  /// The number of cached bytes
+  uint64_t usedBytes();
+  /// The number of cached entries
+  size_t size();
+
+ private:
+  using PriorityIndex = std::multimap<double, std::string>;
+
+  struct Entry {
+    /// The cached result
+    std::shared_ptr<const CachedResult> result;
+    /// Recompute cost in microseconds
+    double cost;
+    /// Footprint in bytes
+    uint64_t bytes;
+    /// Position in the eviction order
+    PriorityIndex::iterator position;
+  };
+
+  /// Priority of an entry given the current inflation
+  double priority(const Entry &entry) const;
+  /// Evict entries until bytes fit (mutex_ must be held)
+  void makeRoom(uint64_t bytes);
+
+  /// Protects all members below
+  std::mutex mutex_;
+  /// Capacity in bytes
+  uint64_t capacity_;
+  /// Cached bytes
+  uint64_t used_ = 0;
+  /// Priority of the last evicted entry
+  double inflation_ = 0;
+  /// The entries
+  std::unordered_map<std::string, Entry> entries_;
+  /// Entries ordered by priority
+  PriorityIndex eviction_order_;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// A column packed into 1, 2 or 4 byte codes, either as the offset from the
+/// minimum (frame of reference) or as the index into a sorted dictionary.
+/// Both encodings preserve the order of the values, so a comparison with a
+/// constant becomes a range check on the codes
+class EncodedColumn {
+ public:
+  enum class Kind : uint8_t { FrameOfReference, Dictionary };
+
+  /// Largest dictionary we build
+  static constexpr uint64_t kMaxDictionary = 1 << 16;
+
+  /// Encode a column, nullptr if no encoding is narrower than 8 bytes
+  static std::shared_ptr<const EncodedColumn> encode(const uint64_t *values,
+                                                     uint64_t size,
+                                                     uint64_t min,
+                                                     uint64_t max,
+                                                     uint64_t distinct);
+
+  /// The encoding
+  Kind kind() const { return kind_; }
+  /// Bytes per code
+  unsigned width() const { return width_; }
+  /// The number of values
+  uint64_t size() const { return size_; }
+  /// The memory footprint
+  uint64_t bytes() const { return codeBytes() + dictionary_.size() * sizeof(uint64_t); }
+
+  /// Frame of reference: the minimum
+  uint64_t base() const { return base_; }
+  /// Frame of reference: the largest code
+  uint64_t maxCode() const { return max_code_; }
+  /// Dictionary: the distinct values in ascending order
+  const std::vector<uint64_t> &dictionary() const { return dictionary_; }
+  /// The packed codes
+  const uint8_t *codeData() const { return code_data_; }
+  /// The size of the packed codes in bytes
+  uint64_t codeBytes() const { return size_ * width_; }
+
+  /// Wrap stored codes (e.g. of a mapped file) without copying them. The
+  /// codes must outlive the column
+  static std::shared_ptr<const EncodedColumn> fromStorage(
+      Kind kind, unsigned width, uint64_t size, uint64_t base,
+      uint64_t max_code, std::vector<uint64_t> dictionary,
+      const uint8_t *code_data);
+
+  /// Translate "value <comparison> constant" into the codes [lo, hi].
+  /// False if no value qualifies
+  bool codeRange(char comparison, uint64_t constant, uint32_t &lo,
+                 uint32_t &hi) const;
+  /// Append the rows in [begin, end) whose codes are in [lo, hi]
+  void select(uint64_t begin, uint64_t end, uint32_t lo, uint32_t hi,
+              std::vector<uint64_t> &row_ids) const;
+  /// Keep the rows of row_ids (from index first on) whose codes are in
+  /// [lo, hi]
+  void refine(uint32_t lo, uint32_t hi, std::vector<uint64_t> &row_ids,
+              uint64_t first) const;
+  /// Decode a value
+  uint64_t get(uint64_t row_id) const;
+  /// Decode the values of count rows
+  void gather(const uint64_t *row_ids, uint64_t count, uint64_t *out) const;
+
+ private:
+  /// The code of a row
+  template <typename Code>
+  const Code *codes() const { return reinterpret_cast<const Code *>(code_data_); }
+  /// Dispatch on the code width
+  template <typename F>
+  void withCodes(const F &f) const;
+  /// The value of a code
+  uint64_t decode(uint32_t code) const
+  {
+    return kind_ == Kind::Dictionary ? dictionary_[code] : base_ + code;
+  }
+
+  /// The encoding
+  Kind kind_;
+  /// Bytes per code
+  unsigned width_;
+  /// The number of values
+  uint64_t size_;
+  /// Frame of reference: the minimum
+  uint64_t base_ = 0;
+  /// Frame of reference: the largest code
+  uint64_t max_code_ = 0;
+  /// Dictionary: the distinct values in ascending order
+  std::vector<uint64_t> dictionary_;
+  /// The codes (points into codes_ or into stored codes)
+  const uint8_t *code_data_ = nullptr;
+  /// The codes if they are owned
+  std::vector<uint8_t> codes_;
+};
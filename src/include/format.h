@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "compression.h"
+#include "stats.h"
+
+class Relation;
+
+/// Precomputed metadata of a column as stored in a file
+struct StoredColumn {
+  /// The statistics, nullptr if not stored
+  std::shared_ptr<const ColumnStats> stats;
+  /// The compressed copy, nullptr if not stored
+  std::shared_ptr<const EncodedColumn> encoded;
+};
+
+/// Identifies the contents of a relation file
+struct FileKey {
+  /// The file size
+  uint64_t size = 0;
+  /// The modification time in nanoseconds
+  uint64_t mtime = 0;
+  /// Hash of sampled words of the file
+  uint64_t checksum = 0;
+
+  /// The key of a mapped file
+  static FileKey of(uint64_t size, uint64_t mtime, const char *data);
+  bool operator==(const FileKey &other) const
+  {
+    return size == other.size && mtime == other.mtime && checksum == other.checksum;
+  }
+};
+
+/// The relation file format v2:
+///   header page    magic | version | size | #columns | footer offset |
+///                  footer length
+///   column chunks  one per column, each starting at a page boundary
+///   code chunks    one per encoded column, each starting at a page boundary
+///   footer         per column: chunk offset, statistics and encoding
+/// A v1 file (size | #columns | columns) starts with its tuple count, which
+/// never equals the magic.
+/// A snapshot is a sidecar file (<relation>.meta) holding the metadata
+/// part of v2 (code chunks and footer) for a relation file of any format,
+/// behind a header with the key of the relation file it was derived from
+class RelationFile {
+ public:
+  /// First word of a v2 file
+  static constexpr uint64_t kMagic = 0x0032762d4c455244ull; // "DREL-v2"
+  /// The version
+  static constexpr uint64_t kVersion = 2;
+  /// Chunk alignment
+  static constexpr uint64_t kPageSize = 4096;
+
+  /// Whether a mapped file is in format v2
+  static bool isV2(const char *data, uint64_t length);
+  /// Store a relation in format v2. columns may be empty or lack statistics
+  /// and encodings
+  static void store(const std::string &file_name, const Relation &relation,
+                    const std::vector<StoredColumn> &columns);
+  /// Parse a mapped v2 file. The column pointers and the stored codes point
+  /// into data. False if the file is damaged
+  static bool load(const char *data, uint64_t length, uint64_t &size,
+                   std::vector<uint64_t *> &columns,
+                   std::vector<StoredColumn> &stored);
+
+  /// The name of the snapshot of a relation file
+  static std::string snapshotName(const std::string &file_name)
+  {
+    return file_name + ".meta";
+  }
+  /// Store the snapshot of a relation file. False if it cannot be written
+  static bool storeSnapshot(const std::string &file_name, const FileKey &key,
+                            const std::vector<StoredColumn> &columns);
+  /// Parse a mapped snapshot. The stored codes point into data. False if it
+  /// is damaged or was derived from another version of the relation
+  static bool loadSnapshot(const char *data, uint64_t length,
+                           const FileKey &key, uint64_t size,
+                           std::vector<StoredColumn> &columns);
+
+  /// Write the code chunks and the footer at offset (page aligned), and
+  /// advance offset past them. column_offsets are recorded in the footer
+  static void writeMetadata(std::ostream &out, uint64_t &offset,
+                            const std::vector<uint64_t> &column_offsets,
+                            const std::vector<StoredColumn> &columns,
+                            uint64_t &footer_offset, uint64_t &footer_length);
+  /// Parse the footer of mapped metadata. False if it is damaged
+  static bool readMetadata(const char *data, uint64_t length,
+                           uint64_t footer_offset, uint64_t footer_length,
+                           std::vector<uint64_t> &column_offsets,
+                           std::vector<StoredColumn> &columns);
+
+  /// Write zeros up to the next page boundary
+  static void pad(std::ostream &out, uint64_t &offset);
+};
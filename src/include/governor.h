@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+class Arena;
+
+/// Budget for the large intermediates of the running queries. Operators
+/// reserve memory before they allocate a hash table or a result; when a
+/// reservation does not fit into the budget of the process or of the query,
+/// the operator degrades to spilling instead of growing the process until
+/// it is killed
+class MemoryGovernor {
+ public:
+  /// The governor of the process (sized by the runtime)
+  static MemoryGovernor &get();
+
+  /// The constructor
+  MemoryGovernor(uint64_t budget, uint64_t query_budget, std::string spill_dir)
+      : budget_(budget), query_budget_(query_budget), spill_dir_(move(spill_dir)) {}
+  MemoryGovernor(const MemoryGovernor &other) = delete;
+
+  /// Reserve bytes of the process budget, false (and nothing reserved) if
+  /// they do not fit
+  bool reserve(uint64_t bytes);
+  /// Return reserved bytes
+  void release(uint64_t bytes);
+
+  /// The budget of the process
+  uint64_t budget() const { return budget_; }
+  /// The budget of a single query
+  uint64_t queryBudget() const { return query_budget_; }
+  /// The bytes reserved right now
+  uint64_t reserved() const { return reserved_.load(std::memory_order_relaxed); }
+  /// The directory of spill files
+  const std::string &spillDir() const { return spill_dir_; }
+
+  /// Count an operator that spilled
+  void countSpill() { spills_.fetch_add(1, std::memory_order_relaxed); }
+  /// The number of operators that spilled
+  uint64_t spills() const { return spills_.load(std::memory_order_relaxed); }
+
+ private:
+  /// The budget of the process
+  const uint64_t budget_;
+  /// The budget of a single query
+  const uint64_t query_budget_;
+  /// The directory of spill files
+  const std::string spill_dir_;
+  /// The bytes reserved
+  std::atomic<uint64_t> reserved_{0};
+  /// The number of operators that spilled
+  std::atomic<uint64_t> spills_{0};
+};
+
+/// Memory an operator reserved from a governor, returned by the destructor
+class Reservation {
+ public:
+  /// The constructor
+  explicit Reservation(MemoryGovernor &governor) : governor_(&governor) {}
+  Reservation(const Reservation &other) = delete;
+  Reservation &operator=(const Reservation &other) = delete;
+  /// Returns the reserved bytes
+  ~Reservation() { governor_->release(bytes_); }
+
+  /// Reserve bytes more. False (and nothing reserved) if they do not fit
+  /// into the process budget, or if the query would exceed its budget with
+  /// what its arena already holds
+  bool grow(uint64_t bytes, const Arena *arena);
+  /// Return bytes that are no longer needed
+  void shrink(uint64_t bytes);
+  /// The reserved bytes
+  uint64_t bytes() const { return bytes_; }
+
+ private:
+  /// The governor
+  MemoryGovernor *governor_;
+  /// The reserved bytes
+  uint64_t bytes_ = 0;
+};
+
+/// A spill file could not be created or grown (e.g. the disk is full).
+/// Fails the query that spilled, the others go on
+class SpillError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
+/// An array of values in a temporary file mapped into memory. Its pages are
+/// backed by the file, so under memory pressure the kernel writes them out
+/// instead of the process dying. The file is unlinked right away and goes
+/// away with the mapping. The directory has to be on a disk: on a tmpfs the
+/// pages take the memory spilling should save
+class SpillFile {
+ public:
+  /// Create an empty spill file in the given directory, throws SpillError
+  /// if it cannot
+  explicit SpillFile(const std::string &dir);
+  SpillFile(const SpillFile &other) = delete;
+  /// Unmaps and closes the file
+  ~SpillFile();
+
+  /// Resize to count values, the first values are kept. The disk space is
+  /// allocated up front (writing to a mapping beyond a full disk would kill
+  /// the process), throws SpillError if there is none
+  void resize(uint64_t count);
+  /// The values
+  uint64_t *data() const { return data_; }
+  /// The number of values
+  uint64_t size() const { return size_; }
+
+ private:
+  /// The file descriptor
+  int fd_;
+  /// The mapping (nullptr while empty)
+  uint64_t *data_ = nullptr;
+  /// The number of values
+  uint64_t size_ = 0;
+  /// The number of values the mapping has room for
+  uint64_t capacity_ = 0;
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "arena.h"
+
+/// Hash table of a join build side, from key to tuple id. The tuples of a
+/// bucket are stored next to each other (bucket offsets, then (key, tuple
+/// id) entries), so a lookup is two dependent accesses. Probes run in
+/// groups: the buckets of a group of keys are prefetched before the first
+/// one is resolved, which overlaps the cache misses of large build sides.
+/// Entries may also carry payload columns of the build side row-wise, so a
+/// match is read from the entry instead of from every column
+class JoinHashTable {
+ public:
+  /// Keys probed per group
+  static constexpr unsigned kGroupSize = 16;
+  /// Payload columns an entry carries at most (an entry takes at most 64
+  /// bytes, two cache lines at worst since entries are not padded)
+  static constexpr unsigned kMaxPayload = 6;
+
+  /// The constructor (nullptr: on the heap)
+  explicit JoinHashTable(Arena *arena = nullptr)
+      : offsets_(ArenaAllocator<uint64_t>(arena)), entries_(ArenaAllocator<uint64_t>(arena)) {}
+
+  /// Build over the tuples row_ids[0, size) with keys keys[row_id], or over
+  /// the tuples [0, size) if row_ids is nullptr. Entries carry the values
+  /// of the payload columns (at most kMaxPayload). Lookups need a built table
+  void build(const uint64_t *keys, const uint64_t *row_ids, uint64_t size,
+             const std::vector<uint64_t *> &payload = {});
+
+  /// The number of tuples
+  uint64_t size() const { return entries_.size() / stride_; }
+  /// The tuple id of an entry
+  static uint64_t tupleId(const uint64_t *entry) { return entry[1]; }
+  /// The payload of an entry
+  static const uint64_t *payload(const uint64_t *entry) { return entry + 2; }
+  /// The number of tuples with the key
+  uint64_t count(uint64_t key) const
+  {
+    uint64_t matches = 0;
+    auto bucket = bucketOf(key);
+    for (uint64_t e = offsets_[bucket]; e < offsets_[bucket + 1]; ++e)
+      matches += entries_[stride_ * e] == key;
+    return matches;
+  }
+
+  /// Probe with the tuples row_ids[begin, end) (or [begin, end) if row_ids
+  /// is nullptr) with keys keys[row_id], calling emit(entry, probe_id) for
+  /// every match
+  template <typename Emit>
+  void probe(const uint64_t *keys, const uint64_t *row_ids, uint64_t begin,
+             uint64_t end, const Emit &emit) const
+  {
+    uint64_t rows[kGroupSize], buckets[kGroupSize];
+    for (uint64_t base = begin; base < end; base += kGroupSize)
+    {
+      unsigned group = std::min<uint64_t>(kGroupSize, end - base);
+      // Stage 1: hash the keys, prefetch the bucket offsets
+      for (unsigned g = 0; g < group; ++g)
+      {
+        rows[g] = row_ids ? row_ids[base + g] : base + g;
+        buckets[g] = bucketOf(keys[rows[g]]);
+        __builtin_prefetch(&offsets_[buckets[g]]);
+      }
+      // Stage 2: prefetch the tuples of the buckets
+      for (unsigned g = 0; g < group; ++g)
+        __builtin_prefetch(entries_.data() + stride_ * offsets_[buckets[g]]);
+      // Stage 3: resolve the matches
+      for (unsigned g = 0; g < group; ++g)
+      {
+        uint64_t key = keys[rows[g]];
+        auto entry = entries_.data() + stride_ * offsets_[buckets[g]];
+        auto last = entries_.data() + stride_ * offsets_[buckets[g] + 1];
+        for (; entry != last; entry += stride_)
+        {
+          if (*entry == key)
+            emit(entry, rows[g]);
+        }
+      }
+    }
+  }
+
+ private:
+  /// The bucket of a key. The key is fully mixed: the partitions of a join
+  /// already share the high bits of a multiplicative hash
+  uint64_t bucketOf(uint64_t key) const
+  {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return key >> shift_;
+  }
+
+  /// First tuple of every bucket (and the end)
+  ArenaVector offsets_;
+  /// (key, tuple id, payload...) entries ordered by bucket
+  ArenaVector entries_;
+  /// Values per entry
+  unsigned stride_ = 2;
+  /// 64 - log2 of the number of buckets
+  unsigned shift_ = 63;
+};
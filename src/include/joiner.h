@@ -1,43 +1,173 @@
 #pragma once
 
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <cstdint>
 #include <set>
+#include <string>
 
+#include "batch.h"
+#include "cache.h"
 #include "operators.h"
 #include "relation.h"
 #include "parser.h"
+#include "prep.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "ThreadPool.h"
 
 class Joiner
 {
 private:
+  /// A relation being loaded on the pool
+  struct RelationLoad
+  {
+    /// The file to load
+    std::string file_name;
+    /// The loaded relation
+    std::unique_ptr<Relation> relation;
+    /// Load the relation (runs on a pool worker)
+    void operator()() { relation = std::make_unique<Relation>(file_name.c_str()); }
+  };
+
   /// The relations that might be joined
   std::vector<Relation> relations_;
+  /// Relations still being loaded, in registration order
+  std::deque<RelationLoad> loads_;
+  /// The outstanding loads
+  TaskGroup loading_;
+  /// Column statistics, filled during the preparation phase
+  Statistics stats_;
+  /// Orders appends and the publication of statistics
+  std::mutex stats_mutex_;
+  /// Protects merges_ and merging_
+  std::mutex merge_mutex_;
+  /// Merged columns waiting to be installed, by relation
+  std::vector<std::unique_ptr<MergedColumns>> merges_;
+  /// Whether a merge of a relation is queued or waiting to be installed
+  std::vector<bool> merging_;
+  /// Runs the preparation work (destroyed before what its tasks use)
+  PrepScheduler prep_;
+  /// Materialized subplans and query results shared across batches
+  ResultCache cache_;
+  /// Build sides shared by the queries of the current batch
+  BatchContext batch_;
+  /// Runs the queries of a batch on a bounded number of workers
+  QueryScheduler scheduler_;
 
   // std::vector<FilterInfo> filters_copy;
 
 public:
   std::vector<std::string> aggResults;
-  std::vector<std::thread> threads;
-  /// Add relation
+  /// The destructor
+  ~Joiner();
+  /// Add relation, it is loaded in the background until finishLoading()
   void addRelation(const char *file_name);
   void addRelation(Relation &&relation);
+  /// Wait for all relations added so far
+  void finishLoading();
+  /// Append tuples (one vector of equal length per column) to a relation.
+  /// They are seen by the next batch and merged into the main columns in
+  /// the background. Not concurrent with a batch
+  void append(RelationId rel_id, const std::vector<std::vector<uint64_t>> &columns);
+  /// Start the preparation work (warm-up, statistics, compression, keys). It
+  /// gets the pool for budget, then continues in the background
+  void startPreparation(std::chrono::milliseconds budget);
+  /// Wait for all preparation work
+  void finishPreparation() { prep_.wait(); }
+  /// Keep the prepared metadata of the relations in snapshot files, so the
+  /// next start can skip the preparation work
+  void storeSnapshots();
+  /// The column statistics known so far
+  const Statistics &statistics() const { return stats_; }
   static void appendHistogram(std::vector<std::vector<int>> histogram);
   double estimateSelectivity(std::vector<int> histogram, uint64_t minVal, uint64_t maxVal, int bucketWidth, FilterInfo::Comparison op, uint64_t val, int nTups);
   /// Get relation
   const Relation &getRelation(unsigned relation_id);
   /// Joins a given set of relations
+  std::string join(QueryInfo &query);
+  /// Joins the query of a line and stores the result at index ("ERROR" if
+  /// it could not spill)
   std::string join(std::string line, int index);
 
+  /// Schedules the query of a line, its result is stored at index
   void asyncJoin(std::string line, int index);
+  /// Executes a batch of queries and returns their results in order
+  std::vector<std::string> runBatch(const std::vector<std::string> &lines);
+
+  /// Share the filter scans of a batch: all pending filters of a relation
+  /// are evaluated in a single pass before the queries run. Also registers
+  /// the build sides that several queries join against
+  void prepareBatch(const std::vector<std::string> &lines);
+  /// Release the state shared by the queries of a batch
+  void finishBatch();
 
   const std::vector<Relation> &relations() const { return relations_; }
 
+  /// Whether a join of inputs with the estimated sizes stays factorized: the
+  /// result grows by FactorizedJoin::kMinExpansion, estimated from the
+  /// distinct counts of both keys (never without them)
+  bool factorizes(double left_rows, double right_rows, const PredicateInfo &p_info);
+
 private:
+  /// Drop the joins that only check that a key exists: the query reads
+  /// nothing else of the key side, the key is unique and every value of the
+  /// other side occurs in it (a verified inclusion dependency)
+  void eliminateJoins(QueryInfo &query);
+  /// Whether a join with a key only checks that the values of a column
+  /// exist as keys, queueing the verification of the inclusion if unknown
+  bool checksKeyOnly(QueryInfo &query, const SelectInfo &column, const SelectInfo &key);
+  /// Verify that every value of a column occurs in a key column (on the
+  /// preparation scheduler)
+  void verifyInclusion(const SelectInfo &column, const SelectInfo &key);
+
   /// Add scan to query
   std::shared_ptr<Operator> addScan(std::set<unsigned> &used_relations,
                                     const SelectInfo &info,
-                                    QueryInfo &query);
+                                    QueryInfo &query, Arena &arena);
+
+  /// Declare the join keys of a binding that are sorted in its relation
+  void addSortedKeys(Operator &scan, unsigned binding, QueryInfo &query);
+  /// Hand the zone maps of the filtered columns to a filter scan
+  void addZoneMaps(FilterScan &scan, RelationId rel_id, const std::vector<FilterInfo> &filters);
+
+  /// Add join to query: another input of a factorized result joined on its
+  /// key, a factorized join if factorizes(), a merge join if the inputs are sorted on
+  /// their keys or both are estimated beyond MergeJoin::kMinSortSize tuples
+  std::shared_ptr<Operator> addJoin(std::shared_ptr<Operator> &&left,
+                                    std::shared_ptr<Operator> &&right,
+                                    const PredicateInfo &p_info,
+                                    Arena &arena, double left_rows,
+                                    double right_rows);
+
+  /// Queue the preparation work that needs the statistics of a column
+  void addDerivedWork(RelationId rel_id, unsigned col_id,
+                      std::shared_ptr<const ColumnStats> stats);
+  /// Compute the statistics of a join key the preparation did not get to
+  /// yet, unless a preparation task is computing them already
+  void requireStats(const SelectInfo &info);
+  /// Publish statistics of the first rows of a column, extended to the
+  /// tuples appended since
+  void publishStats(RelationId rel_id, unsigned col_id,
+                    std::shared_ptr<const ColumnStats> stats);
+  /// Queue the merge of the delta of a relation, unless one is queued
+  void queueMerge(RelationId rel_id);
+  /// Install the finished merges (between batches, once no preparation
+  /// work reads the old columns)
+  void installMerges();
+
+  /// Estimate the tuples of a binding that pass its filters
+  double estimateCardinality(QueryInfo &query, unsigned binding);
+  /// Estimate the result size of a join from the distinct counts of its keys
+  double estimateJoinSize(double left_rows, double right_rows, const PredicateInfo &p_info);
+  /// Estimate the cost of a query (roughly the tuples it has to touch)
+  double estimateCost(QueryInfo &query);
+  /// Estimate the peak memory of the intermediates of a query (admission
+  /// control). Joins are estimated in plan order with the distinct counts
+  /// of their keys, where the preparation phase got to them
+  uint64_t estimateMemory(QueryInfo &query);
 
   double isFilterScan(const SelectInfo &info, QueryInfo &query);
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <memory>
 #include <stdexcept>
@@ -10,8 +11,13 @@
 #include <set>
 #include <thread>
 
+#include "arena.h"
 #include "relation.h"
 #include "parser.h"
+#include "cache.h"
+#include "governor.h"
+#include "batch.h"
+#include "scheduler.h"
 
 namespace std
 {
@@ -30,25 +36,39 @@ struct hash<SelectInfo>
 /// Operators materialize their entire result
 class Operator {
  protected:
-  int NUM_THREADS = 30;
+  int NUM_THREADS = QueryScheduler::parallelism();
   /// Mapping from select info to data
   std::unordered_map<SelectInfo, unsigned> select_to_result_col_id_;
   /// The materialized results
   std::vector<uint64_t *> result_columns_;
   /// The tmp results
-  std::vector<std::vector<uint64_t>> tmp_results_;
-
-  // The temp temp results lol
-  std::vector<std::vector<std::vector<uint64_t>>> inting_tmp_results_;
-
-  // std::vector<std::vector<uint64_t>> left_inting_tmp_results_;
-  // std::vector<std::vector<uint64_t>> right_inting_tmp_results_;
-
-  // result sizes gathered by each thread
-  std::vector<uint64_t> inting_result_sizes_;
+  std::vector<ArenaVector> tmp_results_;
+  /// Result columns in spill files, used instead of tmp_results_ if there
+  /// are any
+  std::vector<std::shared_ptr<SpillFile>> spilled_results_;
 
   /// The result size
   uint64_t result_size_ = 0;
+  /// Columns the result is sorted on (ascending)
+  std::vector<SelectInfo> sorted_on_;
+
+  /// Cache for materialized subplans (optional)
+  ResultCache *cache_ = nullptr;
+  /// Arena of the query for intermediates (nullptr: heap)
+  Arena *arena_ = nullptr;
+  /// Governor of the memory of large intermediates
+  MemoryGovernor *governor_ = &MemoryGovernor::get();
+  /// Memory reserved by the operator (created on first use)
+  std::shared_ptr<Reservation> reservation_;
+
+  /// An empty intermediate column in the arena
+  ArenaVector newColumn() const { return ArenaVector(ArenaAllocator<uint64_t>(arena_)); }
+  /// The reservation of the operator
+  Reservation &reservation();
+  /// Room for size results in every result column. The columns stay in the
+  /// arena if the reservation can grow by their size, they are spilled to
+  /// files otherwise
+  std::vector<uint64_t *> allocateResults(uint64_t size);
 
 public:
   /// The destructor
@@ -67,10 +87,28 @@ public:
   virtual void run() = 0;
   /// Get  materialized results
   virtual std::vector<uint64_t *> getResults();
-
-  void mergeIntingTmpResults(std::vector<uint64_t *> result_vector, int col);
+  /// The sum of a column over the results
+  virtual uint64_t sum(const SelectInfo &info);
 
   uint64_t result_size() const { return result_size_; }
+
+  /// Whether the result is sorted (ascending) on a column
+  virtual bool sortedOn(const SelectInfo &info) const
+  {
+    return std::any_of(sorted_on_.begin(), sorted_on_.end(), [&](const SelectInfo &sorted) {
+      return sorted.binding == info.binding && sorted.col_id == info.col_id;
+    });
+  }
+  /// Declare that the result is sorted on a column. Declared when the plan
+  /// is built, so that the planner can rely on it
+  void addSortedOn(const SelectInfo &info) { sorted_on_.push_back(info); }
+
+  /// Reuse subplan results through the given cache
+  void setCache(ResultCache *cache) { cache_ = cache; }
+  /// Allocate intermediates in the given arena (it must outlive the operator)
+  void setArena(Arena *arena) { arena_ = arena; }
+  /// Reserve memory from the given governor (it must outlive the operator)
+  void setGovernor(MemoryGovernor *governor) { governor_ = governor; }
 };
 
 class Scan : public Operator
@@ -80,6 +118,10 @@ protected:
   const Relation &relation_;
   /// The name of the relation in the query
   unsigned relation_binding_;
+  /// The column ids of the results
+  std::vector<unsigned> col_ids_;
+  /// The delta the results include (it owns their contiguous columns)
+  std::shared_ptr<const DeltaStore> delta_;
 
 public:
   /// The constructor
@@ -91,27 +133,45 @@ public:
   void run() override;
   /// Get  materialized results
   virtual std::vector<uint64_t *> getResults() override;
+
+  /// Normalized description of the scanned input, used as cache key
+  virtual std::string signature() const;
 };
 
 class FilterScan : public Scan
 {
+  friend class SharedScan;
+
 private:
   /// The filter info
   std::vector<FilterInfo> filters_;
   /// The input data
   std::vector<uint64_t *> input_data_;
+  /// The column ids of the input data
+  std::vector<unsigned> input_col_ids_;
+  /// The statistics with the zone maps of filtered columns, by column id
+  std::unordered_map<unsigned, std::shared_ptr<const ColumnStats>> zone_maps_;
 
 private:
-  /// Apply filter
-  bool applyFilter(uint64_t id, FilterInfo &f);
-  /// Copy tuple to result
-  void copy2Result(uint64_t id);
-
-  void runTask(uint64_t lowerBound, uint64_t upperBound, int index);
-
-  void copy2ResultInting(uint64_t index, uint64_t id);
-
-  void mergeIntingTmpResults(int col);
+  /// Append the ids of the tuples in [begin, end) that pass the filters,
+  /// row ids past the main columns are the ones of appended tuples. Zones
+  /// no tuple of which can pass are skipped
+  void filterRange(uint64_t begin, uint64_t end, std::vector<uint64_t> &row_ids);
+  /// filterRange without the zone maps
+  void filterRows(uint64_t begin, uint64_t end, std::vector<uint64_t> &row_ids);
+  /// Whether some tuple of a zone may pass the filters
+  bool mayPass(uint64_t zone) const;
+  /// filterRange within the main columns. Uses the compressed columns
+  /// where there are some
+  void filterMain(uint64_t begin, uint64_t end, std::vector<uint64_t> &row_ids);
+  /// filterRange within the delta
+  void filterDelta(uint64_t begin, uint64_t end, std::vector<uint64_t> &row_ids);
+  /// Collect the ids of all tuples that pass the filters
+  std::vector<uint64_t> selectRowIds();
+  /// Materialize the required columns of the given tuples
+  void copyRowIds2Result(const std::vector<uint64_t> &row_ids);
+  /// Run through the subplan cache (shared scans publish there as well)
+  void runCached();
 
 public:
   /// The constructor
@@ -135,6 +195,44 @@ public:
   {
     return Operator::getResults();
   }
+
+  /// Skip the zones of a filtered column whose min and max rule out the
+  /// filters. The statistics must cover all tuples of the relation
+  void addZoneMap(unsigned col_id, std::shared_ptr<const ColumnStats> stats)
+  {
+    zone_maps_[col_id] = std::move(stats);
+  }
+
+  /// Normalized description of the relation and its filters
+  std::string signature() const override;
+  /// Key of the selection vector in the subplan cache
+  std::string cacheKey() const { return "scan:" + signature(); }
+};
+
+/// Evaluates the filters of several FilterScans over the same relation in
+/// one cooperative pass and publishes every selection vector to the cache
+class SharedScan
+{
+private:
+  /// The relation
+  const Relation &relation_;
+  /// The scans sharing the pass
+  std::vector<std::shared_ptr<FilterScan>> scans_;
+
+  int NUM_THREADS = QueryScheduler::parallelism();
+
+public:
+  /// Rows per morsel (all filters run on a morsel while it is cached)
+  static constexpr uint64_t kMorselSize = 4096;
+
+  /// The constructor
+  explicit SharedScan(const Relation &r) : relation_(r){};
+  /// Add a scan to the pass
+  void add(std::shared_ptr<FilterScan> scan) { scans_.push_back(move(scan)); }
+  /// The number of scans sharing the pass
+  size_t size() const { return scans_.size(); }
+  /// Run the pass and insert the selection vectors into the cache
+  void run(ResultCache &cache);
 };
 
 class Join : public Operator
@@ -145,11 +243,19 @@ private:
   /// The join predicate info
   PredicateInfo p_info_;
 
-  using HT = std::unordered_multimap<uint64_t, uint64_t>;
+  /// Build sides shared with the other queries of the batch (optional)
+  BatchContext *batch_ = nullptr;
+
+  /// The most partitions of a grace hash join
+  static constexpr uint64_t kMaxGracePartitions = 1024;
+  /// Rounds of repartitioning a grace partition beyond the budget, before
+  /// it is joined block by block
+  static constexpr unsigned kMaxGraceLevels = 3;
 
-  /// The hash table for the join
-  HT hash_table_;
-  std::vector<HT> hashTables;
+  /// Private build tables (one per partition), in the arena of the query
+  std::vector<JoinHashTable> hashTables;
+  /// Whether the build tables carry the requested left columns
+  bool co_located_ = false;
   /// Columns that have to be materialized
   std::unordered_set<SelectInfo> requested_columns_;
   /// Left/right columns that have been requested
@@ -160,36 +266,129 @@ private:
   /// The input data that has to be copied
   std::vector<uint64_t *> copy_left_data_, copy_right_data_;
 
-  std::vector<std::vector<uint64_t>> leftTableWork;
-  std::vector<std::vector<uint64_t>> leftTableIndex;
-  std::vector<std::vector<uint64_t>> rightTableWork;
-  std::vector<std::vector<uint64_t>> rightTableIndex;
+  /// Left tuples of every partition (the last one: heavy keys)
+  std::vector<ArenaVector> leftTableIndex;
+  /// Right tuples of every partition
+  std::vector<ArenaVector> rightTableIndex;
+  /// Right tuples with heavy keys, dealt to the partitions
+  std::vector<ArenaVector> rightHeavyIndex;
+
+  /// Keys frequent enough to overload a partition
+  struct HeavyKeys {
+    /// The keys
+    std::unordered_set<uint64_t> keys;
+    /// Whether a partition owns a heavy key (checked before the set)
+    std::vector<char> partitions;
+
+    bool contains(uint64_t key, unsigned partition) const
+    {
+      return partitions[partition] && keys.count(key);
+    }
+  };
+  /// Keys sampled per input to find heavy keys
+  static constexpr uint64_t kHeavySamples = 1024;
+  /// Occurrences in the sample that a heavy key needs at least
+  static constexpr uint64_t kMinHeavyCount = 8;
 
 private:
-  /// Copy tuple to result
-  void copy2Result(uint64_t left_id, uint64_t right_id);
-
-  void copy2ResultInting(uint64_t left_id, uint64_t right_id, uint64_t index);
-
-  void runTask(uint64_t lowerBound, uint64_t upperBound, int index, uint64_t *left_key_column, uint64_t *right_key_column);
-
-  void populateLeftWork(uint64_t lowerBound, uint64_t upperBound, uint64_t *relevant_column, uint64_t size);
+  /// Partition of a key. Keys are mixed first, so keys that share a
+  /// residue or a stride do not end up in the same partition
+  static unsigned partitionOf(uint64_t key, unsigned num_partitions)
+  {
+    return ((key * 0x9e3779b97f4a7c15ull) >> 32) * num_partitions >> 32;
+  }
+  /// Partition of a key when a grace partition is split again. Every level
+  /// mixes the key differently, keys that shared a partition are spread
+  static unsigned partitionOf(uint64_t key, unsigned num_partitions, unsigned level)
+  {
+    if (level == 0)
+      return partitionOf(key, num_partitions);
+    key ^= level * 0xc2b2ae3d27d4eb4full;
+    key = (key ^ (key >> 33)) * 0xff51afd7ed558ccdull;
+    key = (key ^ (key >> 33)) * 0xc4ceb9fe1a85ec53ull;
+    return ((key ^ (key >> 33)) >> 32) * num_partitions >> 32;
+  }
+  /// Add the keys that make up a large share of a sample of the column
+  static void sampleHeavyKeys(const uint64_t *keys, uint64_t size, HeavyKeys &heavy);
+  /// Assign the left tuples to the partitions, heavy keys to the last one
+  void populateLeftWork(const uint64_t *key_column, uint64_t size, const HeavyKeys &heavy);
 
   void createHashTables(int index, uint64_t *left_key_column);
 
-  void populateRightWork(uint64_t lowerBound, uint64_t upperBound, uint64_t *relevant_column);
+  /// Assign the right tuples to the partitions, heavy keys round-robin
+  void populateRightWork(const uint64_t *key_column, uint64_t size, const HeavyKeys &heavy);
 
   void buildHashTable(uint64_t lowerBound, uint64_t upperBound, int index, uint64_t *left_key_column);
 
-  void mergeIntingTmpResults(int index, uint64_t offset);
-
   void mergeIntingTmpResultsLeft(int col);
 
   void mergeIntingTmpResultsRight(int col);
   /// Create mapping for bindings
   void createMappingForBindings();
 
+  /// Cache key of a join of two (filtered) base relations, empty otherwise
+  std::string cacheKey() const;
+  /// Execute the join
+  void runJoin();
+
+  /// The build table shared within the batch, nullptr if the build is private
+  /// or the budget has no room for a shared one
+  std::shared_ptr<const BuildTable> sharedBuildTable(uint64_t *left_key_column);
+  /// Run probe(task, emit) in num_tasks tasks, where emit(entry, right_id)
+  /// reports a match with a build table entry. Every task counts its matches first, then
+  /// writes them at its offset of the result columns
+  template <typename Probe>
+  void materialize(unsigned num_tasks, const Probe &probe);
+  /// Grace hash join for build sides beyond the memory budget: both inputs
+  /// are partitioned into spill files and joined one partition at a time
+  void runGrace(uint64_t *left_key_column, uint64_t *right_key_column,
+                const std::vector<uint64_t *> &payload);
+  /// What the partitions of a grace hash join share
+  struct GraceJoin {
+    /// The key columns
+    const uint64_t *left_keys, *right_keys;
+    /// The left columns the build tables carry
+    const std::vector<uint64_t *> &payload;
+    /// The bytes a build table may take
+    uint64_t budget;
+    /// The bytes of a build tuple
+    uint64_t tuple_bytes;
+  };
+  /// Join a grace partition (the row ids of both inputs). In one beyond the
+  /// budget, a build key that exceeds the budget on its own is joined in
+  /// blocks and the other keys are split again with the partitions of the
+  /// next level. Beyond kMaxGraceLevels, the partition is joined in blocks
+  void joinGracePartition(const GraceJoin &grace, const uint64_t *left_ids,
+                          uint64_t left_count, const uint64_t *right_ids,
+                          uint64_t right_count, unsigned level);
+  /// Join blocks of left tuples that fit into the budget, each with all
+  /// right tuples (block nested loops over build tables)
+  void joinGraceBlocks(const GraceJoin &grace, const uint64_t *left_ids,
+                       uint64_t left_count, const uint64_t *right_ids,
+                       uint64_t right_count);
+  /// A key that a sample of the given rows estimates to occur in more than
+  /// limit of them, false if there is none
+  static bool findHeavyKey(const uint64_t *keys, const uint64_t *ids, uint64_t size,
+                           uint64_t limit, uint64_t &key);
+  /// Write the row ids with a key to a spill file, followed by the others.
+  /// Returns the number of the former
+  static uint64_t splitRowIds(const uint64_t *keys, const uint64_t *ids, uint64_t size,
+                              uint64_t key, SpillFile &row_ids);
+  /// Write a match (a build table entry and a right tuple) to position out
+  /// of the result columns
+  void copyMatch(uint64_t *const *results, uint64_t out, const uint64_t *entry,
+                 uint64_t right_id) const;
+  /// Write the row ids of keys to a spill file, grouped by their partition
+  /// of a level. ids are the rows to partition (nullptr: the first size).
+  /// bounds gets the first position of every partition (and the end)
+  static void partitionRowIds(const uint64_t *keys, const uint64_t *ids, uint64_t size,
+                              unsigned num_partitions, unsigned level, SpillFile &row_ids,
+                              std::vector<uint64_t> &bounds);
+
 public:
+  /// Estimated bytes of a tuple in a private build table
+  static constexpr uint64_t kBuildTupleBytes = 32;
+
   /// The constructor
   Join(std::shared_ptr<Operator> &&left,
        std::shared_ptr<Operator> &&right,
@@ -197,11 +396,158 @@ public:
       : left_(std::move(left)), right_(std::move(right)), p_info_(p_info){};
   /// Require a column and add it to results
   bool require(SelectInfo info) override;
+  /// Share build sides through the batch
+  void setBatch(BatchContext *batch) { batch_ = batch; }
   /// Run
   void runThingLeft();
   void run() override;
 };
 
+/// An input of a join in key order
+struct SortedInput {
+  /// The keys in order
+  const uint64_t *keys;
+  /// The tuple ids in key order (nullptr: the input is sorted)
+  const uint64_t *ids;
+  /// The number of tuples
+  uint64_t size;
+
+  uint64_t id(uint64_t i) const { return ids ? ids[i] : i; }
+
+  /// The results of an input that ran in key order, sorting copies of its
+  /// keys and tuple ids into keys and ids unless it is sorted on the key
+  static SortedInput of(Operator &input, const SelectInfo &key, ArenaVector &keys,
+                        ArenaVector &ids, unsigned num_tasks);
+};
+
+/// Sort-merge join. Inputs that are not sorted on their key are sorted by
+/// a parallel radix sort of (key, tuple id) pairs; inputs that are (scans
+/// of sorted columns, other merge joins) are merged as they are. The merge
+/// runs in tasks over ranges of the left keys that never split a key, and
+/// the result is sorted on the join key
+class MergeJoin : public Operator
+{
+private:
+  /// The input operators
+  std::shared_ptr<Operator> left_, right_;
+  /// The join predicate info
+  PredicateInfo p_info_;
+  /// Columns that have to be materialized
+  std::unordered_set<SelectInfo> requested_columns_;
+  /// Left/right columns that have been requested
+  std::vector<SelectInfo> requested_columns_left_, requested_columns_right_;
+  /// The input data that has to be copied
+  std::vector<uint64_t *> copy_left_data_, copy_right_data_;
+
+  /// Sorted copies of the keys and tuple ids of unsorted inputs
+  ArenaVector left_keys_, left_ids_, right_keys_, right_ids_;
+
+  /// Merge the key ranges left[left_begin, left_end) and right[right_begin,
+  /// right_end), calling emit(left_id, right_id) for every match
+  template <typename Emit>
+  static void merge(const SortedInput &left, uint64_t left_begin, uint64_t left_end,
+                    const SortedInput &right, uint64_t right_begin, uint64_t right_end,
+                    const Emit &emit);
+
+public:
+  /// Tuples on both sides from which sorting beats hashing (the build side
+  /// is far beyond the caches)
+  static constexpr double kMinSortSize = double(1 << 22);
+
+  /// The constructor
+  MergeJoin(std::shared_ptr<Operator> &&left, std::shared_ptr<Operator> &&right,
+            const PredicateInfo &p_info)
+      : left_(std::move(left)), right_(std::move(right)), p_info_(p_info)
+  {
+    // Matches come in key order
+    addSortedOn(p_info_.left);
+    addSortedOn(p_info_.right);
+  }
+  /// Require a column and add it to results
+  bool require(SelectInfo info) override;
+  /// Run
+  void run() override;
+};
+
+/// Join of several inputs on one key whose result stays factorized: a union
+/// over the keys of the product of the tuples with the key in every input.
+/// Many-to-many joins produce flat results far larger than this form, so
+/// sums are computed per key from the sums of the inputs, and further joins
+/// on the key become further inputs. The result is only flattened (in key
+/// order) when a parent reads it as columns
+class FactorizedJoin : public Operator
+{
+private:
+  /// The inputs
+  std::vector<std::shared_ptr<Operator>> inputs_;
+  /// The join key of every input
+  std::vector<SelectInfo> keys_;
+  /// Columns that have to be materialized and their input
+  std::unordered_map<SelectInfo, unsigned> requested_columns_;
+  /// Columns in result order
+  std::vector<SelectInfo> result_order_;
+
+  /// Sorted copies of the keys and tuple ids of unsorted inputs
+  std::vector<ArenaVector> sorted_keys_, sorted_ids_;
+  /// The inputs in key order
+  std::vector<SortedInput> sorted_;
+  /// The tuples of every key in every input: group g is the product of the
+  /// runs [begin, end) of sorted input i at runs_[g * stride() + 2 * i], the
+  /// last value of a group is its first flat result
+  ArenaVector runs_;
+  /// The number of keys in the result
+  uint64_t num_groups_ = 0;
+  /// Whether the results have been flattened
+  bool flattened_ = false;
+
+  /// Values per group in runs_
+  uint64_t stride() const { return 2 * inputs_.size() + 1; }
+  /// Intersect the keys of the inputs in the ranges [begins[i], ends[i]),
+  /// calling emit(runs) with the runs (begin, end) of every input for every
+  /// key that all inputs have
+  template <typename Emit>
+  void intersect(std::vector<uint64_t> begins, const std::vector<uint64_t> &ends,
+                 const Emit &emit) const;
+  /// Materialize the requested columns
+  void flatten();
+
+public:
+  /// Estimated growth of the flat result over its inputs from which a join
+  /// is factorized
+  static constexpr double kMinExpansion = 2.0;
+
+  /// The constructor
+  FactorizedJoin(std::shared_ptr<Operator> &&left, std::shared_ptr<Operator> &&right,
+                 const PredicateInfo &p_info)
+  {
+    addInput(std::move(left), p_info.left);
+    addInput(std::move(right), p_info.right);
+  }
+  /// Whether a column is one of the join keys
+  bool joinsOn(const SelectInfo &info) const
+  {
+    return std::any_of(keys_.begin(), keys_.end(), [&](const SelectInfo &key) {
+      return key.binding == info.binding && key.col_id == info.col_id;
+    });
+  }
+  /// Join another input on its key (equal to the join keys)
+  void addInput(std::shared_ptr<Operator> &&input, const SelectInfo &key)
+  {
+    inputs_.push_back(std::move(input));
+    keys_.push_back(key);
+    // Flattening walks the keys in order
+    addSortedOn(key);
+  }
+  /// Require a column and add it to results
+  bool require(SelectInfo info) override;
+  /// Run
+  void run() override;
+  /// Get materialized results, flattening them
+  std::vector<uint64_t *> getResults() override;
+  /// The sum of a column over the flat result
+  uint64_t sum(const SelectInfo &info) override;
+};
+
 class SelfJoin : public Operator
 {
 private:
@@ -218,24 +564,18 @@ private:
   std::vector<uint64_t *> copy_data_;
 
 private:
-  /// Copy tuple to result
-  void copy2Result(uint64_t id);
-
-  void copy2ResultInting(uint64_t i, int threadIndex);
-
-  void runTask(uint64_t lowerBound, uint64_t upperBound, int index, uint64_t *left_key_column, uint64_t *right_key_column);
-
-  void mergeIntingTmpResults(int col);
-
 public:
   /// The constructor
   SelfJoin(std::shared_ptr<Operator> &&input, PredicateInfo &p_info)
-      : input_(std::move(input)), p_info_(p_info){};
+      : input_(std::move(input)), p_info_(p_info) {}
 
   /// Require a column and add it to results
   bool require(SelectInfo info) override;
   /// Run
   void run() override;
+  /// Filtering keeps the order of the input, asked when the plan is built
+  /// since the input may still gain keys
+  bool sortedOn(const SelectInfo &info) const override { return input_->sortedOn(info); }
 };
 
 class Checksum : public Operator
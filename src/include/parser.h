@@ -127,6 +127,10 @@ class QueryInfo {
   /// Dump SQL
   std::string dumpSQL();
 
+  /// Drop join predicate index, selections of its other column read the
+  /// kept one
+  void dropPredicate(unsigned index, const SelectInfo &kept);
+
   /// Reset query info
   void clear();
 
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "ThreadPool.h"
+
+/// Runs optional preparation work (warm-up, statistics, compression, keys) in the
+/// window between loading and the first queries. Tasks run by priority on
+/// all pool workers until the time budget is spent or queries arrive; the
+/// rest continues on a single background thread at the lowest OS priority.
+/// Tasks publish their results themselves, nobody ever waits for them.
+/// Tasks added later (merges of appended tuples) run on the background
+/// thread as well.
+class PrepScheduler {
+ public:
+  /// Task priorities, lower runs first
+  enum Priority : unsigned { WarmUp = 0, Stats = 1, Encode = 2, Keys = 3, Merge = 4 };
+
+  /// The destructor, drops the tasks that did not start yet
+  ~PrepScheduler();
+
+  /// Add a task
+  void add(unsigned priority, std::function<void()> task);
+  /// Run f once all tasks finished (not if the scheduler is destroyed first)
+  void onDone(std::function<void()> f);
+  /// Start running the tasks on the pool for at most budget
+  void start(ThreadPool &pool, std::chrono::milliseconds budget);
+  /// Queries arrived: release the pool and continue in the background
+  void yield();
+  /// Wait for all tasks (tests and tools)
+  void wait();
+
+  /// The number of tasks that did not finish yet
+  size_t pending();
+
+ private:
+  /// Pool worker: run tasks until the deadline
+  void drain();
+  /// Background thread: run the remaining tasks at low priority
+  void runBackground();
+  /// Pop the next task (mutex_ must be held)
+  bool pop(std::function<void()> &task);
+  /// Run a popped task (lock must hold mutex_, it is released meanwhile)
+  void runTask(std::function<void()> &task, std::unique_lock<std::mutex> &lock);
+
+  /// Protects all members below
+  std::mutex mutex_;
+  /// Signals the background thread and wait()
+  std::condition_variable changed_;
+  /// The tasks by priority
+  std::multimap<unsigned, std::function<void()>> tasks_;
+  /// The tasks that are running
+  size_t running_ = 0;
+  /// Runs once all tasks finished
+  std::function<void()> on_done_;
+  /// The pool workers stop taking tasks at this time
+  std::chrono::steady_clock::time_point deadline_;
+  /// Whether the pool phase is over
+  bool yielded_ = false;
+  /// Whether the scheduler shuts down
+  bool stop_ = false;
+
+  /// The pool
+  ThreadPool *pool_ = nullptr;
+  /// One drain task per pool worker
+  std::function<void()> drainer_;
+  /// The drain tasks
+  TaskGroup drainers_;
+  /// The background thread
+  std::thread background_;
+};
@@ -1,11 +1,62 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "compression.h"
+#include "format.h"
+
 using RelationId = unsigned;
 
+/// The main columns of a relation followed by the tuples of its delta, for
+/// the scans that hand out whole columns. Shared by the deltas of the
+/// appends until the next merge, each reads its own prefix
+struct ContiguousColumns {
+  /// The values by column, capacity rows each
+  std::vector<std::unique_ptr<uint64_t[]>> columns;
+  /// The number of rows filled
+  uint64_t size = 0;
+  /// The number of rows the columns have room for
+  uint64_t capacity = 0;
+};
+
+/// Tuples appended to a relation after it was loaded. Never modified once
+/// published: an append publishes a new delta
+struct DeltaStore {
+  /// The values by column
+  std::vector<std::vector<uint64_t>> columns;
+  /// The number of tuples
+  uint64_t size = 0;
+  /// Built on first use, see Relation::contiguous
+  mutable std::shared_ptr<ContiguousColumns> contiguous;
+  /// Guards the construction of contiguous
+  mutable std::once_flag contiguous_once;
+};
+
+/// Main columns with the tuples of a delta folded in, built off the query
+/// path and installed between batches
+struct MergedColumns {
+  /// Anonymous memory holding the columns
+  void *mapping = nullptr;
+  /// The length of mapping
+  uint64_t length = 0;
+  /// The columns
+  std::vector<uint64_t *> columns;
+  /// The number of tuples
+  uint64_t size = 0;
+  /// The number of delta tuples folded in
+  uint64_t delta_size = 0;
+
+  MergedColumns() = default;
+  MergedColumns(const MergedColumns &other) = delete;
+  /// Releases the memory unless it was installed
+  ~MergedColumns();
+};
+
 class Relation
 {
 private:
@@ -15,22 +66,49 @@ private:
   uint64_t size_;
   /// The join column containing the keys
   std::vector<uint64_t *> columns_;
+  /// Anonymous memory holding the columns (if the relation was placed)
+  void *mapping_ = nullptr;
+  /// The length of mapping_
+  uint64_t mapping_length_ = 0;
+  /// Compressed copies of the columns (nullptr: not encoded)
+  std::vector<std::shared_ptr<const EncodedColumn>> encoded_;
+  /// Metadata stored in the file (format v2) or in its snapshot
+  std::vector<StoredColumn> stored_;
+  /// The file the relation was loaded from
+  std::string file_name_;
+  /// The key of that file
+  FileKey file_key_;
+  /// The mapped relation file, nullptr if nothing points into it anymore.
+  /// Columns placed elsewhere are unmapped from it
+  char *file_ = nullptr;
+  /// The length of file_
+  uint64_t file_length_ = 0;
+  /// The mapped snapshot (stored codes point into it)
+  void *snapshot_ = nullptr;
+  /// The length of snapshot_
+  uint64_t snapshot_length_ = 0;
+  /// Tuples appended since the last merge (nullptr: none). Their row ids
+  /// follow the ones of the main columns
+  std::shared_ptr<const DeltaStore> delta_;
+  /// Counts the appends, results computed from an older version are stale
+  std::atomic<uint64_t> version_{0};
 
 public:
   /// Constructor without mmap
   Relation(uint64_t size, std::vector<uint64_t *> &&columns)
-      : owns_memory_(true), size_(size), columns_(columns) {}
+      : owns_memory_(true), size_(size), columns_(columns),
+        encoded_(columns_.size()), stored_(columns_.size()) {}
   /// Constructor using mmap
   explicit Relation(const char *file_name);
   /// Delete copy constructor
   Relation(const Relation &other) = delete;
   /// Move constructor
-  Relation(Relation &&other) = default;
+  Relation(Relation &&other) noexcept;
 
   /// The destructor
   ~Relation();
 
-  /// Stores a relation into a file (binary)
+  /// Stores a relation into a file (binary, format v1)
   void storeRelation(const std::string &file_name);
 
   // int *minValPtr;
@@ -42,14 +120,61 @@ public:
   /// Dump SQL: Create and load table (PostgreSQL)
   void dumpSQL(const std::string &file_name, unsigned relation_id);
 
-  /// The number of tuples
+  /// The number of tuples in the main columns
   uint64_t size() const { return size_; }
   /// The join column containing the keys
   const std::vector<uint64_t *> &columns() const { return columns_; }
+  /// The number of tuples including the delta
+  uint64_t totalSize() const;
+  /// The appended tuples that are not merged yet, nullptr if there are none
+  std::shared_ptr<const DeltaStore> delta() const { return std::atomic_load(&delta_); }
+  /// The number of appends so far
+  uint64_t version() const { return version_; }
+  /// Copy the values of the rows [begin, end) of a column (main or delta)
+  void copyValues(unsigned col_id, uint64_t begin, uint64_t end,
+                  uint64_t *out) const;
+
+  /// The main columns followed by the tuples of a delta of the relation,
+  /// in one piece. Built by the first caller after a merge, appends copy
+  /// only their own tuples into it while it has room
+  const ContiguousColumns &contiguous(const DeltaStore &delta) const;
+
+  /// Append tuples (one vector of equal length per column) to the delta.
+  /// Not concurrent with queries
+  void append(const std::vector<std::vector<uint64_t>> &columns);
+  /// Copy the main columns and the current delta into fresh memory, nullptr
+  /// if there is no memory. Concurrent with queries
+  std::unique_ptr<MergedColumns> buildMerge() const;
+  /// Replace the main columns by merged ones and drop the merged tuples
+  /// from the delta. Row ids stay the same. Not concurrent with anything
+  /// reading the main columns
+  void installMerge(std::unique_ptr<MergedColumns> merged);
+
+  /// The compressed copy of a column, nullptr if there is none (yet)
+  std::shared_ptr<const EncodedColumn> encoded(unsigned col_id) const;
+  /// The statistics of a column stored in its file, nullptr if none
+  std::shared_ptr<const ColumnStats> storedStats(unsigned col_id) const;
+  /// Whether every column has stored statistics with checked keys
+  bool hasStoredMetadata() const;
+  /// Store the snapshot of the metadata of the relation file. False if the
+  /// relation has no file or the snapshot cannot be written
+  bool storeSnapshot(const std::vector<StoredColumn> &columns) const;
+  /// Publish the compressed copy of a column
+  void setEncoded(unsigned col_id, std::shared_ptr<const EncodedColumn> column);
+
+  /// Faults in the pages of [addr, addr + length) in parallel
+  static void prefault(const char *addr, uint64_t length);
 
 private:
   /// Loads data from a file
   void loadRelation(const char *file_name);
+  /// Parses a mapped .tbl file into anonymous memory. False if it is malformed
+  bool parseTbl(const char *data, uint64_t length);
+  /// Map the snapshot of the relation file if it is still valid
+  void loadSnapshot();
+  /// Copies the columns into memory interleaved across the NUMA nodes.
+  /// False if there is no memory, the columns stay where they are
+  bool interleaveColumns();
 
   // Returns all the values in a certain column specified by colIdx
   std::vector<uint64_t> getColVals(const int colIdx);
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+
+/// A logical CPU the process may run on
+struct CpuInfo {
+  /// OS id of the CPU
+  unsigned cpu;
+  /// Physical core id (within the socket)
+  unsigned core;
+  /// Socket id
+  unsigned socket;
+  /// NUMA node id
+  unsigned node;
+  /// Index among the hyperthreads of its core
+  unsigned smt_rank;
+};
+
+/// Core/SMT/socket/NUMA layout of the CPUs in our affinity mask
+struct Topology {
+  /// The CPUs, one thread per physical core first (round-robin over the
+  /// sockets), hyperthread siblings last
+  std::vector<CpuInfo> cpus;
+  /// The number of physical cores
+  unsigned num_cores = 1;
+  /// The number of sockets
+  unsigned num_sockets = 1;
+  /// The number of NUMA nodes
+  unsigned num_nodes = 1;
+
+  /// Read the topology from sysfs (falls back to a flat layout)
+  static Topology discover();
+};
+
+/// The single parallel runtime of the process. It is sized from the
+/// topology, or from the environment:
+///   DB_THREADS  number of worker threads (default: CPUs in the affinity mask)
+///   DB_PIN      pin workers to CPUs (default: 1)
+///   DB_NUMA     interleave relations across NUMA nodes (default: 1 if the
+///               CPUs span more than one node)
+///   DB_PREFAULT fault relations in while loading (default: 1)
+///   DB_PREP_MS  time budget of the preparation phase (default: 5000)
+///   DB_COMPRESS build compressed copies of the columns (default: 1)
+///   DB_SNAPSHOT keep prepared metadata in <relation>.meta files next to the
+///               inputs (default: 0)
+///   DB_MEMORY_MB budget of query intermediates (default: 3/4 of the RAM)
+///   DB_QUERY_MEMORY_MB budget of a single query (default: half of DB_MEMORY_MB)
+///   DB_SPILL_DIR directory of spill files, has to be on a disk (default:
+///               /var/tmp)
+/// Operators run their parallel work on its pool; the query scheduler takes
+/// its worker budget from it.
+class Runtime {
+ public:
+  /// The runtime of the process
+  static Runtime &get();
+
+  /// The topology
+  const Topology &topology() const { return topology_; }
+  /// The number of pool workers (the intra-query parallelism budget)
+  unsigned numThreads() const { return num_threads_; }
+  /// The number of query workers
+  unsigned numQueryWorkers() const;
+  /// The fork-join pool
+  ThreadPool &pool() { return *pool_; }
+
+  /// Whether data is spread across NUMA nodes
+  bool numaEnabled() const { return numa_enabled_; }
+  /// Whether relations are faulted in while loading
+  bool prefault() const { return prefault_; }
+  /// Time the preparation phase may use the pool before the first queries
+  std::chrono::milliseconds prepBudget() const { return prep_budget_; }
+  /// Whether columns get compressed copies
+  bool compress() const { return compress_; }
+  /// Whether prepared metadata is kept in snapshot files
+  bool snapshots() const { return snapshots_; }
+  /// Budget of query intermediates in bytes
+  uint64_t memoryBudget() const { return memory_budget_; }
+  /// Budget of a single query in bytes
+  uint64_t queryMemoryBudget() const { return query_memory_budget_; }
+  /// Directory of spill files
+  const std::string &spillDir() const { return spill_dir_; }
+  /// Interleave the pages of [addr, addr + length) across the nodes of our
+  /// CPUs. Only affects pages that are not yet faulted in
+  bool interleave(void *addr, uint64_t length) const;
+  /// Place the pages of [addr, addr + length) on a node (falling back to
+  /// others when it is full). Only affects pages that are not yet faulted in
+  bool placeOnNode(void *addr, uint64_t length, unsigned node) const;
+  /// The NUMA node of the CPU the calling thread runs on
+  unsigned currentNode() const;
+
+ private:
+  /// The constructor
+  Runtime();
+
+  /// The topology
+  Topology topology_;
+  /// The NUMA node by CPU id
+  std::vector<unsigned> cpu_nodes_;
+  /// The number of pool workers
+  unsigned num_threads_;
+  /// Whether data is spread across NUMA nodes
+  bool numa_enabled_;
+  /// Whether relations are faulted in while loading
+  bool prefault_;
+  /// Time budget of the preparation phase
+  std::chrono::milliseconds prep_budget_;
+  /// Whether columns get compressed copies
+  bool compress_;
+  /// Whether prepared metadata is kept in snapshot files
+  bool snapshots_;
+  /// Budget of query intermediates
+  uint64_t memory_budget_;
+  /// Budget of a single query
+  uint64_t query_memory_budget_;
+  /// Directory of spill files
+  std::string spill_dir_;
+  /// The pool
+  std::unique_ptr<ThreadPool> pool_;
+};
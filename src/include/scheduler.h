@@ -0,0 +1,83 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Runs queries on a fixed number of workers. Pending queries are admitted
+/// shortest-first by estimated cost; a query that has been passed over too
+/// often is admitted next regardless of its cost (aging guard). Every
+/// admitted query gets a share of the intra-query parallelism budget that
+/// depends on the load at admission. Queries also declare their estimated
+/// peak memory: a query is only admitted while the estimates of the running
+/// queries and its own fit into the memory budget, otherwise it stays
+/// queued until running queries release theirs. A query whose estimate
+/// exceeds the whole budget runs alone (its operators spill).
+class QueryScheduler {
+ public:
+  /// The constructor (0 = sized from the runtime and the memory governor)
+  explicit QueryScheduler(unsigned num_workers = 0, unsigned parallelism = 0,
+                          uint64_t memory_budget = 0);
+  /// The destructor waits for all queries
+  ~QueryScheduler();
+
+  /// Submit a query with an estimated cost and peak memory
+  void submit(double cost, std::function<void()> query, uint64_t memory = 0);
+  /// Wait until all submitted queries are done
+  void wait();
+
+  /// The number of workers
+  unsigned numWorkers() const { return num_workers_; }
+  /// The memory budget of the running queries
+  uint64_t memoryBudget() const { return memory_budget_; }
+  /// Intra-query parallelism of the query on the calling thread
+  static int parallelism();
+
+ private:
+  struct PendingQuery {
+    /// Estimated cost
+    double cost;
+    /// Number of times a cheaper query was admitted first
+    unsigned skipped;
+    /// Estimated peak memory (at most the budget)
+    uint64_t memory;
+    /// The query
+    std::function<void()> run;
+  };
+
+  /// Admit queries until stopped
+  void workerLoop();
+  /// Position of the next query to admit, queue_.size() if none fits into
+  /// the memory budget (mutex_ must be held)
+  size_t pickNext() const;
+  /// Whether a query fits next to the running ones (mutex_ must be held)
+  bool fits(const PendingQuery &query) const;
+
+  /// Protects all members below
+  std::mutex mutex_;
+  /// Signals new queries
+  std::condition_variable work_available_;
+  /// Signals that all queries are done
+  std::condition_variable done_;
+  /// Pending queries in submission order
+  std::vector<PendingQuery> queue_;
+  /// The number of running queries
+  unsigned running_ = 0;
+  /// Estimated memory of the running queries
+  uint64_t admitted_memory_ = 0;
+  /// Memory budget of the running queries
+  uint64_t memory_budget_;
+  /// The number of workers
+  unsigned num_workers_;
+  /// Total intra-query parallelism
+  unsigned parallelism_;
+  /// Skips after which a query is admitted regardless of its cost
+  unsigned aging_limit_;
+  /// Stop the workers
+  bool stop_ = false;
+  /// The workers
+  std::vector<std::thread> workers_;
+};
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+#include "ThreadPool.h"
+#include "arena.h"
+
+/// Parallel LSD radix sort of (key, tuple id) pairs by key, one byte per
+/// pass. Passes over bytes that are zero in every key are skipped. The sort
+/// is stable: tuples with the same key keep their order
+class RadixSort {
+ public:
+  /// Pairs below this count are sorted on the calling thread
+  static constexpr uint64_t kParallelSize = 1 << 16;
+
+  /// Sort the pairs (keys[i], ids[i]) in num_tasks tasks
+  static void sort(ThreadPool &pool, unsigned num_tasks, ArenaVector &keys,
+                   ArenaVector &ids);
+
+ private:
+  /// Values of a digit
+  static constexpr unsigned kRadix = 256;
+};
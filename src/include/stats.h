@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+class Relation;
+
+/// Statistics of one column, computed during the preparation phase
+struct ColumnStats {
+  /// Rows per zone of the zone map
+  static constexpr uint64_t kZoneSize = 1 << 16;
+
+  /// The number of tuples
+  uint64_t size = 0;
+  /// The smallest value
+  uint64_t min = 0;
+  /// The largest value
+  uint64_t max = 0;
+  /// Estimated number of distinct values (HyperLogLog)
+  uint64_t distinct = 0;
+  /// Whether the values are ascending
+  bool sorted = false;
+  /// Whether key detection ran (unique is exact only then)
+  bool keys_checked = false;
+  /// Whether every value occurs once
+  bool unique = false;
+  /// Min and max of every zone of kZoneSize rows
+  std::vector<uint64_t> zone_min, zone_max;
+
+  /// Estimated fraction of tuples passing "column <comparison> constant"
+  double selectivity(char comparison, uint64_t constant) const;
+
+  /// Compute the statistics of a column
+  static std::shared_ptr<ColumnStats> compute(const uint64_t *values,
+                                              uint64_t size);
+  /// Check whether a column is a key (exact)
+  static bool isUnique(const uint64_t *values, const ColumnStats &stats);
+  /// Whether every value of a column may occur in a key column, judged from
+  /// the statistics. The distinct counts are estimates compared with some
+  /// slack, so a few columns that are included may be rejected (the caller
+  /// then only keeps a join it could have dropped)
+  static bool mayBeIncluded(const ColumnStats &stats, const ColumnStats &key_stats);
+  /// Check whether every value of a column occurs in a key column (exact)
+  static bool isIncluded(const uint64_t *values, const ColumnStats &stats,
+                         const uint64_t *key_values, const ColumnStats &key_stats);
+  /// The statistics after appending count values to a column whose last
+  /// value is previous (ignored if the column is empty). The distinct count
+  /// is an upper bound, keys stay checked only if they provably still hold
+  static std::shared_ptr<ColumnStats> extend(const ColumnStats &stats,
+                                             uint64_t previous,
+                                             const uint64_t *values,
+                                             uint64_t count);
+};
+
+/// The statistics of all columns. Entries are published atomically as
+/// preparation tasks finish, readers never wait: a column without
+/// statistics yet returns nullptr
+class Statistics {
+ public:
+  /// Make room for the columns of the relations
+  void init(const std::vector<Relation> &relations);
+
+  /// The statistics of a column, nullptr if not (yet) known
+  std::shared_ptr<const ColumnStats> get(unsigned relation_id,
+                                         unsigned col_id) const;
+  /// Publish the statistics of a column
+  void publish(unsigned relation_id, unsigned col_id,
+               std::shared_ptr<const ColumnStats> stats);
+  /// Claim the computation of the statistics of a column, false if they
+  /// are published or claimed already
+  bool claim(unsigned relation_id, unsigned col_id);
+
+  /// What is known about an inclusion dependency
+  enum class Inclusion { Unknown, Pending, Holds, Fails };
+  /// Whether every value of the first size tuples of a column occurs in a
+  /// key column
+  Inclusion inclusion(unsigned relation_id, unsigned col_id, unsigned key_relation_id,
+                      unsigned key_col_id, uint64_t size) const;
+  /// Claim the verification of an inclusion dependency for size tuples,
+  /// false if it is known or claimed already
+  bool claimInclusion(unsigned relation_id, unsigned col_id, unsigned key_relation_id,
+                      unsigned key_col_id, uint64_t size);
+  /// Publish whether an inclusion dependency holds for size tuples
+  void publishInclusion(unsigned relation_id, unsigned col_id, unsigned key_relation_id,
+                        unsigned key_col_id, uint64_t size, bool holds);
+
+ private:
+  /// A column and the key column it may be included in
+  using ColumnPair = std::tuple<unsigned, unsigned, unsigned, unsigned>;
+
+  /// The statistics by relation and column
+  std::vector<std::vector<std::shared_ptr<const ColumnStats>>> columns_;
+  /// Protects claimed_
+  std::mutex claim_mutex_;
+  /// Whether the statistics of a column are computed, by relation and column
+  std::vector<std::vector<bool>> claimed_;
+  /// Protects inclusions_
+  mutable std::mutex inclusion_mutex_;
+  /// Verified (or claimed) inclusion dependencies and the tuples they cover
+  std::map<ColumnPair, std::pair<uint64_t, Inclusion>> inclusions_;
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+
+/// Parser of pipe-delimited .tbl files, one tuple per line ("1|2|3|", the
+/// last delimiter is optional). The file is split into chunks at line
+/// boundaries; one parallel pass counts the tuples of every chunk, a second
+/// one parses every chunk straight into its rows of the columns
+class TblParser {
+ public:
+  /// The constructor
+  TblParser(const char *data, uint64_t length) : data_(data), length_(length) {}
+
+  /// Whether a file name has the .tbl extension
+  static bool isTblFile(const std::string &file_name);
+
+  /// Split into chunks and count the tuples. False if the first line has
+  /// no values
+  bool scan(ThreadPool &pool);
+  /// The number of tuples
+  uint64_t size() const { return size_; }
+  /// The number of columns
+  unsigned numColumns() const { return num_columns_; }
+  /// Parse the values into columns with room for size() values each. False
+  /// if a line is malformed
+  bool parse(ThreadPool &pool, const std::vector<uint64_t *> &columns);
+
+ private:
+  /// Parse the lines of [begin, end) into the rows from first_row on
+  bool parseChunk(const char *begin, const char *end, uint64_t first_row,
+                  const std::vector<uint64_t *> &columns);
+
+  /// The text
+  const char *data_;
+  /// The length of the text
+  uint64_t length_;
+  /// Chunk boundaries (offsets of line starts, and length_)
+  std::vector<uint64_t> bounds_;
+  /// The first row of every chunk
+  std::vector<uint64_t> first_rows_;
+  /// The number of tuples
+  uint64_t size_ = 0;
+  /// The number of columns
+  unsigned num_columns_ = 0;
+};
@@ -1,10 +1,13 @@
 #include "joiner.h"
 
 #include <cassert>
+#include <chrono>
 #include <iostream>
+#include <limits>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <map>
 #include <set>
 #include <sstream>
 #include <vector>
@@ -12,7 +15,9 @@
 // #include <boost/thread.hpp>
 // #include <boost/asio/io_service.hpp>
 
+#include "governor.h"
 #include "parser.h"
+#include "runtime.h"
 
 namespace
 {
@@ -40,6 +45,53 @@ QueryGraphProvides analyzeInputOfJoin(std::set<unsigned> &usedRelations,
   return QueryGraphProvides::None;
 }
 
+// Normalized text of a query, used as cache key. Includes the versions of
+// the relations, results from before an append are never hit again
+std::string normalizedQuery(QueryInfo &query, const std::vector<Relation> &relations)
+{
+  std::vector<std::string> predicates, filters;
+  for (auto p_info : query.predicates())
+  {
+    if (std::tie(p_info.right.binding, p_info.right.col_id) <
+        std::tie(p_info.left.binding, p_info.left.col_id))
+      std::swap(p_info.left, p_info.right);
+    predicates.push_back(p_info.dumpText());
+  }
+  for (auto f_info : query.filters())
+    filters.push_back(f_info.dumpText());
+  std::sort(predicates.begin(), predicates.end());
+  std::sort(filters.begin(), filters.end());
+
+  std::stringstream key;
+  for (auto rel_id : query.relation_ids())
+    key << rel_id << "v" << (rel_id < relations.size() ? relations[rel_id].version() : 0) << " ";
+  key << "|";
+  for (auto &p : predicates)
+    key << p << "&";
+  for (auto &f : filters)
+    key << f << "&";
+  key << "|";
+  for (auto s_info : query.selections())
+    key << s_info.dumpText() << " ";
+  return key.str();
+}
+
+// Extend statistics of the first rows of a column to all of its rows
+std::shared_ptr<const ColumnStats> extendStats(const Relation &relation,
+                                               unsigned col_id,
+                                               std::shared_ptr<const ColumnStats> stats)
+{
+  auto total = relation.totalSize();
+  if (stats->size >= total)
+    return stats;
+  std::vector<uint64_t> values(total - stats->size);
+  relation.copyValues(col_id, stats->size, total, values.data());
+  uint64_t previous = 0;
+  if (stats->size > 0)
+    relation.copyValues(col_id, stats->size - 1, stats->size, &previous);
+  return ColumnStats::extend(*stats, previous, values.data(), values.size());
+}
+
 } // namespace
 
 std::vector<std::vector<std::vector<int>>> histogramList;
@@ -49,17 +101,212 @@ void Joiner::appendHistogram(std::vector<std::vector<int>> histogram)
   histogramList.push_back(histogram);
 }
 
-// Loads a relation_ from disk
+// Starts loading a relation_ from disk on the pool
 void Joiner::addRelation(const char *file_name)
 {
-  relations_.emplace_back(file_name);
+  loads_.push_back(RelationLoad{file_name, nullptr});
+  Runtime::get().pool().spawn(loading_, loads_.back());
 }
 
 void Joiner::addRelation(Relation &&relation)
 {
+  finishLoading();
   relations_.emplace_back(std::move(relation));
 }
 
+// Waits for the pending loads and registers them in order
+void Joiner::finishLoading()
+{
+  if (loads_.empty())
+    return;
+  Runtime::get().pool().wait(loading_);
+  for (auto &load : loads_)
+    relations_.push_back(std::move(*load.relation));
+  loads_.clear();
+}
+
+// Appends tuples to a relation
+void Joiner::append(RelationId rel_id, const std::vector<std::vector<uint64_t>> &columns)
+{
+  finishLoading();
+  auto &relation = relations_[rel_id];
+  {
+    // Statistics that are still being computed extend themselves when
+    // they are published
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    relation.append(columns);
+    for (unsigned col_id = 0; col_id < relation.columns().size(); ++col_id)
+    {
+      if (auto stats = stats_.get(rel_id, col_id))
+        stats_.publish(rel_id, col_id, extendStats(relation, col_id, move(stats)));
+    }
+  }
+  queueMerge(rel_id);
+}
+
+// Publish statistics extended to the appended tuples
+void Joiner::publishStats(RelationId rel_id, unsigned col_id,
+                          std::shared_ptr<const ColumnStats> stats)
+{
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  stats_.publish(rel_id, col_id, extendStats(relations_[rel_id], col_id, move(stats)));
+}
+
+// Compute the statistics of a join key now
+void Joiner::requireStats(const SelectInfo &info)
+{
+  if (!stats_.claim(info.rel_id, info.col_id))
+    return;
+  auto &relation = relations_[info.rel_id];
+  auto stats = ColumnStats::compute(relation.columns()[info.col_id], relation.size());
+  publishStats(info.rel_id, info.col_id, stats);
+  addDerivedWork(info.rel_id, info.col_id, stats);
+}
+
+// Queue the merge of the delta of a relation
+void Joiner::queueMerge(RelationId rel_id)
+{
+  {
+    std::lock_guard<std::mutex> lock(merge_mutex_);
+    merges_.resize(relations_.size());
+    merging_.resize(relations_.size(), false);
+    if (merging_[rel_id])
+      return;
+    merging_[rel_id] = true;
+  }
+  prep_.add(PrepScheduler::Merge, [this, rel_id] {
+    auto merged = relations_[rel_id].buildMerge();
+    std::lock_guard<std::mutex> lock(merge_mutex_);
+    merging_[rel_id] = merged != nullptr;
+    merges_[rel_id] = move(merged);
+  });
+}
+
+// Install the finished merges
+void Joiner::installMerges()
+{
+  // Preparation work may still read the old columns
+  if (prep_.pending() > 0)
+    return;
+  std::vector<RelationId> installed;
+  {
+    std::lock_guard<std::mutex> lock(merge_mutex_);
+    for (RelationId rel_id = 0; rel_id < merges_.size(); ++rel_id)
+    {
+      if (!merges_[rel_id])
+        continue;
+      relations_[rel_id].installMerge(move(merges_[rel_id]));
+      merging_[rel_id] = false;
+      installed.push_back(rel_id);
+    }
+  }
+  for (auto rel_id : installed)
+  {
+    // The encodings of the old columns are gone
+    for (unsigned col_id = 0; col_id < relations_[rel_id].columns().size(); ++col_id)
+    {
+      if (auto stats = stats_.get(rel_id, col_id))
+        addDerivedWork(rel_id, col_id, stats);
+    }
+    // Tuples appended during the merge
+    if (relations_[rel_id].delta())
+      queueMerge(rel_id);
+  }
+}
+
+// Start the preparation work
+void Joiner::startPreparation(std::chrono::milliseconds budget)
+{
+  finishLoading();
+  stats_.init(relations_);
+  auto &runtime = Runtime::get();
+  for (RelationId rel_id = 0; rel_id < relations_.size(); ++rel_id)
+  {
+    auto &relation = relations_[rel_id];
+    for (unsigned col_id = 0; col_id < relation.columns().size(); ++col_id)
+    {
+      auto values = relation.columns()[col_id];
+      auto size = relation.size();
+      // Lazily loaded relations are faulted in first
+      if (!runtime.prefault() && !runtime.numaEnabled())
+      {
+        prep_.add(PrepScheduler::WarmUp, [values, size] {
+          Relation::prefault(reinterpret_cast<const char *>(values), size * sizeof(uint64_t));
+        });
+      }
+      // Statistics stored in a v2 file are used as they are
+      if (auto stats = relation.storedStats(col_id))
+      {
+        publishStats(rel_id, col_id, stats);
+        addDerivedWork(rel_id, col_id, stats);
+        continue;
+      }
+      prep_.add(PrepScheduler::Stats, [this, rel_id, col_id, values, size] {
+        // A query may have needed them first
+        if (!stats_.claim(rel_id, col_id))
+          return;
+        auto stats = ColumnStats::compute(values, size);
+        publishStats(rel_id, col_id, stats);
+        addDerivedWork(rel_id, col_id, stats);
+      });
+    }
+  }
+  if (runtime.snapshots())
+    prep_.onDone([this] { storeSnapshots(); });
+  prep_.start(runtime.pool(), budget);
+}
+
+// Keep the prepared metadata of the relations for the next start
+void Joiner::storeSnapshots()
+{
+  for (RelationId rel_id = 0; rel_id < relations_.size(); ++rel_id)
+  {
+    auto &relation = relations_[rel_id];
+    // The file no longer holds all tuples of an appended relation
+    if (relation.hasStoredMetadata() || relation.version() > 0)
+      continue;
+    std::vector<StoredColumn> columns(relation.columns().size());
+    for (unsigned col_id = 0; col_id < columns.size(); ++col_id)
+    {
+      columns[col_id].stats = stats_.get(rel_id, col_id);
+      columns[col_id].encoded = relation.encoded(col_id);
+    }
+    relation.storeSnapshot(columns);
+  }
+}
+
+// Queue the work that needs the statistics of a column
+void Joiner::addDerivedWork(RelationId rel_id, unsigned col_id,
+                            std::shared_ptr<const ColumnStats> stats)
+{
+  auto values = relations_[rel_id].columns()[col_id];
+  // The statistics may cover appended tuples beyond the main columns
+  auto size = relations_[rel_id].size();
+  if (Runtime::get().compress() && !relations_[rel_id].encoded(col_id))
+  {
+    prep_.add(PrepScheduler::Encode, [this, rel_id, col_id, values, size, stats] {
+      relations_[rel_id].setEncoded(col_id, EncodedColumn::encode(
+          values, size, stats->min, stats->max, stats->distinct));
+    });
+  }
+  // Keys of a relation with a delta are checked after the merge
+  if (stats->keys_checked || stats->size != size)
+    return;
+  prep_.add(PrepScheduler::Keys, [this, rel_id, col_id, values, stats] {
+    auto checked = std::make_shared<ColumnStats>(*stats);
+    checked->unique = ColumnStats::isUnique(values, *stats);
+    checked->keys_checked = true;
+    publishStats(rel_id, col_id, checked);
+  });
+}
+
+// The destructor
+Joiner::~Joiner()
+{
+  // The loads reference loads_
+  Runtime::get().pool().wait(loading_);
+}
+
 // Loads a relation from disk
 const Relation &Joiner::getRelation(unsigned relation_id)
 {
@@ -72,10 +319,93 @@ const Relation &Joiner::getRelation(unsigned relation_id)
   return relations_[relation_id];
 }
 
+// Drop the joins that only check that a key exists
+void Joiner::eliminateJoins(QueryInfo &query)
+{
+  for (unsigned i = 0; i < query.predicates().size();)
+  {
+    auto p_info = query.predicates()[i];
+    bool dropped = true;
+    if (checksKeyOnly(query, p_info.left, p_info.right))
+      query.dropPredicate(i, p_info.left);
+    else if (checksKeyOnly(query, p_info.right, p_info.left))
+      query.dropPredicate(i, p_info.right);
+    else
+      dropped = false;
+    // The relation joined to the dropped one may only check a key now
+    i = dropped ? 0 : i + 1;
+  }
+}
+
+// Whether a join with a key only checks that the values of a column exist
+bool Joiner::checksKeyOnly(QueryInfo &query, const SelectInfo &column, const SelectInfo &key)
+{
+  if (column.binding == key.binding)
+    return false;
+  // The query reads nothing of the key side but the key (equal to the column)
+  unsigned joins = 0;
+  for (auto &p_info : query.predicates())
+    joins += (p_info.left.binding == key.binding) + (p_info.right.binding == key.binding);
+  if (joins != 1)
+    return false;
+  for (auto &f_info : query.filters())
+  {
+    if (f_info.filter_column.binding == key.binding)
+      return false;
+  }
+  for (auto &s_info : query.selections())
+  {
+    if (s_info.binding == key.binding && s_info.col_id != key.col_id)
+      return false;
+  }
+
+  // Every tuple has exactly one partner if the key is unique and has every
+  // value of the column
+  auto key_stats = stats_.get(key.rel_id, key.col_id);
+  if (!key_stats || !key_stats->keys_checked || !key_stats->unique ||
+      key_stats->size != getRelation(key.rel_id).totalSize())
+    return false;
+  auto inclusion = stats_.inclusion(column.rel_id, column.col_id, key.rel_id, key.col_id,
+                                    getRelation(column.rel_id).totalSize());
+  if (inclusion == Statistics::Inclusion::Unknown)
+    verifyInclusion(column, key);
+  return inclusion == Statistics::Inclusion::Holds;
+}
+
+// Verify that every value of a column occurs in a key column
+void Joiner::verifyInclusion(const SelectInfo &column, const SelectInfo &key)
+{
+  auto &relation = relations_[column.rel_id];
+  auto &key_relation = relations_[key.rel_id];
+  auto stats = stats_.get(column.rel_id, column.col_id);
+  auto key_stats = stats_.get(key.rel_id, key.col_id);
+  // Relations with a delta are verified after the merge
+  if (!stats || stats->size != relation.size() || relation.size() != relation.totalSize() ||
+      key_stats->size != key_relation.size())
+    return;
+  RelationId rel_id = column.rel_id, key_rel_id = key.rel_id;
+  unsigned col_id = column.col_id, key_col_id = key.col_id;
+  // The sketches rule most pairs out right away
+  if (!ColumnStats::mayBeIncluded(*stats, *key_stats))
+  {
+    stats_.publishInclusion(rel_id, col_id, key_rel_id, key_col_id, stats->size, false);
+    return;
+  }
+  if (!stats_.claimInclusion(rel_id, col_id, key_rel_id, key_col_id, stats->size))
+    return;
+  auto values = relation.columns()[col_id];
+  auto key_values = key_relation.columns()[key_col_id];
+  prep_.add(PrepScheduler::Keys, [this, rel_id, col_id, key_rel_id, key_col_id, values,
+                                  stats, key_values, key_stats] {
+    stats_.publishInclusion(rel_id, col_id, key_rel_id, key_col_id, stats->size,
+                            ColumnStats::isIncluded(values, *stats, key_values, *key_stats));
+  });
+}
+
 // Add scan to query
 std::shared_ptr<Operator> Joiner::addScan(std::set<unsigned> &used_relations,
                                           const SelectInfo &info,
-                                          QueryInfo &query)
+                                          QueryInfo &query, Arena &arena)
 {
   used_relations.emplace(info.binding);
   std::vector<FilterInfo> filters;
@@ -86,9 +416,92 @@ std::shared_ptr<Operator> Joiner::addScan(std::set<unsigned> &used_relations,
       filters.emplace_back(f);
     }
   }
-  return !filters.empty() ? std::make_shared<FilterScan>(getRelation(info.rel_id), filters)
-                          : std::make_shared<Scan>(getRelation(info.rel_id),
-                                                   info.binding);
+  if (filters.empty())
+  {
+    auto scan = std::make_shared<Scan>(getRelation(info.rel_id), info.binding);
+    scan->setArena(&arena);
+    addSortedKeys(*scan, info.binding, query);
+    return scan;
+  }
+  auto scan = std::make_shared<FilterScan>(getRelation(info.rel_id), filters);
+  scan->setCache(&cache_);
+  scan->setArena(&arena);
+  addSortedKeys(*scan, info.binding, query);
+  addZoneMaps(*scan, info.rel_id, filters);
+  return scan;
+}
+
+// Hand the zone maps of the filtered columns to a filter scan
+void Joiner::addZoneMaps(FilterScan &scan, RelationId rel_id, const std::vector<FilterInfo> &filters)
+{
+  for (auto &f : filters)
+  {
+    // The statistics have to cover the appended tuples as well
+    auto stats = stats_.get(rel_id, f.filter_column.col_id);
+    if (stats && stats->size == getRelation(rel_id).totalSize())
+      scan.addZoneMap(f.filter_column.col_id, move(stats));
+  }
+}
+
+// Declare the join keys of a binding that are sorted in its relation
+void Joiner::addSortedKeys(Operator &scan, unsigned binding, QueryInfo &query)
+{
+  for (auto &p_info : query.predicates())
+  {
+    for (auto &key : {p_info.left, p_info.right})
+    {
+      if (key.binding != binding)
+        continue;
+      // The statistics have to cover the appended tuples as well
+      auto stats = stats_.get(key.rel_id, key.col_id);
+      if (stats && stats->sorted && stats->size == getRelation(key.rel_id).totalSize())
+        scan.addSortedOn(key);
+    }
+  }
+}
+
+// Add join to query
+std::shared_ptr<Operator> Joiner::addJoin(std::shared_ptr<Operator> &&left,
+                                          std::shared_ptr<Operator> &&right,
+                                          const PredicateInfo &p_info,
+                                          Arena &arena, double left_rows,
+                                          double right_rows)
+{
+  // A join on the key of a factorized result becomes another input of it
+  auto factorized = std::dynamic_pointer_cast<FactorizedJoin>(left);
+  if (factorized && factorized->joinsOn(p_info.left))
+  {
+    factorized->addInput(move(right), p_info.right);
+    return factorized;
+  }
+  factorized = std::dynamic_pointer_cast<FactorizedJoin>(right);
+  if (factorized && factorized->joinsOn(p_info.right))
+  {
+    factorized->addInput(move(left), p_info.left);
+    return factorized;
+  }
+  // Many-to-many joins stay factorized, which needs the distinct counts
+  requireStats(p_info.left);
+  requireStats(p_info.right);
+  if (factorizes(left_rows, right_rows, p_info))
+  {
+    auto join = std::make_shared<FactorizedJoin>(move(left), move(right), p_info);
+    join->setArena(&arena);
+    return join;
+  }
+  // Inputs sorted on their keys merge without random accesses, and very
+  // large inputs are cheaper to sort than to hash
+  if ((left->sortedOn(p_info.left) && right->sortedOn(p_info.right)) ||
+      std::min(left_rows, right_rows) >= MergeJoin::kMinSortSize)
+  {
+    auto join = std::make_shared<MergeJoin>(move(left), move(right), p_info);
+    join->setArena(&arena);
+    return join;
+  }
+  auto join = std::make_shared<Join>(move(left), move(right), p_info);
+  join->setBatch(&batch_);
+  join->setArena(&arena);
+  return join;
 }
 
 double Joiner::isFilterScan(const SelectInfo &info, QueryInfo &query)
@@ -151,9 +564,36 @@ bool Joiner::sortPredicateInfoByEqualsFirst(PredicateInfo &left, PredicateInfo &
 // Executes a join query
 std::string Joiner::join(std::string line, int index)
 {
-  std::set<unsigned> used_relations;
   QueryInfo query;
   query.parseQuery(line);
+  try
+  {
+    aggResults[index] = join(query);
+  }
+  catch (const SpillError &error)
+  {
+    // Only this query lost its intermediates
+    std::cerr << "query " << index << " failed: " << error.what() << std::endl;
+    aggResults[index] = "ERROR\n";
+  }
+  return aggResults[index];
+}
+
+// Executes a join query
+std::string Joiner::join(QueryInfo &original)
+{
+  auto key = normalizedQuery(original, relations_);
+  if (auto cached = cache_.lookup(key))
+    return cached->checksums;
+  auto start = std::chrono::steady_clock::now();
+  // Intermediates of the query, released (to the chunk pool) after the
+  // operators below
+  Arena arena;
+  // Joins that only check that a key exists are dropped
+  QueryInfo query = original;
+  eliminateJoins(query);
+
+  std::set<unsigned> used_relations;
   // We always start with the first join predicate and append the other joins
   // to it (--> left-deep join trees). You might want to choose a smarter
   // join ordering ...
@@ -170,12 +610,25 @@ std::string Joiner::join(std::string line, int index)
   //   std::cerr << predicates_copy[i].selectivity << std::endl;
   // }
 
-  const auto &firstJoin = predicates_copy[0];
-  std::shared_ptr<Operator> left, right;
-  left = addScan(used_relations, firstJoin.left, query);
-  right = addScan(used_relations, firstJoin.right, query);
-  std::shared_ptr<Operator>
-      root = std::make_shared<Join>(move(left), move(right), firstJoin);
+  std::shared_ptr<Operator> left, right, root;
+  double root_rows = 0, scan_rows = 0;
+  if (predicates_copy.empty())
+  {
+    // All joins were dropped, the query reads a single relation
+    root = addScan(used_relations, query.selections()[0], query, arena);
+  }
+  else
+  {
+    const auto &firstJoin = predicates_copy[0];
+    left = addScan(used_relations, firstJoin.left, query, arena);
+    right = addScan(used_relations, firstJoin.right, query, arena);
+    root_rows = estimateCardinality(query, firstJoin.left.binding);
+    scan_rows = estimateCardinality(query, firstJoin.right.binding);
+    root = addJoin(move(left), move(right), firstJoin, arena, root_rows, scan_rows);
+    // Only the first join is over base relations, its result may be cached
+    root->setCache(&cache_);
+    root_rows = estimateJoinSize(root_rows, scan_rows, firstJoin);
+  }
 
   for (unsigned i = 1; i < predicates_copy.size(); ++i)
   {
@@ -187,21 +640,28 @@ std::string Joiner::join(std::string line, int index)
     {
     case QueryGraphProvides::Left:
       left = move(root);
-      right = addScan(used_relations, right_info, query);
-      root = std::make_shared<Join>(move(left), move(right), p_info);
+      right = addScan(used_relations, right_info, query, arena);
+      scan_rows = estimateCardinality(query, right_info.binding);
+      root = addJoin(move(left), move(right), p_info, arena, root_rows, scan_rows);
+      root_rows = estimateJoinSize(root_rows, scan_rows, p_info);
       break;
     case QueryGraphProvides::Right:
       left = addScan(used_relations,
                      left_info,
-                     query);
+                     query, arena);
       right = move(root);
-      root = std::make_shared<Join>(move(left), move(right), p_info);
+      scan_rows = estimateCardinality(query, left_info.binding);
+      root = addJoin(move(left), move(right), p_info, arena, scan_rows, root_rows);
+      root_rows = estimateJoinSize(scan_rows, root_rows, p_info);
       break;
     case QueryGraphProvides::Both:
       // All relations of this join are already used somewhere else in the
       // query. Thus, we have either a cycle in our join graph or more than
       // one join predicate per join.
       root = std::make_shared<SelfJoin>(move(root), p_info);
+      root->setArena(&arena);
+      // Another predicate between the joined relations only filters
+      root_rows = std::min(root_rows, estimateJoinSize(root_rows, root_rows, p_info));
       break;
     case QueryGraphProvides::None:
       // Process this predicate later when we can connect it to the other
@@ -222,15 +682,223 @@ std::string Joiner::join(std::string line, int index)
       out << " ";
   }
   out << "\n";
-  aggResults[index] = out.str();
-  return out.str();
+
+  auto result = std::make_shared<CachedResult>();
+  result->checksums = out.str();
+  std::chrono::duration<double, std::micro> cost =
+      std::chrono::steady_clock::now() - start;
+  cache_.insert(key, result, cost.count());
+  return result->checksums;
+}
+
+// Share the filter scans and build sides of a batch
+void Joiner::prepareBatch(const std::vector<std::string> &lines)
+{
+  // Distinct filter scans per relation, skipping already cached ones
+  std::map<RelationId, std::map<std::string, std::shared_ptr<FilterScan>>> pending;
+  for (auto line : lines)
+  {
+    QueryInfo query;
+    query.parseQuery(line);
+    if (cache_.lookup(normalizedQuery(query, relations_)))
+      continue;
+    std::vector<std::string> signatures;
+    for (unsigned binding = 0; binding < query.relation_ids().size(); ++binding)
+    {
+      std::vector<FilterInfo> filters;
+      for (auto &f : query.filters())
+      {
+        if (f.filter_column.binding == binding)
+          filters.emplace_back(f);
+      }
+      auto rel_id = query.relation_ids()[binding];
+      if (filters.empty())
+      {
+        signatures.push_back(Scan(getRelation(rel_id), binding).signature());
+        continue;
+      }
+      auto scan = std::make_shared<FilterScan>(getRelation(rel_id), filters);
+      addZoneMaps(*scan, rel_id, filters);
+      signatures.push_back(scan->signature());
+      auto key = scan->cacheKey();
+      if (!cache_.lookup(key))
+        pending[rel_id].emplace(key, move(scan));
+    }
+    // Either input of a join may end up as its build side
+    for (auto &p_info : query.predicates())
+    {
+      batch_.expectBuild(BatchContext::buildKey(signatures[p_info.left.binding],
+                                                p_info.left.col_id));
+      batch_.expectBuild(BatchContext::buildKey(signatures[p_info.right.binding],
+                                                p_info.right.col_id));
+    }
+  }
+
+  for (auto &[rel_id, scans] : pending)
+  {
+    // A single scan is cheaper on its own
+    if (scans.size() < 2)
+      continue;
+    SharedScan shared_scan(getRelation(rel_id));
+    for (auto &entry : scans)
+      shared_scan.add(entry.second);
+    shared_scan.run(cache_);
+  }
+}
+
+// Release the state shared by the queries of a batch
+void Joiner::finishBatch()
+{
+  batch_.clear();
+}
+
+// Estimate the tuples of a binding that pass its filters
+double Joiner::estimateCardinality(QueryInfo &query, unsigned binding)
+{
+  double cardinality = getRelation(query.relation_ids()[binding]).totalSize();
+  for (auto &f : query.filters())
+  {
+    if (f.filter_column.binding != binding)
+      continue;
+    // Use the statistics if the preparation phase got to the column
+    auto stats = stats_.get(f.filter_column.rel_id, f.filter_column.col_id);
+    if (stats)
+      cardinality *= stats->selectivity(f.comparison, f.constant);
+    else
+      cardinality *= f.comparison == FilterInfo::Comparison::Equal ? 0.01 : 0.5;
+  }
+  return cardinality;
+}
+
+// Estimate the cost of a query
+double Joiner::estimateCost(QueryInfo &query)
+{
+  double cost = 0;
+  for (unsigned binding = 0; binding < query.relation_ids().size(); ++binding)
+  {
+    // The scan is paid in full, only its output flows into the joins
+    cost += getRelation(query.relation_ids()[binding]).totalSize() +
+            estimateCardinality(query, binding);
+  }
+  return cost;
+}
+
+// Estimate the result size of a join
+double Joiner::estimateJoinSize(double left_rows, double right_rows, const PredicateInfo &p_info)
+{
+  // Every key of the smaller domain finds its partners in the larger one
+  auto distinct = [&](const SelectInfo &info) {
+    auto stats = stats_.get(info.rel_id, info.col_id);
+    return stats && stats->distinct ? double(stats->distinct) : 1.0;
+  };
+  return left_rows * right_rows / std::max(distinct(p_info.left), distinct(p_info.right));
+}
+
+// Whether a join stays factorized
+bool Joiner::factorizes(double left_rows, double right_rows, const PredicateInfo &p_info)
+{
+  // Without the distinct counts every join would look many-to-many
+  auto known = [&](const SelectInfo &info) {
+    auto stats = stats_.get(info.rel_id, info.col_id);
+    return stats && stats->distinct;
+  };
+  if (!known(p_info.left) || !known(p_info.right))
+    return false;
+  return estimateJoinSize(left_rows, right_rows, p_info) >=
+         FactorizedJoin::kMinExpansion * (left_rows + right_rows);
+}
+
+// Estimate the peak memory of the intermediates of a query
+uint64_t Joiner::estimateMemory(QueryInfo &query)
+{
+  // Columns every binding contributes to the intermediates
+  std::vector<std::set<unsigned>> columns(query.relation_ids().size());
+  for (auto &info : query.selections())
+    columns[info.binding].insert(info.col_id);
+  for (auto &p_info : query.predicates())
+  {
+    columns[p_info.left.binding].insert(p_info.left.col_id);
+    columns[p_info.right.binding].insert(p_info.right.col_id);
+  }
+
+  // Intermediates live until the query is done: the peak is their sum.
+  // Filter scans materialize the columns of their binding
+  double bytes = 0;
+  std::vector<double> cardinalities;
+  for (unsigned binding = 0; binding < query.relation_ids().size(); ++binding)
+  {
+    cardinalities.push_back(estimateCardinality(query, binding));
+    bool filtered = std::any_of(query.filters().begin(), query.filters().end(),
+                                [binding](const FilterInfo &f) { return f.filter_column.binding == binding; });
+    if (filtered)
+      bytes += cardinalities.back() * columns[binding].size() * sizeof(uint64_t);
+  }
+
+  // Joins in the order the plan adds them (left-deep, no cross products)
+  std::set<unsigned> joined;
+  double rows = 0, width = 0;
+  auto predicates = query.predicates();
+  // Deferred in a row: once all pending predicates were deferred without a
+  // join in between, the rest is not connected and never will be
+  uint64_t deferred = 0;
+  for (uint64_t i = 0; i < predicates.size() && deferred < predicates.size() - i; ++i)
+  {
+    auto &p_info = predicates[i];
+    bool has_left = joined.count(p_info.left.binding), has_right = joined.count(p_info.right.binding);
+    if (!joined.empty() && !has_left && !has_right)
+    {
+      predicates.push_back(p_info);
+      ++deferred;
+      continue;
+    }
+    deferred = 0;
+    if (joined.empty())
+    {
+      joined.insert(p_info.left.binding);
+      rows = cardinalities[p_info.left.binding];
+      width = columns[p_info.left.binding].size();
+      has_left = true;
+    }
+    if (has_left && has_right)
+      continue; // a self join only shrinks the result
+    auto added = has_left ? p_info.right.binding : p_info.left.binding;
+    joined.insert(added);
+    // The smaller input is hashed, the result follows the key domains
+    double build = std::min(rows, cardinalities[added]);
+    rows = estimateJoinSize(rows, cardinalities[added], p_info);
+    width += columns[added].size();
+    bytes += build * Join::kBuildTupleBytes + rows * width * sizeof(uint64_t);
+  }
+  return bytes < double(std::numeric_limits<uint64_t>::max() / 2) ? uint64_t(bytes)
+                                                                   : std::numeric_limits<uint64_t>::max() / 2;
 }
 
 void Joiner::asyncJoin(std::string line, int index)
 {
-  aggResults.emplace_back();
-  // asyncJoin(line, index);
-  threads.push_back(std::thread(&Joiner::join, this, line, index));
+  QueryInfo query;
+  query.parseQuery(line);
+  scheduler_.submit(estimateCost(query), [this, line, index] { join(line, index); },
+                    estimateMemory(query));
+}
+
+// Executes a batch of queries
+std::vector<std::string> Joiner::runBatch(const std::vector<std::string> &lines)
+{
+  // Queries arrived, the preparation work moves to the background
+  prep_.yield();
+  finishLoading();
+  installMerges();
+  prepareBatch(lines);
+  // Size the results up front, the queries write into them
+  aggResults.assign(lines.size(), "");
+  for (unsigned i = 0; i < lines.size(); ++i)
+    asyncJoin(lines[i], i);
+  scheduler_.wait();
+  finishBatch();
+
+  std::vector<std::string> results;
+  results.swap(aggResults);
+  return results;
 }
 
 double Joiner::estimateSelectivity(std::vector<int> histogram, uint64_t minVal, uint64_t maxVal, int bucketWidth, FilterInfo::Comparison op, uint64_t val, int nTups)
@@ -0,0 +1,44 @@
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "format.h"
+#include "relation.h"
+#include "runtime.h"
+
+// Converts relation files to format v2 in place: the statistics, key
+// properties and encodings the preparation phase would compute are
+// stored in the footer
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " <relation file>..." << std::endl;
+    return 1;
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    std::string file_name = argv[i];
+    std::vector<StoredColumn> columns;
+    {
+      Relation relation(file_name.c_str());
+      columns.resize(relation.columns().size());
+      Runtime::get().pool().parallel_for(0, columns.size(), [&](uint64_t c) {
+        auto values = relation.columns()[c];
+        auto stats = ColumnStats::compute(values, relation.size());
+        stats->unique = ColumnStats::isUnique(values, *stats);
+        stats->keys_checked = true;
+        columns[c].stats = stats;
+        columns[c].encoded = EncodedColumn::encode(values, stats->size, stats->min,
+                                                   stats->max, stats->distinct);
+      }, 1);
+      // The old file stays mapped until the new one replaced it
+      RelationFile::store(file_name + ".tmp", relation, columns);
+    }
+    if (std::rename((file_name + ".tmp").c_str(), file_name.c_str()) != 0) {
+      std::cerr << "cannot replace " << file_name << std::endl;
+      return 1;
+    }
+    std::cout << file_name << std::endl;
+  }
+
+  return 0;
+}
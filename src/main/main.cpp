@@ -2,6 +2,7 @@
 
 #include "joiner.h"
 #include "parser.h"
+#include "runtime.h"
 // #include <boost/thread.hpp>
 // #include <boost/asio/io_service.hpp>
 
@@ -13,6 +14,10 @@ int main(int argc, char *argv[]) {
     if (line == "Done") break;
     joiner.addRelation(line.c_str());
   }
+  joiner.finishLoading();
+  // Preparation phase: statistics are computed until the first batch
+  // arrives (or the budget is spent), then in the background
+  joiner.startPreparation(Runtime::get().prepBudget());
   // joiner.numCompleted = 0;
   // boost::thread_group threadpool;
   // boost::asio::io_service ioService;
@@ -36,27 +41,18 @@ int main(int argc, char *argv[]) {
 
   
 
-  QueryInfo i;
-  int index = 0;
+  // All queries of a batch arrive before its 'F' line
+  std::vector<std::string> batch;
   while (getline(std::cin, line)) {
     if (line == "F") {
-      for (auto& thread : joiner.threads) {
-        thread.join();
-      }
-      // while (joiner.numCompleted != index - 1) {
-      //   continue;
-      // }
-      for (std::string out: joiner.aggResults) {
+      for (auto &out : joiner.runBatch(batch)) {
         std::cout << out;
       }
-      joiner.threads.clear();
-      joiner.aggResults.clear();
-      index = 0;
+      batch.clear();
       continue; // End of a batch
     }
     // ioService.post(boost::bind(&Joiner::asyncJoin, &joiner, line, index));
-    joiner.asyncJoin(line, index);
-    ++index;
+    batch.push_back(line);
   }
 
   return 0;
@@ -1,32 +1,79 @@
 #include "operators.h"
-#include "ThreadPool.h"
+#include "runtime.h"
+#include "sort.h"
 
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include <algorithm>
 #include <numeric>
-#include <omp.h>
+#include <sstream>
 
-ThreadPool pool(16);
+ThreadPool &pool = Runtime::get().pool();
 
 // Get materialized results
 std::vector<uint64_t *> Operator::getResults()
 {
+  if (!spilled_results_.empty())
+  {
+    std::vector<uint64_t *> result_vector;
+    for (auto &column : spilled_results_)
+      result_vector.push_back(column->data());
+    return result_vector;
+  }
   uint64_t size = tmp_results_.size();
   std::vector<uint64_t *> result_vector(size);
-  // for (int i = 0; i < size; ++i)
-  // {
-  //   result_vector[i] = tmp_results_[i].data();
-  // }
-  
-  #pragma omp parallel num_threads(size)
+  for (uint64_t i = 0; i < size; ++i)
   {
-    int id = omp_get_thread_num();
-    result_vector[id] = tmp_results_[id].data();
+    result_vector[i] = tmp_results_[i].data();
   }
   return result_vector;
 }
 
+// The sum of a column over the results
+uint64_t Operator::sum(const SelectInfo &info)
+{
+  auto column = getResults()[resolve(info)];
+  uint64_t sum = 0;
+  for (auto iter = column, limit = iter + result_size_; iter != limit; ++iter)
+    sum += *iter;
+  return sum;
+}
+
+// The reservation of the operator
+Reservation &Operator::reservation()
+{
+  if (!reservation_)
+    reservation_ = std::make_shared<Reservation>(*governor_);
+  return *reservation_;
+}
+
+// Room for size results in every result column
+std::vector<uint64_t *> Operator::allocateResults(uint64_t size)
+{
+  std::vector<uint64_t *> columns;
+  if (size == 0 || reservation().grow(size * tmp_results_.size() * sizeof(uint64_t), arena_))
+  {
+    for (auto &column : tmp_results_)
+    {
+      column.resize(size);
+      columns.push_back(column.data());
+    }
+    return columns;
+  }
+
+  // Over budget: the kernel may write the results out instead of us dying
+  governor_->countSpill();
+  spilled_results_.clear();
+  for (unsigned col = 0; col < tmp_results_.size(); ++col)
+  {
+    spilled_results_.push_back(std::make_shared<SpillFile>(governor_->spillDir()));
+    spilled_results_.back()->resize(size);
+    columns.push_back(spilled_results_.back()->data());
+  }
+  return columns;
+}
+
 // Require a column and add it to results
 bool Scan::require(SelectInfo info)
 {
@@ -34,6 +81,7 @@ bool Scan::require(SelectInfo info)
     return false;
   assert(info.col_id < relation_.columns().size());
   result_columns_.push_back(relation_.columns()[info.col_id]);
+  col_ids_.push_back(info.col_id);
   select_to_result_col_id_[info] = result_columns_.size() - 1;
   return true;
 }
@@ -41,8 +89,15 @@ bool Scan::require(SelectInfo info)
 // Run
 void Scan::run()
 {
-  // Nothing to do
-  result_size_ = relation_.size();
+  delta_ = relation_.delta();
+  result_size_ = relation_.size() + (delta_ ? delta_->size : 0);
+  if (!delta_)
+    return;
+  // Appended tuples are not contiguous with the main columns: the scans
+  // share one copy with them appended until a merge folds them in
+  auto &contiguous = relation_.contiguous(*delta_);
+  for (unsigned cId = 0; cId < result_columns_.size(); ++cId)
+    result_columns_[cId] = contiguous.columns[col_ids_[cId]].get();
 }
 
 // Get materialized results
@@ -51,6 +106,31 @@ std::vector<uint64_t *> Scan::getResults()
   return result_columns_;
 }
 
+// Normalized description of the scanned input
+std::string Scan::signature() const
+{
+  // Relations are never moved once queries run, appends bump the version
+  return "r" + std::to_string(reinterpret_cast<uintptr_t>(&relation_)) + "v" +
+         std::to_string(relation_.version());
+}
+
+// Normalized description of the relation and its filters
+std::string FilterScan::signature() const
+{
+  std::vector<std::string> filters;
+  for (auto f : filters_)
+    filters.push_back("c" + std::to_string(f.filter_column.col_id) +
+                      static_cast<char>(f.comparison) +
+                      std::to_string(f.constant));
+  std::sort(filters.begin(), filters.end());
+  filters.erase(std::unique(filters.begin(), filters.end()), filters.end());
+
+  std::string signature = Scan::signature();
+  for (auto &f : filters)
+    signature += "&" + f;
+  return signature;
+}
+
 // Require a column and add it to results
 bool FilterScan::require(SelectInfo info)
 {
@@ -61,131 +141,317 @@ bool FilterScan::require(SelectInfo info)
   {
     // Add to results
     input_data_.push_back(relation_.columns()[info.col_id]);
-    tmp_results_.emplace_back();
+    input_col_ids_.push_back(info.col_id);
+    tmp_results_.push_back(newColumn());
     unsigned colId = tmp_results_.size() - 1;
     select_to_result_col_id_[info] = colId;
   }
   return true;
 }
 
-// Copy to result
-void FilterScan::copy2Result(uint64_t id)
-{
-  for (unsigned cId = 0; cId < input_data_.size(); ++cId)
-    tmp_results_[cId].push_back(input_data_[cId][id]);
-  ++result_size_;
-}
-
-// Apply filter
-bool FilterScan::applyFilter(uint64_t i, FilterInfo &f)
+// Append the ids of the tuples in a range that pass the filters
+void FilterScan::filterRange(uint64_t begin, uint64_t end,
+                             std::vector<uint64_t> &row_ids)
 {
-  auto compare_col = relation_.columns()[f.filter_column.col_id];
-  auto constant = f.constant;
-  switch (f.comparison)
+  if (zone_maps_.empty())
   {
-  case FilterInfo::Comparison::Equal:
-    return compare_col[i] == constant;
-  case FilterInfo::Comparison::Greater:
-    return compare_col[i] > constant;
-  case FilterInfo::Comparison::Less:
-    return compare_col[i] < constant;
-  };
-  return false;
+    filterRows(begin, end, row_ids);
+    return;
+  }
+  // Filter the runs of zones that may pass
+  uint64_t run_begin = begin;
+  for (uint64_t zone_begin = begin; zone_begin < end;)
+  {
+    uint64_t zone = zone_begin / ColumnStats::kZoneSize;
+    uint64_t zone_end = std::min(end, (zone + 1) * ColumnStats::kZoneSize);
+    if (!mayPass(zone))
+    {
+      filterRows(run_begin, zone_begin, row_ids);
+      run_begin = zone_end;
+    }
+    zone_begin = zone_end;
+  }
+  filterRows(run_begin, end, row_ids);
 }
 
-void FilterScan::mergeIntingTmpResults(int col)
+// Whether some tuple of a zone may pass the filters
+bool FilterScan::mayPass(uint64_t zone) const
 {
-  for (int threadIdx = 0; threadIdx < inting_tmp_results_.size(); ++threadIdx)
+  for (auto &f : filters_)
   {
-    auto data = inting_tmp_results_[threadIdx][col];
-    tmp_results_[col].insert(tmp_results_[col].end(), data.begin(), data.end());
+    auto it = zone_maps_.find(f.filter_column.col_id);
+    if (it == zone_maps_.end() || zone >= it->second->zone_min.size())
+      continue;
+    auto zone_min = it->second->zone_min[zone], zone_max = it->second->zone_max[zone];
+    switch (f.comparison)
+    {
+    case FilterInfo::Comparison::Equal:
+      if (f.constant < zone_min || f.constant > zone_max)
+        return false;
+      break;
+    case FilterInfo::Comparison::Greater:
+      if (zone_max <= f.constant)
+        return false;
+      break;
+    default:
+      if (zone_min >= f.constant)
+        return false;
+      break;
+    }
   }
+  return true;
 }
 
-void FilterScan::copy2ResultInting(uint64_t index, uint64_t id)
+// Append the ids of the tuples in a range that pass the filters
+void FilterScan::filterRows(uint64_t begin, uint64_t end,
+                            std::vector<uint64_t> &row_ids)
 {
-  for (unsigned cId = 0; cId < input_data_.size(); ++cId)
-    inting_tmp_results_[index][cId].push_back(input_data_[cId][id]);
-  // ++inting_result_sizes_[index];
+  if (begin >= end)
+    return;
+  uint64_t main_size = relation_.size();
+  if (begin < main_size)
+    filterMain(begin, std::min(end, main_size), row_ids);
+  if (end > main_size)
+    filterDelta(std::max(begin, main_size), end, row_ids);
 }
 
-void FilterScan::runTask(uint64_t lowerBound, uint64_t upperBound, int index)
+// Append the ids of the appended tuples in a range that pass the filters
+void FilterScan::filterDelta(uint64_t begin, uint64_t end,
+                             std::vector<uint64_t> &row_ids)
 {
-  inting_tmp_results_[index].resize(tmp_results_.size());
-  for (uint64_t i = lowerBound; i < upperBound; ++i)
+  auto delta = relation_.delta();
+  uint64_t offset = relation_.size();
+  uint64_t n = row_ids.size();
+  row_ids.resize(n + (end - begin));
+  for (uint64_t i = begin; i < end; ++i)
   {
     bool pass = true;
     for (auto &f : filters_)
     {
-      pass &= applyFilter(i, f);
-      if (!pass)
+      auto value = delta->columns[f.filter_column.col_id][i - offset];
+      switch (f.comparison)
+      {
+      case FilterInfo::Comparison::Equal:
+        pass &= value == f.constant;
         break;
+      case FilterInfo::Comparison::Greater:
+        pass &= value > f.constant;
+        break;
+      default:
+        pass &= value < f.constant;
+        break;
+      }
     }
-    if (pass)
-      copy2ResultInting(index, i);
+    row_ids[n] = i;
+    n += pass;
   }
+  row_ids.resize(n);
 }
 
-// Run
-void FilterScan::run()
+// Append the ids of the tuples of the main columns in a range that pass
+void FilterScan::filterMain(uint64_t begin, uint64_t end,
+                            std::vector<uint64_t> &row_ids)
 {
-
-  int desiredNumThreads = std::max((int)(relation_.size() / 10000), 1);
-  NUM_THREADS = std::min(desiredNumThreads, NUM_THREADS);
-  if (NUM_THREADS != 1) {
-    // std::vector<std::thread> threads;
-    inting_tmp_results_.resize(NUM_THREADS);
-    uint64_t size = relation_.size() / NUM_THREADS;
-
-    std::vector<std::future<void>> newThreads;
-
-    for (int i = 0; i < NUM_THREADS - 1; ++i)
+  uint64_t first = row_ids.size();
+  bool selected = false;
+  for (auto &f : filters_)
+  {
+    auto col_id = f.filter_column.col_id;
+    auto encoded = relation_.encoded(col_id);
+    if (encoded)
+    {
+      // Compare the codes, the values are never decoded
+      uint32_t lo, hi;
+      if (!encoded->codeRange(f.comparison, f.constant, lo, hi))
+      {
+        row_ids.resize(first);
+        return;
+      }
+      if (!selected)
+        encoded->select(begin, end, lo, hi, row_ids);
+      else
+        encoded->refine(lo, hi, row_ids, first);
+    }
+    else
     {
-      newThreads.emplace_back(pool.enqueue([&, i, size] { FilterScan::runTask(size * i, size * (i + 1), i); }));
-      // threads.push_back(std::thread(&FilterScan::runTask, this, size * i, size * (i + 1), i));
+      auto values = relation_.columns()[col_id];
+      auto constant = f.constant;
+      auto comparison = f.comparison;
+      auto pass = [values, constant, comparison](uint64_t i) {
+        switch (comparison)
+        {
+        case FilterInfo::Comparison::Equal:
+          return values[i] == constant;
+        case FilterInfo::Comparison::Greater:
+          return values[i] > constant;
+        default:
+          return values[i] < constant;
+        }
+      };
+      uint64_t n = selected ? first : row_ids.size();
+      if (!selected)
+      {
+        row_ids.resize(n + (end - begin));
+        for (uint64_t i = begin; i < end; ++i)
+        {
+          row_ids[n] = i;
+          n += pass(i);
+        }
+      }
+      else
+      {
+        for (uint64_t i = first; i < row_ids.size(); ++i)
+        {
+          auto row_id = row_ids[i];
+          row_ids[n] = row_id;
+          n += pass(row_id);
+        }
+      }
+      row_ids.resize(n);
     }
-    runTask((NUM_THREADS - 1) * size, relation_.size(), NUM_THREADS - 1);
+    selected = true;
+    if (row_ids.size() == first)
+      return;
+  }
+}
 
-    for (auto &&result : newThreads)
-      result.get();
+// Collect the ids of all tuples that pass the filters
+std::vector<uint64_t> FilterScan::selectRowIds()
+{
+  uint64_t limit = relation_.totalSize();
+  int numThreads = std::min(std::max((int)(limit / 10000), 1), NUM_THREADS);
+  uint64_t size = limit / numThreads;
+  std::vector<std::vector<uint64_t>> threadRowIds(numThreads);
 
-    newThreads.clear();
+  auto task = [&](int t) {
+    uint64_t upperBound = t == numThreads - 1 ? limit : size * (t + 1);
+    for (uint64_t m = size * t; m < upperBound; m += SharedScan::kMorselSize)
+      filterRange(m, std::min(m + SharedScan::kMorselSize, upperBound), threadRowIds[t]);
+  };
+  pool.parallel_for(0, numThreads, task, 1);
 
-    // for (auto &thread : threads)
-    // {
-    //   thread.join();
-    // }
+  if (numThreads == 1)
+    return std::move(threadRowIds[0]);
+  // Every thread copies its ids to their final position
+  std::vector<uint64_t> offsets(numThreads + 1, 0);
+  for (int t = 0; t < numThreads; ++t)
+    offsets[t + 1] = offsets[t] + threadRowIds[t].size();
+  std::vector<uint64_t> rowIds(offsets[numThreads]);
+  pool.parallel_for(0, numThreads, [&](uint64_t t) {
+    std::copy(threadRowIds[t].begin(), threadRowIds[t].end(), rowIds.begin() + offsets[t]);
+  }, 1);
+  return rowIds;
+}
 
-    // threads.clear();
-    for (int col = 0; col < tmp_results_.size() - 1; ++col)
+// Materialize the required columns of the given tuples
+void FilterScan::copyRowIds2Result(const std::vector<uint64_t> &row_ids)
+{
+  // The ids ascend, the ones of appended tuples come last
+  auto delta = relation_.delta();
+  uint64_t main_count = delta ? std::lower_bound(row_ids.begin(), row_ids.end(), relation_.size()) - row_ids.begin()
+                              : row_ids.size();
+  auto copyColumn = [&](unsigned cId) {
+    auto &column = tmp_results_[cId];
+    column.resize(row_ids.size());
+    if (delta)
+    {
+      auto &values = delta->columns[input_col_ids_[cId]];
+      for (uint64_t i = main_count; i < row_ids.size(); ++i)
+        column[i] = values[row_ids[i] - relation_.size()];
+    }
+    // Compressed columns are decoded while gathering
+    if (auto encoded = relation_.encoded(input_col_ids_[cId]))
     {
-      newThreads.emplace_back(pool.enqueue([&, col] { FilterScan::mergeIntingTmpResults(col); }));
-      // threads.push_back(std::thread(&FilterScan::mergeIntingTmpResults, this, col));
+      encoded->gather(row_ids.data(), main_count, column.data());
+      return;
     }
-    mergeIntingTmpResults(tmp_results_.size() - 1);
-    for (auto &&result : newThreads)
-      result.get();
-    // for (auto &thread : threads)
-    // {
-    //   thread.join();
-    // }
+    auto input = input_data_[cId];
+    for (uint64_t i = 0; i < main_count; ++i)
+      column[i] = input[row_ids[i]];
+  };
+  if (row_ids.size() > 10000)
+  {
+    pool.parallel_for(0, input_data_.size(), copyColumn, 1);
   }
   else
   {
-    for (uint64_t i = 0; i < relation_.size(); ++i)
+    for (unsigned cId = 0; cId < input_data_.size(); ++cId)
+      copyColumn(cId);
+  }
+}
+
+// Run through the subplan cache
+void FilterScan::runCached()
+{
+  auto key = cacheKey();
+  auto cached = cache_->lookup(key);
+  if (!cached)
+  {
+    auto start = std::chrono::steady_clock::now();
+    auto result = std::make_shared<CachedResult>();
+    result->row_ids = selectRowIds();
+    result->size = result->row_ids.size();
+    std::chrono::duration<double, std::micro> cost =
+        std::chrono::steady_clock::now() - start;
+    cache_->insert(key, result, cost.count());
+    cached = move(result);
+  }
+  copyRowIds2Result(cached->row_ids);
+  result_size_ = cached->size;
+}
+
+// Run the pass and insert the selection vectors into the cache
+void SharedScan::run(ResultCache &cache)
+{
+  auto start = std::chrono::steady_clock::now();
+  uint64_t limit = relation_.totalSize();
+  uint64_t numMorsels = (limit + kMorselSize - 1) / kMorselSize;
+  int numThreads = std::min<uint64_t>(std::max<uint64_t>(limit / 10000, 1), NUM_THREADS);
+  numThreads = std::min<uint64_t>(numThreads, std::max<uint64_t>(numMorsels, 1));
+  uint64_t morselsPerThread = (numMorsels + numThreads - 1) / numThreads;
+
+  // threadRowIds[t][s]: ids selected by scan s within the range of thread t
+  std::vector<std::vector<std::vector<uint64_t>>> threadRowIds(
+      numThreads, std::vector<std::vector<uint64_t>>(scans_.size()));
+  auto task = [&](int t) {
+    uint64_t lowerBound = std::min(t * morselsPerThread * kMorselSize, limit);
+    uint64_t upperBound = std::min(lowerBound + morselsPerThread * kMorselSize, limit);
+    for (uint64_t m = lowerBound; m < upperBound; m += kMorselSize)
     {
-      bool pass = true;
-      for (auto &f : filters_)
+      uint64_t morselEnd = std::min(m + kMorselSize, upperBound);
+      for (unsigned s = 0; s < scans_.size(); ++s)
       {
-        pass &= applyFilter(i, f);
-        if (!pass)
-          break;
+        scans_[s]->filterRange(m, morselEnd, threadRowIds[t][s]);
       }
-      if (pass)
-        copy2Result(i);
     }
+  };
+  pool.parallel_for(0, numThreads, task, 1);
+
+  std::chrono::duration<double, std::micro> cost =
+      std::chrono::steady_clock::now() - start;
+  for (unsigned s = 0; s < scans_.size(); ++s)
+  {
+    auto result = std::make_shared<CachedResult>();
+    for (int t = 0; t < numThreads; ++t)
+      result->row_ids.insert(result->row_ids.end(), threadRowIds[t][s].begin(),
+                             threadRowIds[t][s].end());
+    result->size = result->row_ids.size();
+    // Each scan would have paid for a pass of its own
+    cache.insert(scans_[s]->cacheKey(), move(result), cost.count());
+  }
+}
+
+// Run
+void FilterScan::run()
+{
+  if (cache_)
+  {
+    runCached();
+    return;
   }
-  result_size_ = tmp_results_[0].size();
+  auto row_ids = selectRowIds();
+  copyRowIds2Result(row_ids);
+  result_size_ = row_ids.size();
 }
 
 // Require a column and add it to results
@@ -207,70 +473,81 @@ bool Join::require(SelectInfo info)
     if (!success)
       return false;
 
-    tmp_results_.emplace_back();
+    tmp_results_.push_back(newColumn());
     requested_columns_.emplace(info);
   }
   return true;
 }
 
-// Copy to result
-void Join::copy2ResultInting(uint64_t left_id, uint64_t right_id, uint64_t index)
+// Cache key of a join of two (filtered) base relations
+std::string Join::cacheKey() const
 {
-  // left_inting_tmp_results_[index].push_back(left_id);
-  // right_inting_tmp_results_[index].push_back(right_id);
+  auto left_scan = dynamic_cast<const Scan *>(left_.get());
+  auto right_scan = dynamic_cast<const Scan *>(right_.get());
+  if (!left_scan || !right_scan)
+    return "";
 
-  unsigned rel_col_id = 0;
-  uint64_t leftCopySize = copy_left_data_.size();
-  uint64_t rightCopySize = copy_right_data_.size();
-  for (unsigned cId = 0; cId < leftCopySize; ++cId)
-  {
-    inting_tmp_results_[index][rel_col_id++].push_back(copy_left_data_[cId][left_id]);
-  }
-
-  for (unsigned cId = 0; cId < rightCopySize; ++cId)
-  {
-    inting_tmp_results_[index][rel_col_id++].push_back(copy_right_data_[cId][right_id]);
-  }
+  std::stringstream key;
+  key << "join:" << left_scan->signature() << "." << p_info_.left.col_id
+      << "=" << right_scan->signature() << "." << p_info_.right.col_id << "|";
+  for (auto &info : requested_columns_left_)
+    key << info.col_id << " ";
+  key << "|";
+  for (auto &info : requested_columns_right_)
+    key << info.col_id << " ";
+  return key.str();
 }
 
-void Join::mergeIntingTmpResults(int index, uint64_t offset)
+// Run
+void Join::run()
 {
-  // for (int threadIdx = 0; threadIdx < inting_tmp_results_.size(); ++threadIdx)
-  //   {
-  //     auto data = inting_tmp_results_[threadIdx][col];
-  //     tmp_results_[col].insert(tmp_results_[col].end(), data.begin(), data.end());
-  //   }
-  for (int col = 0; col < tmp_results_.size(); ++col)
+  auto key = cache_ ? cacheKey() : "";
+  if (key.empty())
   {
-    auto &data = inting_tmp_results_[index][col];
-    std::vector<uint64_t>::iterator it = tmp_results_[col].begin();
-    std::copy(data.begin(), data.end(), tmp_results_[col].begin() + offset);
+    runJoin();
+    return;
   }
-}
 
-void SelfJoin::mergeIntingTmpResults(int col)
-{
-  for (int threadIdx = 0; threadIdx < NUM_THREADS; ++threadIdx)
+  // Cached columns are ordered by request (left before right)
+  std::vector<SelectInfo> requested = requested_columns_left_;
+  requested.insert(requested.end(), requested_columns_right_.begin(),
+                   requested_columns_right_.end());
+
+  auto cached = cache_->lookup(key);
+  if (!cached)
   {
-    auto data = inting_tmp_results_[threadIdx][col];
-    tmp_results_[col].insert(tmp_results_[col].end(), data.begin(), data.end());
-  }
-}
+    auto start = std::chrono::steady_clock::now();
+    runJoin();
+    std::chrono::duration<double, std::micro> cost =
+        std::chrono::steady_clock::now() - start;
+    if (result_size_ * requested.size() * sizeof(uint64_t) >
+        cache_->capacity() / 4)
+      return;
 
-// Copy to result
-void Join::copy2Result(uint64_t left_id, uint64_t right_id)
-{
-  unsigned rel_col_id = 0;
-  for (unsigned cId = 0; cId < copy_left_data_.size(); ++cId)
-    tmp_results_[rel_col_id++].push_back(copy_left_data_[cId][left_id]);
+    auto result = std::make_shared<CachedResult>();
+    result->size = result_size_;
+    // Cached results outlive the arena of the query
+    auto results = getResults();
+    for (auto &info : requested)
+      result->columns.emplace_back(results[resolve(info)],
+                                   results[resolve(info)] + result_size_);
+    cache_->insert(key, move(result), cost.count());
+    return;
+  }
 
-  for (unsigned cId = 0; cId < copy_right_data_.size(); ++cId)
-    tmp_results_[rel_col_id++].push_back(copy_right_data_[cId][right_id]);
-  ++result_size_;
+  tmp_results_.clear();
+  for (auto &column : cached->columns)
+  {
+    tmp_results_.push_back(newColumn());
+    tmp_results_.back().assign(column.begin(), column.end());
+  }
+  for (unsigned col = 0; col < requested.size(); ++col)
+    select_to_result_col_id_[requested[col]] = col;
+  result_size_ = cached->size;
 }
 
-// Run
-void Join::run()
+// Execute the join
+void Join::runJoin()
 {
   left_->require(p_info_.left);
   left_->run();
@@ -317,194 +594,707 @@ void Join::run()
   auto right_col_id = right_->resolve(p_info_.right);
   int desiredNumThreads = std::max((int)(right_->result_size() / 10000), 1);
   NUM_THREADS = std::min(desiredNumThreads, NUM_THREADS);
-  // Build phase
-  // std::vector<std::thread> threads;
   auto left_key_column = left_input_data[left_col_id];
   auto right_key_column = right_input_data[right_col_id];
-  if (NUM_THREADS != 1)
-  {
-    std::vector<std::future<void>> newThreads;
-    uint64_t limit = left_->result_size();
-    uint64_t size = limit / (NUM_THREADS);
-    inting_tmp_results_.resize(NUM_THREADS);
-    inting_result_sizes_.resize(NUM_THREADS);
-    rightTableIndex.resize(NUM_THREADS);
-    if (left_->result_size() > 5000) {
-      leftTableIndex.resize(NUM_THREADS);
-      std::thread t1(&Join::populateLeftWork, this, (NUM_THREADS - 1) * size, limit, left_key_column, limit);
-      limit = right_->result_size();
-      size = limit / (NUM_THREADS);
-      for (uint64_t i = 0; i != limit; ++i)
-      {
-        uint64_t rightVal = right_key_column[i];
-        rightTableIndex[rightVal % NUM_THREADS].push_back(i);
-      }
-      t1.join();
-    } else {
-      limit = right_->result_size();
-      size = limit / (NUM_THREADS);
-      for (uint64_t i = 0; i != limit; ++i)
-      {
-        uint64_t rightVal = right_key_column[i];
-        rightTableIndex[rightVal % NUM_THREADS].push_back(i);
-      }
-    }
-    
-    // Probe phase
-    for (int j = 0; j < NUM_THREADS - 1; j++)
-    {
-      newThreads.emplace_back(pool.enqueue([&, j, size, right_key_column] { Join::runTask(j * size, size * (j + 1), j, left_key_column, right_key_column); }));
-    }
-    runTask((NUM_THREADS - 1) * size, limit, NUM_THREADS - 1, left_key_column, right_key_column);
+  uint64_t left_size = left_->result_size();
+  uint64_t right_size = right_->result_size();
+  uint64_t size = right_size / NUM_THREADS;
+  // The last range also takes the remainder
+  unsigned last_task = NUM_THREADS - 1;
+  // Private tables carry a narrow left payload in their entries: a match
+  // then reads one entry instead of one value per column
+  co_located_ = !copy_left_data_.empty() && copy_left_data_.size() <= JoinHashTable::kMaxPayload;
+  auto payload = co_located_ ? copy_left_data_ : std::vector<uint64_t *>();
+  // Private builds have to fit into the memory budget
+  bool partitioned = NUM_THREADS != 1 && left_size > 5000;
+  uint64_t build_bytes = left_size * (kBuildTupleBytes + payload.size() * sizeof(uint64_t)) +
+                         (partitioned ? (left_size + right_size) * sizeof(uint64_t) : 0);
 
-    for (auto &&result : newThreads)
-      result.get();
+  if (auto table = sharedBuildTable(left_key_column))
+  {
+    // Shared tables serve joins with different payloads
+    co_located_ = false;
+    // Probe the shared table with ranges of the right input
+    materialize(NUM_THREADS, [&](unsigned t, auto &&emit) {
+      uint64_t upperBound = t == last_task ? right_size : size * (t + 1);
+      table->probe(right_key_column, nullptr, size * t, upperBound, emit);
+    });
+  }
+  else if (!reservation().grow(build_bytes, arena_))
+  {
+    runGrace(left_key_column, right_key_column, payload);
+  }
+  else if (!partitioned)
+  {
+    // One table over the small left input, probed with ranges of the right
+    hashTables.assign(1, JoinHashTable(arena_));
+    auto &hash_table = hashTables[0];
+    hash_table.build(left_key_column, nullptr, left_size, payload);
+    materialize(NUM_THREADS, [&](unsigned t, auto &&emit) {
+      uint64_t upperBound = t == last_task ? right_size : size * (t + 1);
+      hash_table.probe(right_key_column, nullptr, size * t, upperBound, emit);
+    });
+  }
+  else
+  {
+    // Partition both inputs by key, every task joins one partition. Heavy
+    // keys would overload their partition: their build tuples go to a table
+    // every task probes, their probe tuples are dealt to all tasks
+    HeavyKeys heavy;
+    heavy.partitions.assign(NUM_THREADS, 0);
+    sampleHeavyKeys(left_key_column, left_size, heavy);
+    sampleHeavyKeys(right_key_column, right_size, heavy);
+    leftTableIndex.assign(NUM_THREADS + 1, newColumn());
+    rightTableIndex.assign(NUM_THREADS, newColumn());
+    rightHeavyIndex.assign(NUM_THREADS, newColumn());
+    TaskGroup populateLeft;
+    auto populateLeftTask = [&] { populateLeftWork(left_key_column, left_size, heavy); };
+    pool.spawn(populateLeft, populateLeftTask);
+    populateRightWork(right_key_column, right_size, heavy);
+    pool.wait(populateLeft);
 
-    newThreads.clear();
-    uint64_t totalSize = std::accumulate(inting_result_sizes_.begin(), inting_result_sizes_.end(), 0);
-    for (int col = 0; col < tmp_results_.size(); ++col)
-    {
-      tmp_results_[col].resize(totalSize);
-    }
-    uint64_t runningSumSize = 0;
-    for (int j = 0; j < NUM_THREADS - 1; ++j)
+    // The tables have to survive both passes, the last one holds the heavy keys
+    hashTables.assign(NUM_THREADS + 1, JoinHashTable(arena_));
+    pool.parallel_for(0, NUM_THREADS + 1, [&](uint64_t t) {
+      hashTables[t].build(left_key_column, leftTableIndex[t].data(), leftTableIndex[t].size(),
+                          payload);
+    }, 1);
+    materialize(NUM_THREADS, [&](unsigned t, auto &&emit) {
+      hashTables[t].probe(right_key_column, rightTableIndex[t].data(), 0,
+                          rightTableIndex[t].size(), emit);
+      hashTables[NUM_THREADS].probe(right_key_column, rightHeavyIndex[t].data(), 0,
+                                    rightHeavyIndex[t].size(), emit);
+    });
+  }
+}
+
+// Run the probe of every task twice: once to count the matches, once to
+// write them to their final position
+template <typename Probe>
+void Join::materialize(unsigned num_tasks, const Probe &probe)
+{
+  std::vector<uint64_t> offsets(num_tasks + 1, 0);
+  pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+    uint64_t count = 0;
+    probe(t, [&count](const uint64_t *, uint64_t) { ++count; });
+    offsets[t + 1] = count;
+  }, 1);
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  result_size_ = offsets[num_tasks];
+  auto results = allocateResults(result_size_);
+
+  pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+    uint64_t out = offsets[t];
+    probe(t, [&](const uint64_t *entry, uint64_t right_id) {
+      copyMatch(results.data(), out++, entry, right_id);
+    });
+  }, 1);
+}
+
+// Write a match to position out of the result columns
+inline void Join::copyMatch(uint64_t *const *results, uint64_t out,
+                            const uint64_t *entry, uint64_t right_id) const
+{
+  unsigned rel_col_id = 0;
+  if (co_located_)
+  {
+    auto payload = JoinHashTable::payload(entry);
+    for (unsigned cId = 0; cId < copy_left_data_.size(); ++cId)
+      results[rel_col_id++][out] = payload[cId];
+  }
+  else
+  {
+    auto left_id = JoinHashTable::tupleId(entry);
+    for (auto column : copy_left_data_)
+      results[rel_col_id++][out] = column[left_id];
+  }
+  for (auto column : copy_right_data_)
+    results[rel_col_id++][out] = column[right_id];
+}
+
+// Grace hash join for build sides beyond the memory budget
+void Join::runGrace(uint64_t *left_key_column, uint64_t *right_key_column,
+                    const std::vector<uint64_t *> &payload)
+{
+  governor_->countSpill();
+  uint64_t left_size = left_->result_size();
+  uint64_t right_size = right_->result_size();
+
+  // Partitions whose build tables fit into half of what the query has left
+  uint64_t used = arena_ ? arena_->bytes() : 0;
+  uint64_t available = std::max<uint64_t>(
+      (governor_->queryBudget() - std::min(used, governor_->queryBudget())) / 2, Arena::kChunkSize);
+  GraceJoin grace{left_key_column, right_key_column, payload, available,
+                  kBuildTupleBytes + payload.size() * sizeof(uint64_t)};
+  uint64_t num_partitions = std::min<uint64_t>(
+      std::max<uint64_t>(left_size * grace.tuple_bytes / available + 1, 2), kMaxGracePartitions);
+
+  // The results grow partition by partition
+  spilled_results_.clear();
+  for (unsigned col = 0; col < tmp_results_.size(); ++col)
+    spilled_results_.push_back(std::make_shared<SpillFile>(governor_->spillDir()));
+  result_size_ = 0;
+
+  SpillFile left_ids(governor_->spillDir()), right_ids(governor_->spillDir());
+  std::vector<uint64_t> left_bounds, right_bounds;
+  partitionRowIds(left_key_column, nullptr, left_size, num_partitions, 0, left_ids, left_bounds);
+  partitionRowIds(right_key_column, nullptr, right_size, num_partitions, 0, right_ids, right_bounds);
+  for (uint64_t p = 0; p < num_partitions; ++p)
+  {
+    joinGracePartition(grace, left_ids.data() + left_bounds[p], left_bounds[p + 1] - left_bounds[p],
+                       right_ids.data() + right_bounds[p], right_bounds[p + 1] - right_bounds[p], 0);
+  }
+}
+
+// Join a grace partition, splitting it further if it is beyond the budget
+void Join::joinGracePartition(const GraceJoin &grace, const uint64_t *left_ids,
+                              uint64_t left_count, const uint64_t *right_ids,
+                              uint64_t right_count, unsigned level)
+{
+  if (left_count == 0 || right_count == 0)
+    return;
+  uint64_t block_size = std::max<uint64_t>(grace.budget / grace.tuple_bytes, 1);
+  if (left_count <= block_size || level >= kMaxGraceLevels)
+  {
+    joinGraceBlocks(grace, left_ids, left_count, right_ids, right_count);
+    return;
+  }
+  // A key beyond the budget stays together however it is hashed: it is
+  // joined on its own, the rest of the partition is split
+  uint64_t key;
+  if (findHeavyKey(grace.left_keys, left_ids, left_count, block_size, key))
+  {
+    SpillFile left_split(governor_->spillDir()), right_split(governor_->spillDir());
+    uint64_t left_heavy = splitRowIds(grace.left_keys, left_ids, left_count, key, left_split);
+    uint64_t right_heavy = splitRowIds(grace.right_keys, right_ids, right_count, key, right_split);
+    joinGraceBlocks(grace, left_split.data(), left_heavy, right_split.data(), right_heavy);
+    joinGracePartition(grace, left_split.data() + left_heavy, left_count - left_heavy,
+                       right_split.data() + right_heavy, right_count - right_heavy, level + 1);
+    return;
+  }
+  uint64_t num_partitions = std::min<uint64_t>(left_count / block_size + 1, kMaxGracePartitions);
+  SpillFile left_sub(governor_->spillDir()), right_sub(governor_->spillDir());
+  std::vector<uint64_t> left_bounds, right_bounds;
+  partitionRowIds(grace.left_keys, left_ids, left_count, num_partitions, level + 1, left_sub,
+                  left_bounds);
+  partitionRowIds(grace.right_keys, right_ids, right_count, num_partitions, level + 1, right_sub,
+                  right_bounds);
+  for (uint64_t p = 0; p < num_partitions; ++p)
+  {
+    joinGracePartition(grace, left_sub.data() + left_bounds[p], left_bounds[p + 1] - left_bounds[p],
+                       right_sub.data() + right_bounds[p], right_bounds[p + 1] - right_bounds[p],
+                       level + 1);
+  }
+}
+
+// Join blocks of left tuples that fit into the budget with all right tuples
+void Join::joinGraceBlocks(const GraceJoin &grace, const uint64_t *left_ids,
+                           uint64_t left_count, const uint64_t *right_ids,
+                           uint64_t right_count)
+{
+  if (right_count == 0)
+    return;
+  uint64_t block_size = std::max<uint64_t>(grace.budget / grace.tuple_bytes, 1);
+  for (uint64_t begin = 0; begin < left_count; begin += block_size)
+  {
+    // Only the table of one block is alive at a time
+    JoinHashTable table;
+    table.build(grace.left_keys, left_ids + begin, std::min(block_size, left_count - begin),
+                grace.payload);
+
+    uint64_t count = 0;
+    table.probe(grace.right_keys, right_ids, 0, right_count,
+                [&count](const uint64_t *, uint64_t) { ++count; });
+    if (count == 0)
+      continue;
+
+    for (auto &column : spilled_results_)
+      column->resize(result_size_ + count);
+    auto results = getResults();
+    uint64_t out = result_size_;
+    table.probe(grace.right_keys, right_ids, 0, right_count,
+                [&](const uint64_t *entry, uint64_t right_id) {
+                  copyMatch(results.data(), out++, entry, right_id);
+                });
+    result_size_ += count;
+  }
+}
+
+// A key that makes up more than limit of the rows in a sample
+bool Join::findHeavyKey(const uint64_t *keys, const uint64_t *ids, uint64_t size,
+                        uint64_t limit, uint64_t &key)
+{
+  uint64_t num_samples = std::min(size, kHeavySamples);
+  if (num_samples == 0)
+    return false;
+  // Golden ratio steps do not resonate with keys that repeat periodically
+  std::unordered_map<uint64_t, uint64_t> counts;
+  for (uint64_t i = 0; i < num_samples; ++i)
+    ++counts[keys[ids[((i * 0x9e3779b97f4a7c15ull) >> 32) * size >> 32]]];
+  auto top = std::max_element(counts.begin(), counts.end(),
+                              [](auto &a, auto &b) { return a.second < b.second; });
+  if (top->second < kMinHeavyCount || top->second * size / num_samples <= limit)
+    return false;
+  key = top->first;
+  return true;
+}
+
+// Write the row ids with a key to a spill file, followed by the others
+uint64_t Join::splitRowIds(const uint64_t *keys, const uint64_t *ids, uint64_t size,
+                           uint64_t key, SpillFile &row_ids)
+{
+  row_ids.resize(size);
+  auto out = row_ids.data();
+  uint64_t matches = 0;
+  for (uint64_t i = 0; i < size; ++i)
+    matches += keys[ids[i]] == key;
+  uint64_t heavy = 0, rest = matches;
+  for (uint64_t i = 0; i < size; ++i)
+    out[keys[ids[i]] == key ? heavy++ : rest++] = ids[i];
+  return matches;
+}
+
+// Write the row ids of keys to a spill file, grouped by partition
+void Join::partitionRowIds(const uint64_t *keys, const uint64_t *ids, uint64_t size,
+                           unsigned num_partitions, unsigned level, SpillFile &row_ids,
+                           std::vector<uint64_t> &bounds)
+{
+  auto id = [ids](uint64_t i) { return ids ? ids[i] : i; };
+  bounds.assign(num_partitions + 1, 0);
+  for (uint64_t i = 0; i < size; ++i)
+    ++bounds[partitionOf(keys[id(i)], num_partitions, level) + 1];
+  std::partial_sum(bounds.begin(), bounds.end(), bounds.begin());
+
+  row_ids.resize(size);
+  std::vector<uint64_t> positions(bounds.begin(), bounds.end() - 1);
+  for (uint64_t i = 0; i < size; ++i)
+    row_ids.data()[positions[partitionOf(keys[id(i)], num_partitions, level)]++] = id(i);
+}
+
+// The build table shared within the batch
+std::shared_ptr<const BuildTable> Join::sharedBuildTable(uint64_t *left_key_column)
+{
+  auto scan = dynamic_cast<const Scan *>(left_.get());
+  if (!batch_ || !scan)
+    return nullptr;
+  auto key = BatchContext::buildKey(scan->signature(), p_info_.left.col_id);
+  if (!batch_->isShared(key))
+    return nullptr;
+
+  // Tuple ids of a (filtered) scan are the same in every query
+  uint64_t limit = left_->result_size();
+  return batch_->getOrBuild(key, [&]() -> std::shared_ptr<const BuildTable> {
+    // The table is charged once, until its last user is done. Without room
+    // every join of the batch builds its own or spills
+    auto reservation = std::make_shared<Reservation>(*governor_);
+    if (!reservation->grow(limit * kBuildTupleBytes, nullptr))
+      return nullptr;
+    auto table = std::make_shared<BuildTable>();
+    table->build(left_key_column, nullptr, limit);
+    return std::shared_ptr<const BuildTable>(table.get(), [table, reservation](const BuildTable *) {});
+  });
+}
+
+// Add the keys that make up a large share of a sample of the column
+void Join::sampleHeavyKeys(const uint64_t *keys, uint64_t size, HeavyKeys &heavy)
+{
+  uint64_t num_samples = std::min(size, kHeavySamples);
+  if (num_samples == 0)
+    return;
+  std::unordered_map<uint64_t, uint64_t> counts;
+  for (uint64_t i = 0; i < num_samples; ++i)
+    ++counts[keys[i * (size / num_samples)]];
+
+  // More than half of the fair share of a partition
+  uint64_t threshold = std::max<uint64_t>(num_samples / (2 * heavy.partitions.size()), kMinHeavyCount);
+  for (auto &[key, count] : counts)
+  {
+    if (count < threshold)
+      continue;
+    heavy.keys.insert(key);
+    heavy.partitions[partitionOf(key, heavy.partitions.size())] = 1;
+  }
+}
+
+// Assign the left tuples to the partitions, heavy keys to the last one
+void Join::populateLeftWork(const uint64_t *key_column, uint64_t size, const HeavyKeys &heavy)
+{
+  unsigned num_partitions = heavy.partitions.size();
+  for (uint64_t i = 0; i < size; ++i)
+  {
+    uint64_t key = key_column[i];
+    auto partition = partitionOf(key, num_partitions);
+    leftTableIndex[heavy.contains(key, partition) ? num_partitions : partition].push_back(i);
+  }
+}
+
+// Assign the right tuples to the partitions, heavy keys round-robin
+void Join::populateRightWork(const uint64_t *key_column, uint64_t size, const HeavyKeys &heavy)
+{
+  unsigned num_partitions = heavy.partitions.size();
+  unsigned next = 0;
+  for (uint64_t i = 0; i < size; ++i)
+  {
+    uint64_t key = key_column[i];
+    auto partition = partitionOf(key, num_partitions);
+    if (!heavy.contains(key, partition))
     {
-      newThreads.emplace_back(pool.enqueue([&, j, runningSumSize] { Join::mergeIntingTmpResults(j, runningSumSize); }));
-      runningSumSize += inting_tmp_results_[j][0].size();
+      rightTableIndex[partition].push_back(i);
+      continue;
     }
-    mergeIntingTmpResults(NUM_THREADS - 1, runningSumSize);
-    for (auto &&result : newThreads)
-      result.get();
+    rightHeavyIndex[next].push_back(i);
+    next = next + 1 == num_partitions ? 0 : next + 1;
   }
+}
+
+// Require a column and add it to results
+bool MergeJoin::require(SelectInfo info)
+{
+  if (requested_columns_.count(info))
+    return true;
+  if (left_->require(info))
+    requested_columns_left_.emplace_back(info);
+  else if (right_->require(info))
+    requested_columns_right_.emplace_back(info);
   else
+    return false;
+  tmp_results_.push_back(newColumn());
+  requested_columns_.emplace(info);
+  return true;
+}
+
+// The input in key order
+SortedInput SortedInput::of(Operator &input, const SelectInfo &key, ArenaVector &keys,
+                            ArenaVector &ids, unsigned num_tasks)
+{
+  auto key_column = input.getResults()[input.resolve(key)];
+  uint64_t size = input.result_size();
+  if (input.sortedOn(key))
+    return SortedInput{key_column, nullptr, size};
+
+  keys.assign(key_column, key_column + size);
+  ids.resize(size);
+  std::iota(ids.begin(), ids.end(), uint64_t(0));
+  RadixSort::sort(pool, num_tasks, keys, ids);
+  return SortedInput{keys.data(), ids.data(), size};
+}
+
+// Merge two key ranges
+template <typename Emit>
+void MergeJoin::merge(const SortedInput &left, uint64_t left_begin, uint64_t left_end,
+                      const SortedInput &right, uint64_t right_begin, uint64_t right_end,
+                      const Emit &emit)
+{
+  uint64_t i = left_begin, j = right_begin;
+  while (i < left_end && j < right_end)
   {
-    hash_table_.reserve(left_->result_size() * 2);
-    for (uint64_t i = 0; i != left_->result_size(); ++i)
+    if (left.keys[i] < right.keys[j])
     {
-      hash_table_.emplace(left_key_column[i], i);
+      ++i;
+      continue;
     }
-    uint64_t limit = right_->result_size();
-    for (uint64_t i = 0, limit = i + right_->result_size(); i != limit; ++i)
+    if (left.keys[i] > right.keys[j])
     {
-      auto rightKey = right_key_column[i];
-      auto range = hash_table_.equal_range(rightKey);
-      for (auto iter = range.first; iter != range.second; ++iter)
-      {
-        copy2Result(iter->second, i);
-      }
+      ++j;
+      continue;
+    }
+    // Every pair of the two runs of the key matches
+    uint64_t key = left.keys[i], left_run = i, right_run = j;
+    while (left_run < left_end && left.keys[left_run] == key)
+      ++left_run;
+    while (right_run < right_end && right.keys[right_run] == key)
+      ++right_run;
+    for (uint64_t r = j; r < right_run; ++r)
+    {
+      for (uint64_t l = i; l < left_run; ++l)
+        emit(left.id(l), right.id(r));
     }
+    i = left_run;
+    j = right_run;
   }
-  result_size_ = tmp_results_[0].size();
-  // std::cerr << "desired " << result_size_ << std::endl;
 }
 
-void Join::runTask(uint64_t lowerBound, uint64_t upperBound, int index, uint64_t *left_key_column, uint64_t *right_key_column)
+// Run
+void MergeJoin::run()
 {
-  HT localHashTable;
-  if (left_->result_size() > 5000) {
-    std::vector<uint64_t> &threadLeftIndex = leftTableIndex[index]; 
-    uint64_t leftSize = threadLeftIndex.size();
-    localHashTable.reserve(leftSize);
-    for (uint64_t i = 0; i < leftSize; ++i) {
-      localHashTable.emplace(left_key_column[threadLeftIndex[i]], threadLeftIndex[i]);
-    }
-  } else {
-    uint64_t leftSize = left_->result_size();
-    localHashTable.reserve(leftSize);
-    for (uint64_t i = 0; i < leftSize; ++i) {
-      localHashTable.emplace(left_key_column[i], i);
-    }
-  }
-  
+  left_->require(p_info_.left);
+  right_->require(p_info_.right);
+  left_->run();
+  right_->run();
 
-  std::vector<uint64_t> &threadRightIndex = rightTableIndex[index];
-  inting_tmp_results_[index].resize(tmp_results_.size());
-  std::vector<std::vector<uint64_t>> &localCopy = inting_tmp_results_[index];
-  uint64_t rightSize = threadRightIndex.size();
-  for (uint64_t i = 0; i < rightSize; ++i) 
+  auto left_input_data = left_->getResults();
+  auto right_input_data = right_->getResults();
+  unsigned res_col_id = 0;
+  for (auto &info : requested_columns_left_)
   {
-    int right_id = threadRightIndex[i];
-    auto rightKey = right_key_column[right_id];
-    auto range = localHashTable.equal_range(rightKey);
-    for (auto iter = range.first; iter != range.second; ++iter)
-    {
-      int left_id = iter->second;
-      
-      unsigned rel_col_id = 0;
-      for (unsigned cId = 0; cId < copy_left_data_.size(); ++cId)
-      {
-        localCopy[rel_col_id++].push_back(copy_left_data_[cId][left_id]);
-      }
+    copy_left_data_.push_back(left_input_data[left_->resolve(info)]);
+    select_to_result_col_id_[info] = res_col_id++;
+  }
+  for (auto &info : requested_columns_right_)
+  {
+    copy_right_data_.push_back(right_input_data[right_->resolve(info)]);
+    select_to_result_col_id_[info] = res_col_id++;
+  }
 
-      for (unsigned cId = 0; cId < copy_right_data_.size(); ++cId)
-      {
-        localCopy[rel_col_id++].push_back(copy_right_data_[cId][right_id]);
-      }
-    }
+  left_keys_ = newColumn();
+  left_ids_ = newColumn();
+  right_keys_ = newColumn();
+  right_ids_ = newColumn();
+  auto left = SortedInput::of(*left_, p_info_.left, left_keys_, left_ids_, NUM_THREADS);
+  auto right = SortedInput::of(*right_, p_info_.right, right_keys_, right_ids_, NUM_THREADS);
+
+  // Ranges of the left keys that do not split a key, and the right keys
+  // they can match
+  int desiredNumThreads = std::max((int)((left.size + right.size) / 10000), 1);
+  unsigned num_tasks = std::min(desiredNumThreads, NUM_THREADS);
+  std::vector<uint64_t> left_bounds(num_tasks + 1, left.size), right_bounds(num_tasks + 1, right.size);
+  left_bounds[0] = right_bounds[0] = 0;
+  for (unsigned t = 1; t < num_tasks; ++t)
+  {
+    uint64_t bound = std::max(left_bounds[t - 1], left.size * t / num_tasks);
+    while (bound > 0 && bound < left.size && left.keys[bound] == left.keys[bound - 1])
+      ++bound;
+    left_bounds[t] = bound;
+    right_bounds[t] = bound < left.size
+                          ? std::lower_bound(right.keys, right.keys + right.size, left.keys[bound]) - right.keys
+                          : right.size;
   }
-  inting_result_sizes_[index] = localCopy[0].size();
-}
 
-// void Join::createHashTables(int index, uint64_t *left_key_column) {
-//   std::vector<uint64_t> &threadLeftIndex = leftTableIndex[index]; 
-//   HT &localHashTable = hashTables[index];
-//   localHashTable.reserve(threadLeftIndex.size());
-//   for (uint64_t i = 0; i < threadLeftIndex.size(); ++i) {
-//     localHashTable.emplace(left_key_column[threadLeftIndex[i]], threadLeftIndex[i]);
-//   }
-// }
+  // Count the matches of every range, then write them to their position
+  std::vector<uint64_t> offsets(num_tasks + 1, 0);
+  pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+    uint64_t count = 0;
+    merge(left, left_bounds[t], left_bounds[t + 1], right, right_bounds[t], right_bounds[t + 1],
+          [&count](uint64_t, uint64_t) { ++count; });
+    offsets[t + 1] = count;
+  }, 1);
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  result_size_ = offsets[num_tasks];
+  auto results = allocateResults(result_size_);
 
-void Join::populateLeftWork(uint64_t lowerBound, uint64_t upperBound, uint64_t *relevant_column, uint64_t size) {
-  // for (uint64_t i = lowerBound; i < upperBound; ++i)
-  //   {
-  //     uint64_t val = relevant_column[i];
-  //     leftTableWork[val % NUM_THREADS].push_back(val);
-  //     leftTableIndex[val % NUM_THREADS].push_back(i);
-  //   }
-  for (uint64_t i = 0; i < size; ++i)
+  pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+    uint64_t out = offsets[t];
+    merge(left, left_bounds[t], left_bounds[t + 1], right, right_bounds[t], right_bounds[t + 1],
+          [&](uint64_t left_id, uint64_t right_id) {
+            unsigned rel_col_id = 0;
+            for (auto column : copy_left_data_)
+              results[rel_col_id++][out] = column[left_id];
+            for (auto column : copy_right_data_)
+              results[rel_col_id++][out] = column[right_id];
+            ++out;
+          });
+  }, 1);
+}
+
+// Require a column and add it to results
+bool FactorizedJoin::require(SelectInfo info)
+{
+  if (requested_columns_.count(info))
+    return true;
+  for (unsigned i = 0; i < inputs_.size(); ++i)
+  {
+    if (inputs_[i]->require(info))
     {
-      uint64_t val = relevant_column[i];
-      // leftTableWork[val % NUM_THREADS].push_back(val);
-      leftTableIndex[val % NUM_THREADS].push_back(i);
+      tmp_results_.push_back(newColumn());
+      requested_columns_.emplace(info, i);
+      return true;
     }
+  }
+  return false;
 }
 
-void Join::populateRightWork(uint64_t lowerBound, uint64_t upperBound, uint64_t *relevant_column) {
-  for (uint64_t i = lowerBound; i < upperBound; ++i)
+// Intersect the keys of the inputs
+template <typename Emit>
+void FactorizedJoin::intersect(std::vector<uint64_t> begins, const std::vector<uint64_t> &ends,
+                               const Emit &emit) const
+{
+  unsigned num_inputs = inputs_.size();
+  std::vector<uint64_t> runs(2 * num_inputs);
+  while (true)
+  {
+    // No input has a smaller key than the largest next one of them all
+    uint64_t key = 0;
+    for (unsigned i = 0; i < num_inputs; ++i)
+    {
+      if (begins[i] == ends[i])
+        return;
+      key = std::max(key, sorted_[i].keys[begins[i]]);
+    }
+    bool matches = true;
+    for (unsigned i = 0; i < num_inputs; ++i)
     {
-      uint64_t val = relevant_column[i];
-      rightTableWork[val % NUM_THREADS].push_back(val);
-      rightTableIndex[val % NUM_THREADS].push_back(i);
+      auto keys = sorted_[i].keys;
+      while (begins[i] < ends[i] && keys[begins[i]] < key)
+        ++begins[i];
+      runs[2 * i] = begins[i];
+      while (begins[i] < ends[i] && keys[begins[i]] == key)
+        ++begins[i];
+      runs[2 * i + 1] = begins[i];
+      matches &= runs[2 * i] != runs[2 * i + 1];
     }
+    if (matches)
+      emit(runs.data());
+  }
 }
 
-void SelfJoin::copy2ResultInting(uint64_t i, int threadIndex)
+// Run
+void FactorizedJoin::run()
 {
-  unsigned rel_col_id = 0;
+  unsigned num_inputs = inputs_.size();
+  for (unsigned i = 0; i < num_inputs; ++i)
+  {
+    inputs_[i]->require(keys_[i]);
+    inputs_[i]->run();
+  }
+  unsigned res_col_id = 0;
+  for (auto &[info, input] : requested_columns_)
+    select_to_result_col_id_[info] = res_col_id++;
 
-  for (unsigned cId = 0; cId < copy_data_.size(); ++cId)
+  uint64_t total_size = 0;
+  sorted_keys_.assign(num_inputs, newColumn());
+  sorted_ids_.assign(num_inputs, newColumn());
+  for (unsigned i = 0; i < num_inputs; ++i)
   {
-    inting_tmp_results_[threadIndex][rel_col_id++].push_back(copy_data_[cId][i]);
+    sorted_.push_back(SortedInput::of(*inputs_[i], keys_[i], sorted_keys_[i], sorted_ids_[i],
+                                      NUM_THREADS));
+    total_size += sorted_[i].size;
+  }
+
+  // Ranges of the keys of the first input that do not split a key, and the
+  // keys of the other inputs they can match
+  int desiredNumThreads = std::max((int)(total_size / 10000), 1);
+  unsigned num_tasks = std::min(desiredNumThreads, NUM_THREADS);
+  auto &first = sorted_[0];
+  std::vector<std::vector<uint64_t>> bounds(num_tasks + 1, std::vector<uint64_t>(num_inputs, 0));
+  for (unsigned i = 0; i < num_inputs; ++i)
+    bounds[num_tasks][i] = sorted_[i].size;
+  for (unsigned t = 1; t < num_tasks; ++t)
+  {
+    uint64_t bound = std::max(bounds[t - 1][0], first.size * t / num_tasks);
+    while (bound > 0 && bound < first.size && first.keys[bound] == first.keys[bound - 1])
+      ++bound;
+    for (unsigned i = 0; i < num_inputs; ++i)
+    {
+      auto &input = sorted_[i];
+      bounds[t][i] = bound < first.size
+                         ? std::lower_bound(input.keys, input.keys + input.size, first.keys[bound]) - input.keys
+                         : input.size;
+    }
+  }
+
+  // Count the keys of every range, then write their runs to their position
+  std::vector<uint64_t> offsets(num_tasks + 1, 0);
+  pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+    uint64_t count = 0;
+    intersect(bounds[t], bounds[t + 1], [&count](const uint64_t *) { ++count; });
+    offsets[t + 1] = count;
+  }, 1);
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  num_groups_ = offsets[num_tasks];
+  runs_ = newColumn();
+  runs_.resize(num_groups_ * stride());
+
+  pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+    auto group = runs_.data() + offsets[t] * stride();
+    intersect(bounds[t], bounds[t + 1], [&](const uint64_t *runs) {
+      std::copy(runs, runs + 2 * num_inputs, group);
+      group += stride();
+    });
+  }, 1);
+
+  // The flat result of a key is the product of its runs
+  for (uint64_t g = 0; g < num_groups_; ++g)
+  {
+    auto runs = &runs_[g * stride()];
+    uint64_t size = 1;
+    for (unsigned i = 0; i < num_inputs; ++i)
+      size *= runs[2 * i + 1] - runs[2 * i];
+    runs[2 * num_inputs] = result_size_;
+    result_size_ += size;
   }
 }
 
-void SelfJoin::runTask(uint64_t lowerBound, uint64_t upperBound, int index, uint64_t *left_key_column, uint64_t *right_key_column)
+// Materialize the requested columns
+void FactorizedJoin::flatten()
 {
-  inting_tmp_results_[index].resize(tmp_results_.size());
-  for (uint64_t i = lowerBound; i < upperBound; ++i)
+  flattened_ = true;
+  unsigned num_inputs = inputs_.size();
+  std::vector<uint64_t *> copy_data(tmp_results_.size());
+  std::vector<unsigned> copy_inputs(tmp_results_.size());
+  for (auto &[info, input] : requested_columns_)
   {
-    if (left_key_column[i] == right_key_column[i])
-      copy2ResultInting(i, index);
+    auto col = select_to_result_col_id_[info];
+    copy_data[col] = inputs_[input]->getResults()[inputs_[input]->resolve(info)];
+    copy_inputs[col] = input;
   }
-  // inting_result_sizes_[index] = inting_tmp_results_[index][0].size();
+  auto results = allocateResults(result_size_);
+
+  int desiredNumThreads = std::max((int)(num_groups_ / 1000), 1);
+  unsigned num_tasks = std::min(desiredNumThreads, NUM_THREADS);
+  pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+    std::vector<uint64_t> positions(num_inputs);
+    for (uint64_t g = num_groups_ * t / num_tasks; g < num_groups_ * (t + 1) / num_tasks; ++g)
+    {
+      auto runs = &runs_[g * stride()];
+      uint64_t out = runs[2 * num_inputs];
+      for (unsigned i = 0; i < num_inputs; ++i)
+        positions[i] = runs[2 * i];
+      // Walk the product like an odometer, the last input fastest
+      unsigned i;
+      do
+      {
+        for (unsigned c = 0; c < copy_data.size(); ++c)
+        {
+          auto input = copy_inputs[c];
+          results[c][out] = copy_data[c][sorted_[input].id(positions[input])];
+        }
+        ++out;
+        for (i = num_inputs; i > 0 && ++positions[i - 1] == runs[2 * i - 1]; --i)
+          positions[i - 1] = runs[2 * i - 2];
+      } while (i > 0);
+    }
+  }, 1);
+}
+
+// Get materialized results
+std::vector<uint64_t *> FactorizedJoin::getResults()
+{
+  if (!flattened_)
+    flatten();
+  return Operator::getResults();
 }
 
-// Copy to result
-void SelfJoin::copy2Result(uint64_t id)
+// The sum of a column over the flat result
+uint64_t FactorizedJoin::sum(const SelectInfo &info)
 {
-  for (unsigned cId = 0; cId < copy_data_.size(); ++cId)
-    tmp_results_[cId].push_back(copy_data_[cId][id]);
-  ++result_size_;
+  if (flattened_)
+    return Operator::sum(info);
+  unsigned input = requested_columns_.at(info);
+  auto column = inputs_[input]->getResults()[inputs_[input]->resolve(info)];
+  auto &sorted = sorted_[input];
+
+  int desiredNumThreads = std::max((int)(num_groups_ / 1000), 1);
+  unsigned num_tasks = std::min(desiredNumThreads, NUM_THREADS);
+  std::vector<uint64_t> sums(num_tasks, 0);
+  pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+    uint64_t sum = 0;
+    for (uint64_t g = num_groups_ * t / num_tasks; g < num_groups_ * (t + 1) / num_tasks; ++g)
+    {
+      // Every tuple of the run pairs with the product of the other runs
+      auto runs = &runs_[g * stride()];
+      uint64_t run_sum = 0, pairs = 1;
+      for (uint64_t p = runs[2 * input]; p < runs[2 * input + 1]; ++p)
+        run_sum += column[sorted.id(p)];
+      for (unsigned i = 0; i < inputs_.size(); ++i)
+      {
+        if (i != input)
+          pairs *= runs[2 * i + 1] - runs[2 * i];
+      }
+      sum += run_sum * pairs;
+    }
+    sums[t] = sum;
+  }, 1);
+  return std::accumulate(sums.begin(), sums.end(), uint64_t(0));
 }
 
 // Require a column and add it to results
@@ -514,7 +1304,7 @@ bool SelfJoin::require(SelectInfo info)
     return true;
   if (input_->require(info))
   {
-    tmp_results_.emplace_back();
+    tmp_results_.push_back(newColumn());
     required_IUs_.emplace(info);
     return true;
   }
@@ -542,61 +1332,38 @@ void SelfJoin::run()
   auto left_col = input_data_[left_col_id];
   auto right_col = input_data_[right_col_id];
 
-  inting_tmp_results_.resize(NUM_THREADS);
-  // inting_result_sizes_.resize(NUM_THREADS);
-
-  
-  std::vector<std::future<void>> newThreads;
-
-  // std::vector<std::thread> threads;
-
   uint64_t limit = input_->result_size();
   int desiredNumThreads = std::max((int)(limit / 1000), 1);
   NUM_THREADS = std::min(desiredNumThreads, NUM_THREADS);
-  inting_tmp_results_.resize(NUM_THREADS);
-  uint64_t size = limit / (NUM_THREADS);
-  if (NUM_THREADS != 1)
-  {
-    for (int j = 0; j < NUM_THREADS - 1; j++)
-    {
-        newThreads.emplace_back(pool.enqueue([&, j, size, left_col, right_col] { SelfJoin::runTask(j * size, size * (j + 1), j, left_col, right_col); }));
-      // threads.push_back(std::thread(&SelfJoin::runTask, this, j * size, size * (j + 1), j, left_col, right_col));
-    }
-    runTask((NUM_THREADS - 1) * size, limit, NUM_THREADS - 1, left_col, right_col);
-    for (auto &&result : newThreads)
-      result.get();
-
-    newThreads.clear();
+  uint64_t size = limit / NUM_THREADS;
+  // The last range also takes the remainder
+  uint64_t last_task = NUM_THREADS - 1;
 
-    // for (auto &thread : threads)
-    // {
-    //   thread.join();
-    // }
+  // Count the matches of every range, then write them to their final position
+  std::vector<uint64_t> offsets(NUM_THREADS + 1, 0);
+  pool.parallel_for(0, NUM_THREADS, [&](uint64_t t) {
+    uint64_t upperBound = t == last_task ? limit : size * (t + 1);
+    uint64_t count = 0;
+    for (uint64_t i = size * t; i < upperBound; ++i)
+      count += left_col[i] == right_col[i];
+    offsets[t + 1] = count;
+  }, 1);
+  std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+  result_size_ = offsets[NUM_THREADS];
+  auto results = allocateResults(result_size_);
 
-    // threads.clear();
-    for (int col = 0; col < tmp_results_.size() - 1; ++col)
+  pool.parallel_for(0, NUM_THREADS, [&](uint64_t t) {
+    uint64_t upperBound = t == last_task ? limit : size * (t + 1);
+    uint64_t out = offsets[t];
+    for (uint64_t i = size * t; i < upperBound; ++i)
     {
-      newThreads.emplace_back(pool.enqueue([&, col] { SelfJoin::mergeIntingTmpResults(col); }));
-      // threads.push_back(std::thread(&SelfJoin::mergeIntingTmpResults, this, col));
+      if (left_col[i] != right_col[i])
+        continue;
+      for (unsigned cId = 0; cId < copy_data_.size(); ++cId)
+        results[cId][out] = copy_data_[cId][i];
+      ++out;
     }
-    mergeIntingTmpResults(tmp_results_.size() - 1);
-    for (auto &&result : newThreads)
-      result.get();
-    // for (auto &thread : threads)
-    // {
-    //   thread.join();
-    // }
-  }
-  else
-  {
-    for (uint64_t i = 0; i < input_->result_size(); ++i)
-    {
-      if (left_col[i] == right_col[i])
-        copy2Result(i);
-    }
-  }
-
-  result_size_ = tmp_results_[0].size();
+  }, 1);
 }
 
 // Run
@@ -607,32 +1374,11 @@ void Checksum::run()
     input_->require(sInfo);
   }
   input_->run();
-  std::vector<uint64_t *> results = input_->getResults();
-
-  // std::vector<std::thread> threads;
-  // check_sums_.resize(col_info_.size());
-  // for (int col = 0; col < col_info_.size(); ++col)
-  // {
-  //   // runTask(col);
-  //   threads.push_back(std::thread(&Checksum::runTask, this, col));
-  // }
-  // for (auto &thread : threads)
-  // {
-  //   thread.join();
-  // }
+  result_size_ = input_->result_size();
 
+  // Factorized inputs sum without materializing their results
   for (auto &sInfo : col_info_)
-  {
-    auto col_id = input_->resolve(sInfo);
-    auto result_col = results[col_id];
-    uint64_t sum = 0;
-    result_size_ = input_->result_size();
-    for (auto iter = result_col, limit = iter + input_->result_size();
-         iter != limit;
-         ++iter)
-      sum += *iter;
-    check_sums_.push_back(sum);
-  }
+    check_sums_.push_back(input_->sum(sInfo));
 }
 
 // void Checksum::runTask(int col) {
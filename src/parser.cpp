@@ -136,6 +136,16 @@ void QueryInfo::parseQuery(std::string &raw_query) {
   resolveRelationIds();
 }
 
+// Drop a join predicate whose columns are equal in every result
+void QueryInfo::dropPredicate(unsigned index, const SelectInfo &kept) {
+  auto p_info = predicates_[index];
+  auto &dropped = p_info.left == kept ? p_info.right : p_info.left;
+  predicates_.erase(predicates_.begin() + index);
+  for (auto &s_info : selections_) {
+    if (s_info == dropped) s_info = kept;
+  }
+}
+
 // Reset query info
 void QueryInfo::clear() {
   relation_ids_.clear();
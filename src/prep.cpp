@@ -0,0 +1,134 @@
+#include "prep.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The destructor
+PrepScheduler::~PrepScheduler()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    tasks_.clear();
+  }
+  changed_.notify_all();
+  if (background_.joinable())
+    background_.join();
+  if (pool_)
+    pool_->wait(drainers_);
+}
+
+// Add a task
+void PrepScheduler::add(unsigned priority, std::function<void()> task)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.emplace(priority, std::move(task));
+  }
+  changed_.notify_all();
+}
+
+// Run f once all tasks finished
+void PrepScheduler::onDone(std::function<void()> f)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  on_done_ = std::move(f);
+}
+
+// Start running the tasks on the pool
+void PrepScheduler::start(ThreadPool &pool, std::chrono::milliseconds budget)
+{
+  pool_ = &pool;
+  deadline_ = std::chrono::steady_clock::now() + budget;
+  drainer_ = [this] { drain(); };
+  for (size_t i = 0; i < pool.size(); ++i)
+    pool.spawn(drainers_, drainer_);
+  background_ = std::thread(&PrepScheduler::runBackground, this);
+}
+
+// Queries arrived
+void PrepScheduler::yield()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    yielded_ = true;
+  }
+  changed_.notify_all();
+}
+
+// Wait for all tasks
+void PrepScheduler::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait(lock, [this] { return tasks_.empty() && running_ == 0; });
+}
+
+// The number of tasks that did not finish yet
+size_t PrepScheduler::pending()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tasks_.size() + running_;
+}
+
+// Pop the next task
+bool PrepScheduler::pop(std::function<void()> &task)
+{
+  if (stop_ || tasks_.empty())
+    return false;
+  task = std::move(tasks_.begin()->second);
+  tasks_.erase(tasks_.begin());
+  ++running_;
+  return true;
+}
+
+// Pool worker: run tasks until the deadline
+void PrepScheduler::drain()
+{
+  std::function<void()> task;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!yielded_ && std::chrono::steady_clock::now() < deadline_ && pop(task))
+    runTask(task, lock);
+}
+
+// Run a popped task
+void PrepScheduler::runTask(std::function<void()> &task,
+                            std::unique_lock<std::mutex> &lock)
+{
+  lock.unlock();
+  task();
+  lock.lock();
+  if (--running_ == 0 && tasks_.empty() && !stop_ && on_done_)
+  {
+    // Tasks that were added by tasks are done as well
+    auto on_done = std::move(on_done_);
+    on_done_ = nullptr;
+    ++running_;
+    lock.unlock();
+    on_done();
+    lock.lock();
+    --running_;
+  }
+  changed_.notify_all();
+}
+
+// Background thread: run the remaining tasks at low priority
+void PrepScheduler::runBackground()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  changed_.wait_until(lock, deadline_, [this] {
+    return yielded_ || stop_ || (tasks_.empty() && running_ == 0);
+  });
+  yielded_ = true;
+
+  // Only run when the query workers leave a core idle
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  std::function<void()> task;
+  while (!stop_)
+  {
+    while (pop(task))
+      runTask(task, lock);
+    // Wait for tasks added later
+    changed_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+  }
+}
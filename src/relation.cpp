@@ -1,11 +1,17 @@
 #include "relation.h"
 #include "joiner.h"
+#include "runtime.h"
+#include "tbl.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fcntl.h>
 #include <iostream>
 #include <fstream>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 int NUM_BUCKETS = 10;
 
@@ -88,23 +94,114 @@ void Relation::loadRelation(const char *file_name)
     throw;
   }
 
-  if (length < 16)
+  char *base = addr;
+  // The magic decides, a .tbl file may have been converted in place
+  bool is_v2 = RelationFile::isV2(base, length);
+  bool is_tbl = !is_v2 && TblParser::isTblFile(file_name);
+  if (is_tbl)
+  {
+    // Text is parsed straight into the column layout
+    if (!parseTbl(base, length))
+    {
+      std::cerr << "relation_ file " << file_name << " is malformed" << std::endl;
+      throw;
+    }
+  }
+  else if (length < 16)
   {
     std::cerr << "relation_ file " << file_name
               << " does not contain a valid header"
               << std::endl;
     throw;
   }
+  else if (is_v2)
+  {
+    // Columns, statistics and encodings are read in place
+    if (!RelationFile::load(base, length, size_, columns_, stored_))
+    {
+      std::cerr << "relation_ file " << file_name << " is damaged" << std::endl;
+      throw;
+    }
+  }
+  else
+  {
+    this->size_ = *reinterpret_cast<uint64_t *>(addr);
+    addr += sizeof(size_);
+    auto numColumns = *reinterpret_cast<size_t *>(addr);
+    addr += sizeof(size_t);
 
-  this->size_ = *reinterpret_cast<uint64_t *>(addr);
-  addr += sizeof(size_);
-  auto numColumns = *reinterpret_cast<size_t *>(addr);
-  addr += sizeof(size_t);
+    for (unsigned i = 0; i < numColumns; ++i)
+    {
+      this->columns_.push_back(reinterpret_cast<uint64_t *>(addr));
+      addr += size_ * sizeof(uint64_t);
+    }
+    stored_.resize(columns_.size());
+  }
+  close(fd);
+
+  file_name_ = file_name;
+  file_key_ = FileKey::of(length, uint64_t(sb.st_mtim.tv_sec) * 1000000000 + sb.st_mtim.tv_nsec, base);
+  if (!hasStoredMetadata() && Runtime::get().snapshots())
+    loadSnapshot();
+  encoded_.resize(columns_.size());
+  if (Runtime::get().compress())
+  {
+    for (unsigned i = 0; i < columns_.size(); ++i)
+      encoded_[i] = stored_[i].encoded;
+  }
 
-  for (unsigned i = 0; i < numColumns; ++i)
+  // Use the preparation phase to take the page faults that would otherwise
+  // hit the first queries. Without prefaulting, the first scan streams the
+  // file, so ask for aggressive readahead
+  auto &runtime = Runtime::get();
+  if (is_tbl)
   {
-    this->columns_.push_back(reinterpret_cast<uint64_t *>(addr));
-    addr += size_ * sizeof(uint64_t);
+    // The columns were written to placed memory, the text is not needed
+    munmap(base, length);
+  }
+  else if (runtime.numaEnabled())
+  {
+    madvise(base, length, MADV_WILLNEED);
+    auto file_columns = columns_;
+    if (!interleaveColumns())
+    {
+      file_ = base;
+      file_length_ = length;
+    }
+    else if (is_v2)
+    {
+      // Stored codes still point into the file, keep only their pages.
+      // Columns start on a page and nothing else shares their last one
+      auto page = RelationFile::kPageSize;
+      uint64_t column_bytes = (size_ * sizeof(uint64_t) + page - 1) / page * page;
+      for (auto column : file_columns)
+      {
+        if (column_bytes)
+          munmap(column, column_bytes);
+      }
+      file_ = base;
+      file_length_ = length;
+    }
+    else
+    {
+      munmap(base, length);
+    }
+  }
+  else if (runtime.prefault())
+  {
+    madvise(base, length, MADV_WILLNEED);
+    madvise(base, length, MADV_HUGEPAGE);
+    prefault(base, length);
+    // Materialization reads payload columns by row id, don't read ahead
+    madvise(base, length, MADV_RANDOM);
+    file_ = base;
+    file_length_ = length;
+  }
+  else
+  {
+    madvise(base, length, MADV_SEQUENTIAL);
+    file_ = base;
+    file_length_ = length;
   }
 
   // std::vector<std::vector<int>> histogramsForRelation;
@@ -144,6 +241,157 @@ void Relation::loadRelation(const char *file_name)
   // }
 }
 
+// Parses a mapped .tbl file into anonymous memory
+bool Relation::parseTbl(const char *data, uint64_t length)
+{
+  auto &runtime = Runtime::get();
+  TblParser parser(data, length);
+  madvise(const_cast<char *>(data), length, MADV_SEQUENTIAL);
+  if (!parser.scan(runtime.pool()))
+    return false;
+
+  size_ = parser.size();
+  uint64_t column_bytes = size_ * sizeof(uint64_t);
+  uint64_t mapping_length = std::max<uint64_t>(column_bytes * parser.numColumns(), 1);
+  void *mapping = mmap(nullptr, mapping_length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return false;
+  // The parser takes the first touch, so the policy decides the placement
+  if (runtime.numaEnabled())
+    runtime.interleave(mapping, mapping_length);
+  madvise(mapping, mapping_length, MADV_HUGEPAGE);
+  mapping_ = mapping;
+  mapping_length_ = mapping_length;
+
+  columns_.clear();
+  for (unsigned c = 0; c < parser.numColumns(); ++c)
+    columns_.push_back(reinterpret_cast<uint64_t *>(static_cast<char *>(mapping) + c * column_bytes));
+  stored_.resize(columns_.size());
+  return parser.parse(runtime.pool(), columns_);
+}
+
+// Copies the columns into memory interleaved across the NUMA nodes, so
+// scans draw on the bandwidth of all sockets instead of the one whose page
+// cache happened to hold the file
+bool Relation::interleaveColumns()
+{
+  uint64_t column_bytes = size_ * sizeof(uint64_t);
+  // Columns start on a page, as in a v2 file
+  auto page = RelationFile::kPageSize;
+  uint64_t stride = (column_bytes + page - 1) / page * page;
+  uint64_t length = std::max<uint64_t>(stride * columns_.size(), 1);
+  void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return false;
+  // The policy is set before the first touch, so it decides the placement
+  Runtime::get().interleave(mapping, length);
+  madvise(mapping, length, MADV_HUGEPAGE);
+
+  // Copy page-sized pieces in parallel
+  constexpr uint64_t kPiece = 1 << 21;
+  auto target = static_cast<char *>(mapping);
+  auto pieces = (column_bytes + kPiece - 1) / kPiece;
+  Runtime::get().pool().parallel_for(0, pieces * columns_.size(), [&](uint64_t i) {
+    auto column = i / pieces;
+    auto offset = (i % pieces) * kPiece;
+    auto bytes = std::min(kPiece, column_bytes - offset);
+    memcpy(target + column * stride + offset,
+           reinterpret_cast<char *>(columns_[column]) + offset, bytes);
+  }, 1);
+
+  for (unsigned i = 0; i < columns_.size(); ++i)
+    columns_[i] = reinterpret_cast<uint64_t *>(target + i * stride);
+  mapping_ = mapping;
+  mapping_length_ = length;
+  return true;
+}
+
+// The compressed copy of a column
+std::shared_ptr<const EncodedColumn> Relation::encoded(unsigned col_id) const
+{
+  if (col_id >= encoded_.size())
+    return nullptr;
+  return std::atomic_load(&encoded_[col_id]);
+}
+
+// Map the snapshot of the relation file if it is still valid
+void Relation::loadSnapshot()
+{
+  auto name = RelationFile::snapshotName(file_name_);
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat sb
+  {
+  };
+  void *data = MAP_FAILED;
+  if (fstat(fd, &sb) == 0 && sb.st_size > 0)
+    data = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return;
+
+  std::vector<StoredColumn> columns(columns_.size());
+  if (!RelationFile::loadSnapshot(static_cast<char *>(data), sb.st_size,
+                                  file_key_, size_, columns))
+  {
+    munmap(data, sb.st_size);
+    return;
+  }
+  stored_ = move(columns);
+  snapshot_ = data;
+  snapshot_length_ = sb.st_size;
+}
+
+// Whether every column has stored statistics with checked keys
+bool Relation::hasStoredMetadata() const
+{
+  for (auto &column : stored_)
+  {
+    if (!column.stats || !column.stats->keys_checked)
+      return false;
+  }
+  return true;
+}
+
+// Store the snapshot of the metadata of the relation file
+bool Relation::storeSnapshot(const std::vector<StoredColumn> &columns) const
+{
+  if (file_name_.empty())
+    return false;
+  return RelationFile::storeSnapshot(file_name_, file_key_, columns);
+}
+
+// The statistics of a column stored in its file
+std::shared_ptr<const ColumnStats> Relation::storedStats(unsigned col_id) const
+{
+  return col_id < stored_.size() ? stored_[col_id].stats : nullptr;
+}
+
+// Publish the compressed copy of a column
+void Relation::setEncoded(unsigned col_id,
+                          std::shared_ptr<const EncodedColumn> column)
+{
+  std::atomic_store(&encoded_[col_id], std::move(column));
+}
+
+// Faults in the pages of a mapping in parallel (MAP_POPULATE would fault
+// them on a single thread)
+void Relation::prefault(const char *addr, uint64_t length)
+{
+  constexpr uint64_t kPage = 4096;
+  constexpr uint64_t kPiece = 1 << 21;
+  std::atomic<uint64_t> sum{0};
+  Runtime::get().pool().parallel_for(0, (length + kPiece - 1) / kPiece, [&](uint64_t i) {
+    uint64_t local_sum = 0;
+    for (uint64_t offset = i * kPiece; offset < std::min(length, (i + 1) * kPiece); offset += kPage)
+      local_sum += static_cast<const volatile char *>(addr)[offset];
+    sum += local_sum;
+  }, 1);
+}
+
 std::vector<uint64_t> Relation::getColVals(int colIdx)
 {
   std::vector<uint64_t> colVals(this->size_, 0);
@@ -200,9 +448,194 @@ Relation::Relation(const char *file_name) : owns_memory_(false), size_(0)
   loadRelation(file_name);
 }
 
+// Releases the memory unless it was installed
+MergedColumns::~MergedColumns()
+{
+  if (mapping)
+    munmap(mapping, length);
+}
+
+// The number of tuples including the delta
+uint64_t Relation::totalSize() const
+{
+  auto delta = this->delta();
+  return size_ + (delta ? delta->size : 0);
+}
+
+// Copy the values of some rows of a column
+void Relation::copyValues(unsigned col_id, uint64_t begin, uint64_t end,
+                          uint64_t *out) const
+{
+  auto main_end = std::min(end, size_);
+  if (begin < main_end)
+    out = std::copy(columns_[col_id] + begin, columns_[col_id] + main_end, out);
+  if (end > size_)
+  {
+    auto &values = delta()->columns[col_id];
+    std::copy(values.begin() + (std::max(begin, size_) - size_),
+              values.begin() + (end - size_), out);
+  }
+}
+
+// The main columns followed by a delta in one piece
+const ContiguousColumns &Relation::contiguous(const DeltaStore &delta) const
+{
+  std::call_once(delta.contiguous_once, [&] {
+    auto contiguous = std::make_shared<ContiguousColumns>();
+    contiguous->size = size_ + delta.size;
+    // Room for the appends until the next merge
+    contiguous->capacity = contiguous->size + contiguous->size / 8;
+    for (unsigned c = 0; c < columns_.size(); ++c)
+    {
+      contiguous->columns.emplace_back(new uint64_t[contiguous->capacity]);
+      auto out = std::copy(columns_[c], columns_[c] + size_, contiguous->columns[c].get());
+      std::copy(delta.columns[c].begin(), delta.columns[c].end(), out);
+    }
+    delta.contiguous = std::move(contiguous);
+  });
+  return *delta.contiguous;
+}
+
+// Append tuples to the delta
+void Relation::append(const std::vector<std::vector<uint64_t>> &columns)
+{
+  if (columns.size() != columns_.size())
+  {
+    std::cerr << "append to " << columns_.size() << " columns with "
+              << columns.size() << " columns" << std::endl;
+    throw;
+  }
+  auto count = columns.empty() ? 0 : columns[0].size();
+  for (auto &column : columns)
+  {
+    if (column.size() != count)
+    {
+      std::cerr << "append of columns with different lengths" << std::endl;
+      throw;
+    }
+  }
+
+  // Copy on write: a merge may be reading the current delta. Merges keep
+  // the delta small, so the copy is cheap
+  auto old = delta();
+  auto delta = std::make_shared<DeltaStore>();
+  if (old)
+  {
+    delta->columns = old->columns;
+    delta->size = old->size;
+  }
+  delta->columns.resize(columns_.size());
+  for (unsigned c = 0; c < columns.size(); ++c)
+    delta->columns[c].insert(delta->columns[c].end(), columns[c].begin(), columns[c].end());
+  delta->size += count;
+
+  // The contiguous columns of the old delta are extended past its tuples,
+  // no query reads them meanwhile
+  auto contiguous = old ? old->contiguous : nullptr;
+  if (contiguous && contiguous->size == size_ + old->size &&
+      contiguous->capacity >= size_ + delta->size)
+  {
+    for (unsigned c = 0; c < columns.size(); ++c)
+      std::copy(columns[c].begin(), columns[c].end(), contiguous->columns[c].get() + contiguous->size);
+    contiguous->size += count;
+    std::call_once(delta->contiguous_once, [&] { delta->contiguous = std::move(contiguous); });
+  }
+  std::atomic_store(&delta_, std::shared_ptr<const DeltaStore>(std::move(delta)));
+  ++version_;
+}
+
+// Copy the main columns and the delta into fresh memory
+std::unique_ptr<MergedColumns> Relation::buildMerge() const
+{
+  auto delta = this->delta();
+  auto merged = std::make_unique<MergedColumns>();
+  merged->delta_size = delta ? delta->size : 0;
+  merged->size = size_ + merged->delta_size;
+  uint64_t column_bytes = merged->size * sizeof(uint64_t);
+  merged->length = std::max<uint64_t>(column_bytes * columns_.size(), 1);
+  void *mapping = mmap(nullptr, merged->length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+  merged->mapping = mapping;
+  // Placed like the columns of a loaded relation
+  if (Runtime::get().numaEnabled())
+    Runtime::get().interleave(mapping, merged->length);
+  madvise(mapping, merged->length, MADV_HUGEPAGE);
+
+  for (unsigned c = 0; c < columns_.size(); ++c)
+  {
+    auto target = reinterpret_cast<uint64_t *>(static_cast<char *>(mapping) + c * column_bytes);
+    std::copy(columns_[c], columns_[c] + size_, target);
+    if (delta)
+      std::copy(delta->columns[c].begin(), delta->columns[c].end(), target + size_);
+    merged->columns.push_back(target);
+  }
+  return merged;
+}
+
+// Replace the main columns by merged ones
+void Relation::installMerge(std::unique_ptr<MergedColumns> merged)
+{
+  // Encodings and stored metadata describe the old columns
+  encoded_.assign(columns_.size(), nullptr);
+  stored_.assign(columns_.size(), StoredColumn());
+  if (mapping_)
+    munmap(mapping_, mapping_length_);
+  if (owns_memory_)
+  {
+    for (auto c : columns_)
+      delete[] c;
+    owns_memory_ = false;
+  }
+  mapping_ = merged->mapping;
+  mapping_length_ = merged->length;
+  merged->mapping = nullptr;
+  columns_ = merged->columns;
+  size_ = merged->size;
+
+  // Tuples appended during the merge stay in the delta
+  auto delta = this->delta();
+  std::shared_ptr<DeltaStore> rest;
+  if (delta && delta->size > merged->delta_size)
+  {
+    rest = std::make_shared<DeltaStore>();
+    for (auto &column : delta->columns)
+      rest->columns.emplace_back(column.begin() + merged->delta_size, column.end());
+    rest->size = delta->size - merged->delta_size;
+  }
+  std::atomic_store(&delta_, std::shared_ptr<const DeltaStore>(std::move(rest)));
+}
+
+// Move constructor
+Relation::Relation(Relation &&other) noexcept
+    : owns_memory_(other.owns_memory_), size_(other.size_),
+      columns_(std::move(other.columns_)), mapping_(other.mapping_),
+      mapping_length_(other.mapping_length_),
+      encoded_(std::move(other.encoded_)), stored_(std::move(other.stored_)),
+      file_name_(std::move(other.file_name_)), file_key_(other.file_key_),
+      file_(other.file_), file_length_(other.file_length_),
+      snapshot_(other.snapshot_), snapshot_length_(other.snapshot_length_),
+      delta_(std::move(other.delta_)), version_(other.version_.load())
+{
+  other.columns_.clear();
+  other.mapping_ = nullptr;
+  other.file_ = nullptr;
+  other.snapshot_ = nullptr;
+}
+
 // Destructor
 Relation::~Relation()
 {
+  // Drop the encodings before the file or snapshot their codes may point into
+  encoded_.clear();
+  stored_.clear();
+  if (snapshot_)
+    munmap(snapshot_, snapshot_length_);
+  if (file_)
+    munmap(file_, file_length_);
+  if (mapping_)
+    munmap(mapping_, mapping_length_);
   if (owns_memory_)
   {
     for (auto c : columns_)
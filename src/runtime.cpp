@@ -0,0 +1,198 @@
+#include "runtime.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <sched.h>
+#include <set>
+#include <string>
+#include <sys/syscall.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+
+namespace {
+
+// Read an unsigned from a sysfs file
+unsigned readSysfs(const std::string &path, unsigned fallback)
+{
+  std::ifstream in(path);
+  unsigned value;
+  return in >> value ? value : fallback;
+}
+
+// NUMA node of a CPU (the cpuN/nodeM link in sysfs)
+unsigned readNode(unsigned cpu)
+{
+  auto path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR *dir = opendir(path.c_str());
+  if (!dir)
+    return 0;
+  unsigned node = 0;
+  while (auto entry = readdir(dir))
+  {
+    if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4]))
+    {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+// Read a positive integer from the environment
+unsigned readEnv(const char *name, unsigned fallback)
+{
+  auto value = getenv(name);
+  if (!value || atoi(value) <= 0)
+    return fallback;
+  return atoi(value);
+}
+
+// Memory policies (linux/mempolicy.h, no libnuma needed)
+constexpr int kMpolPreferred = 1;
+constexpr int kMpolInterleave = 3;
+/// Nodes a policy mask covers
+constexpr unsigned kMaxNodes = 1024;
+/// Words of a policy mask
+constexpr unsigned kMaskWords = kMaxNodes / (8 * sizeof(unsigned long));
+
+} // namespace
+
+// Read the topology from sysfs
+Topology Topology::discover()
+{
+  Topology topology;
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  if (sched_getaffinity(0, sizeof(mask), &mask) != 0)
+  {
+    for (unsigned cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); ++cpu)
+      CPU_SET(cpu, &mask);
+  }
+
+  for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+  {
+    if (!CPU_ISSET(cpu, &mask))
+      continue;
+    auto path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+    CpuInfo info{cpu, readSysfs(path + "core_id", cpu),
+                 readSysfs(path + "physical_package_id", 0), readNode(cpu), 0};
+    topology.cpus.push_back(info);
+  }
+
+  // Rank the hyperthreads of every core and the cores of every socket
+  std::map<std::pair<unsigned, unsigned>, unsigned> threads_per_core;
+  std::map<std::pair<unsigned, unsigned>, unsigned> core_rank;
+  std::map<unsigned, unsigned> cores_per_socket;
+  for (auto &info : topology.cpus)
+  {
+    auto core = std::make_pair(info.socket, info.core);
+    info.smt_rank = threads_per_core[core]++;
+    if (info.smt_rank == 0)
+      core_rank[core] = cores_per_socket[info.socket]++;
+    topology.num_nodes = std::max(topology.num_nodes, info.node + 1);
+  }
+  topology.num_cores = std::max<unsigned>(threads_per_core.size(), 1);
+  topology.num_sockets = std::max<unsigned>(cores_per_socket.size(), 1);
+
+  std::sort(topology.cpus.begin(), topology.cpus.end(),
+            [&](const CpuInfo &a, const CpuInfo &b) {
+              auto rank_a = core_rank[{a.socket, a.core}];
+              auto rank_b = core_rank[{b.socket, b.core}];
+              return std::tie(a.smt_rank, rank_a, a.socket, a.cpu) <
+                     std::tie(b.smt_rank, rank_b, b.socket, b.cpu);
+            });
+  return topology;
+}
+
+// The runtime of the process
+Runtime &Runtime::get()
+{
+  static Runtime runtime;
+  return runtime;
+}
+
+// The constructor
+Runtime::Runtime() : topology_(Topology::discover())
+{
+  for (auto &info : topology_.cpus)
+  {
+    cpu_nodes_.resize(std::max<size_t>(cpu_nodes_.size(), info.cpu + 1), 0);
+    cpu_nodes_[info.cpu] = info.node;
+  }
+  unsigned num_cpus = std::max<unsigned>(topology_.cpus.size(), 1);
+  num_threads_ = readEnv("DB_THREADS", num_cpus);
+
+  auto numa = getenv("DB_NUMA");
+  numa_enabled_ = numa ? strcmp(numa, "0") != 0 : topology_.num_nodes > 1;
+  auto prefault = getenv("DB_PREFAULT");
+  prefault_ = !(prefault && strcmp(prefault, "0") == 0);
+  prep_budget_ = std::chrono::milliseconds(readEnv("DB_PREP_MS", 5000));
+  auto compress = getenv("DB_COMPRESS");
+  compress_ = !(compress && strcmp(compress, "0") == 0);
+  auto snapshots = getenv("DB_SNAPSHOT");
+  // Opt-in, the snapshots are written next to the relation files
+  snapshots_ = snapshots && strcmp(snapshots, "0") != 0;
+  uint64_t ram = uint64_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE);
+  memory_budget_ = uint64_t(readEnv("DB_MEMORY_MB", ram / 4 * 3 >> 20)) << 20;
+  query_memory_budget_ = std::min<uint64_t>(
+      uint64_t(readEnv("DB_QUERY_MEMORY_MB", memory_budget_ / 2 >> 20)) << 20, memory_budget_);
+  // Not $TMPDIR or /tmp, they are often a tmpfs
+  auto spill_dir = getenv("DB_SPILL_DIR");
+  spill_dir_ = spill_dir ? spill_dir : "/var/tmp";
+
+  std::vector<int> cpus, nodes;
+  auto pin = getenv("DB_PIN");
+  if (!(pin && strcmp(pin, "0") == 0) && !topology_.cpus.empty())
+  {
+    for (unsigned i = 0; i < num_threads_; ++i)
+    {
+      auto &info = topology_.cpus[i % topology_.cpus.size()];
+      cpus.push_back(info.cpu);
+      nodes.push_back(info.node);
+    }
+  }
+  pool_ = std::make_unique<ThreadPool>(num_threads_, cpus, nodes);
+}
+
+// Interleave a range across the nodes of our CPUs
+bool Runtime::interleave(void *addr, uint64_t length) const
+{
+  unsigned long mask[kMaskWords] = {};
+  std::set<unsigned> nodes;
+  for (auto &info : topology_.cpus)
+    nodes.insert(std::min(info.node, kMaxNodes - 1));
+  if (nodes.empty())
+    nodes.insert(0);
+  for (auto node : nodes)
+    mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_mbind, addr, length, kMpolInterleave, mask, kMaxNodes + 1, 0) == 0;
+}
+
+// Place a range on a node
+bool Runtime::placeOnNode(void *addr, uint64_t length, unsigned node) const
+{
+  unsigned long mask[kMaskWords] = {};
+  node = std::min(node, kMaxNodes - 1);
+  mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_mbind, addr, length, kMpolPreferred, mask, kMaxNodes + 1, 0) == 0;
+}
+
+// The NUMA node of the CPU the calling thread runs on
+unsigned Runtime::currentNode() const
+{
+  int cpu = sched_getcpu();
+  return cpu >= 0 && unsigned(cpu) < cpu_nodes_.size() ? cpu_nodes_[cpu] : 0;
+}
+
+// The number of query workers
+unsigned Runtime::numQueryWorkers() const
+{
+  // Query workers mostly wait for (and help with) pool tasks
+  return std::max(1u, std::min(num_threads_, topology_.num_cores));
+}
@@ -0,0 +1,127 @@
+#include "scheduler.h"
+#include "governor.h"
+#include "runtime.h"
+
+#include <algorithm>
+
+namespace {
+
+/// Parallelism granted to the query running on this thread (0: not granted)
+thread_local int current_parallelism = 0;
+
+} // namespace
+
+// The constructor
+QueryScheduler::QueryScheduler(unsigned num_workers, unsigned parallelism,
+                               uint64_t memory_budget)
+{
+  auto &runtime = Runtime::get();
+  num_workers_ = num_workers ? num_workers : runtime.numQueryWorkers();
+  parallelism_ = parallelism ? parallelism : runtime.numThreads();
+  memory_budget_ = memory_budget ? memory_budget : MemoryGovernor::get().budget();
+  aging_limit_ = 2 * num_workers_;
+  for (unsigned i = 0; i < num_workers_; ++i)
+    workers_.emplace_back(&QueryScheduler::workerLoop, this);
+}
+
+// The destructor
+QueryScheduler::~QueryScheduler()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_available_.notify_all();
+  for (auto &worker : workers_)
+    worker.join();
+}
+
+// Submit a query with an estimated cost and peak memory
+void QueryScheduler::submit(double cost, std::function<void()> query, uint64_t memory)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(PendingQuery{cost, 0, std::min(memory, memory_budget_), std::move(query)});
+  }
+  work_available_.notify_one();
+}
+
+// Wait until all submitted queries are done
+void QueryScheduler::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_.wait(lock, [this] { return queue_.empty() && running_ == 0; });
+}
+
+// Intra-query parallelism of the query on the calling thread
+int QueryScheduler::parallelism()
+{
+  // Outside of the scheduler operators may use the whole runtime
+  return current_parallelism ? current_parallelism : Runtime::get().numThreads();
+}
+
+// Whether a query fits next to the running ones
+bool QueryScheduler::fits(const PendingQuery &query) const
+{
+  return query.memory <= memory_budget_ - admitted_memory_;
+}
+
+// Position of the next query to admit
+size_t QueryScheduler::pickNext() const
+{
+  size_t next = queue_.size();
+  for (size_t i = 0; i < queue_.size(); ++i)
+  {
+    // Aging guard: the oldest starved query goes first, the others wait
+    // until it fits
+    if (queue_[i].skipped >= aging_limit_)
+      return fits(queue_[i]) ? i : queue_.size();
+    if (fits(queue_[i]) && (next == queue_.size() || queue_[i].cost < queue_[next].cost))
+      next = i;
+  }
+  return next;
+}
+
+// Admit queries until stopped
+void QueryScheduler::workerLoop()
+{
+  for (;;)
+  {
+    PendingQuery query;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      size_t next = 0;
+      work_available_.wait(lock, [this, &next] {
+        if (queue_.empty())
+          return stop_;
+        next = pickNext();
+        return next < queue_.size();
+      });
+      if (queue_.empty())
+        return;
+      for (size_t i = 0; i < next; ++i)
+        ++queue_[i].skipped;
+      query = std::move(queue_[next]);
+      queue_.erase(queue_.begin() + next);
+      ++running_;
+      admitted_memory_ += query.memory;
+
+      // Split the budget among the queries that run (or will run) now
+      unsigned load = std::min<size_t>(num_workers_, running_ + queue_.size());
+      current_parallelism = std::max(1u, parallelism_ / std::max(load, 1u));
+    }
+
+    query.run();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --running_;
+      admitted_memory_ -= query.memory;
+      if (queue_.empty() && running_ == 0)
+        done_.notify_all();
+    }
+    // Queries that waited for memory may fit now
+    if (query.memory > 0)
+      work_available_.notify_all();
+  }
+}
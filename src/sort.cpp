@@ -0,0 +1,64 @@
+#include "sort.h"
+
+#include <algorithm>
+
+// Sort the pairs by key
+void RadixSort::sort(ThreadPool &pool, unsigned num_tasks, ArenaVector &keys,
+                     ArenaVector &ids)
+{
+  uint64_t size = keys.size();
+  if (size < kParallelSize)
+    num_tasks = 1;
+  num_tasks = std::max(num_tasks, 1u);
+
+  // A byte that is zero in every key (in the OR of the keys) does not
+  // reorder anything
+  uint64_t bits = 0;
+  for (auto key : keys)
+    bits |= key;
+
+  ArenaVector other_keys(keys.get_allocator()), other_ids(ids.get_allocator());
+  other_keys.resize(size);
+  other_ids.resize(size);
+  uint64_t chunk = (size + num_tasks - 1) / num_tasks;
+  std::vector<uint64_t> counts(num_tasks * kRadix);
+
+  for (unsigned byte = 0; byte < 8; ++byte)
+  {
+    unsigned shift = 8 * byte;
+    if (((bits >> shift) & (kRadix - 1)) == 0)
+      continue;
+    // Histogram of every chunk
+    std::fill(counts.begin(), counts.end(), 0);
+    pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+      auto histogram = &counts[t * kRadix];
+      for (uint64_t i = t * chunk; i < std::min(size, (t + 1) * chunk); ++i)
+        ++histogram[(keys[i] >> shift) & (kRadix - 1)];
+    }, 1);
+
+    // Digit-major offsets keep the sort stable across chunks
+    uint64_t offset = 0;
+    for (unsigned digit = 0; digit < kRadix; ++digit)
+    {
+      for (unsigned t = 0; t < num_tasks; ++t)
+      {
+        uint64_t count = counts[t * kRadix + digit];
+        counts[t * kRadix + digit] = offset;
+        offset += count;
+      }
+    }
+
+    // Scatter
+    pool.parallel_for(0, num_tasks, [&](uint64_t t) {
+      auto positions = &counts[t * kRadix];
+      for (uint64_t i = t * chunk; i < std::min(size, (t + 1) * chunk); ++i)
+      {
+        auto position = positions[(keys[i] >> shift) & (kRadix - 1)]++;
+        other_keys[position] = keys[i];
+        other_ids[position] = ids[i];
+      }
+    }, 1);
+    keys.swap(other_keys);
+    ids.swap(other_ids);
+  }
+}
@@ -0,0 +1,320 @@
+#include "stats.h"
+
+#include "relation.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace {
+
+/// log2 of the number of HyperLogLog registers
+constexpr unsigned kHllBits = 12;
+
+// 64 bit finalizer of MurmurHash3
+uint64_t mix(uint64_t key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ull;
+  key ^= key >> 33;
+  return key;
+}
+
+// Estimate the number of distinct values from HyperLogLog registers
+uint64_t estimateDistinct(const std::vector<uint8_t> &registers)
+{
+  double m = registers.size();
+  double sum = 0;
+  unsigned zeros = 0;
+  for (auto r : registers)
+  {
+    sum += std::ldexp(1.0, -r);
+    zeros += r == 0;
+  }
+  double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  // Linear counting is more precise for small cardinalities
+  if (estimate <= 2.5 * m && zeros > 0)
+    estimate = m * std::log(m / zeros);
+  return std::llround(estimate);
+}
+
+} // namespace
+
+// Estimated fraction of tuples passing "column <comparison> constant"
+double ColumnStats::selectivity(char comparison, uint64_t constant) const
+{
+  if (size == 0)
+    return 0;
+  double range = double(max - min) + 1;
+  switch (comparison)
+  {
+  case '=':
+    return constant < min || constant > max ? 0 : 1.0 / std::max<uint64_t>(distinct, 1);
+  case '<':
+    return constant <= min ? 0 : std::min(1.0, (constant - min) / range);
+  case '>':
+    return constant >= max ? 0 : std::min(1.0, (max - constant) / range);
+  default:
+    return 1;
+  }
+}
+
+// Compute the statistics of a column in one pass
+std::shared_ptr<ColumnStats> ColumnStats::compute(const uint64_t *values,
+                                                  uint64_t size)
+{
+  auto stats = std::make_shared<ColumnStats>();
+  stats->size = size;
+  if (size == 0)
+  {
+    stats->sorted = stats->keys_checked = stats->unique = true;
+    return stats;
+  }
+
+  std::vector<uint8_t> registers(1 << kHllBits, 0);
+  bool sorted = true, strictly_sorted = true;
+  stats->min = stats->max = values[0];
+  for (uint64_t zone = 0; zone < size; zone += kZoneSize)
+  {
+    uint64_t zone_min = values[zone], zone_max = values[zone];
+    for (uint64_t i = zone; i < std::min(size, zone + kZoneSize); ++i)
+    {
+      auto value = values[i];
+      zone_min = std::min(zone_min, value);
+      zone_max = std::max(zone_max, value);
+      if (i > 0)
+      {
+        sorted &= values[i - 1] <= value;
+        strictly_sorted &= values[i - 1] < value;
+      }
+      auto hash = mix(value);
+      auto &r = registers[hash >> (64 - kHllBits)];
+      r = std::max<uint8_t>(r, __builtin_clzll((hash << kHllBits) | 1) + 1);
+    }
+    stats->zone_min.push_back(zone_min);
+    stats->zone_max.push_back(zone_max);
+    stats->min = std::min(stats->min, zone_min);
+    stats->max = std::max(stats->max, zone_max);
+  }
+
+  stats->sorted = sorted;
+  stats->distinct = std::min(estimateDistinct(registers), size);
+  if (strictly_sorted)
+  {
+    stats->keys_checked = stats->unique = true;
+    stats->distinct = size;
+  }
+  return stats;
+}
+
+// Check whether a column is a key
+bool ColumnStats::isUnique(const uint64_t *values, const ColumnStats &stats)
+{
+  if (stats.keys_checked)
+    return stats.unique;
+  // The estimate is off by a few percent at most
+  if (stats.distinct < stats.size / 2)
+    return false;
+
+  uint64_t range = stats.max - stats.min;
+  if (range < 64 * stats.size)
+  {
+    // Dense domain: a bitmap is cheaper than sorting
+    std::vector<uint64_t> seen(range / 64 + 1, 0);
+    for (uint64_t i = 0; i < stats.size; ++i)
+    {
+      uint64_t offset = values[i] - stats.min;
+      uint64_t bit = 1ull << (offset % 64);
+      if (seen[offset / 64] & bit)
+        return false;
+      seen[offset / 64] |= bit;
+    }
+    return true;
+  }
+  std::vector<uint64_t> copy(values, values + stats.size);
+  std::sort(copy.begin(), copy.end());
+  return std::adjacent_find(copy.begin(), copy.end()) == copy.end();
+}
+
+// Whether a column may be included in a key column
+bool ColumnStats::mayBeIncluded(const ColumnStats &stats, const ColumnStats &key_stats)
+{
+  if (stats.size == 0)
+    return true;
+  // The estimates are off by a few percent at most
+  return key_stats.size > 0 && stats.min >= key_stats.min && stats.max <= key_stats.max &&
+         stats.distinct <= key_stats.distinct + key_stats.distinct / 10;
+}
+
+// Check whether a column is included in a key column
+bool ColumnStats::isIncluded(const uint64_t *values, const ColumnStats &stats,
+                             const uint64_t *key_values, const ColumnStats &key_stats)
+{
+  if (!mayBeIncluded(stats, key_stats))
+    return false;
+  uint64_t range = key_stats.max - key_stats.min;
+  // Distinct keys that fill their range contain every value within it
+  if (key_stats.keys_checked && key_stats.unique && range == key_stats.size - 1)
+    return true;
+
+  if (range < 64 * key_stats.size)
+  {
+    // Dense domain: a bitmap of the keys
+    std::vector<uint64_t> keys(range / 64 + 1, 0);
+    for (uint64_t i = 0; i < key_stats.size; ++i)
+    {
+      uint64_t offset = key_values[i] - key_stats.min;
+      keys[offset / 64] |= 1ull << (offset % 64);
+    }
+    for (uint64_t i = 0; i < stats.size; ++i)
+    {
+      uint64_t offset = values[i] - key_stats.min;
+      if (!(keys[offset / 64] & (1ull << (offset % 64))))
+        return false;
+    }
+    return true;
+  }
+  std::vector<uint64_t> copy;
+  if (!key_stats.sorted)
+  {
+    copy.assign(key_values, key_values + key_stats.size);
+    std::sort(copy.begin(), copy.end());
+    key_values = copy.data();
+  }
+  for (uint64_t i = 0; i < stats.size; ++i)
+  {
+    if (!std::binary_search(key_values, key_values + key_stats.size, values[i]))
+      return false;
+  }
+  return true;
+}
+
+// The statistics after appending values
+std::shared_ptr<ColumnStats> ColumnStats::extend(const ColumnStats &stats,
+                                                 uint64_t previous,
+                                                 const uint64_t *values,
+                                                 uint64_t count)
+{
+  if (stats.size == 0)
+    return compute(values, count);
+  auto extended = std::make_shared<ColumnStats>(stats);
+  if (count == 0)
+    return extended;
+
+  auto added = compute(values, count);
+  extended->size += count;
+  extended->min = std::min(stats.min, added->min);
+  extended->max = std::max(stats.max, added->max);
+  // The registers are gone, the new values may repeat old ones
+  extended->distinct = std::min(stats.distinct + added->distinct, extended->size);
+  extended->sorted = stats.sorted && added->sorted && previous <= values[0];
+
+  // A key stays a key if the new values are distinct and above all old ones,
+  // duplicates stay duplicates
+  bool known_unique = stats.keys_checked && stats.unique;
+  bool known_duplicate = stats.keys_checked && !stats.unique;
+  if (known_unique && added->keys_checked && added->unique && added->min > stats.max)
+  {
+    extended->unique = true;
+    extended->distinct = extended->size;
+  }
+  else
+  {
+    extended->keys_checked = known_duplicate;
+    extended->unique = false;
+  }
+
+  // Zones continue at the old size, the last one may be partial
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    uint64_t zone = (stats.size + i) / kZoneSize;
+    if (zone >= extended->zone_min.size())
+    {
+      extended->zone_min.resize(zone + 1, values[i]);
+      extended->zone_max.resize(zone + 1, values[i]);
+    }
+    extended->zone_min[zone] = std::min(extended->zone_min[zone], values[i]);
+    extended->zone_max[zone] = std::max(extended->zone_max[zone], values[i]);
+  }
+  return extended;
+}
+
+// Make room for the columns of the relations
+void Statistics::init(const std::vector<Relation> &relations)
+{
+  columns_.clear();
+  for (auto &relation : relations)
+    columns_.emplace_back(relation.columns().size());
+  {
+    std::lock_guard<std::mutex> lock(claim_mutex_);
+    claimed_.clear();
+    for (auto &relation : relations)
+      claimed_.emplace_back(relation.columns().size(), false);
+  }
+  std::lock_guard<std::mutex> lock(inclusion_mutex_);
+  inclusions_.clear();
+}
+
+// The statistics of a column
+std::shared_ptr<const ColumnStats> Statistics::get(unsigned relation_id,
+                                                   unsigned col_id) const
+{
+  if (relation_id >= columns_.size() || col_id >= columns_[relation_id].size())
+    return nullptr;
+  return std::atomic_load(&columns_[relation_id][col_id]);
+}
+
+// Publish the statistics of a column
+void Statistics::publish(unsigned relation_id, unsigned col_id,
+                         std::shared_ptr<const ColumnStats> stats)
+{
+  std::atomic_store(&columns_[relation_id][col_id], std::move(stats));
+}
+
+// Claim the computation of the statistics of a column
+bool Statistics::claim(unsigned relation_id, unsigned col_id)
+{
+  std::lock_guard<std::mutex> lock(claim_mutex_);
+  if (relation_id >= claimed_.size() || col_id >= claimed_[relation_id].size() ||
+      claimed_[relation_id][col_id] || get(relation_id, col_id))
+    return false;
+  claimed_[relation_id][col_id] = true;
+  return true;
+}
+
+// What is known about an inclusion dependency
+Statistics::Inclusion Statistics::inclusion(unsigned relation_id, unsigned col_id,
+                                            unsigned key_relation_id, unsigned key_col_id,
+                                            uint64_t size) const
+{
+  std::lock_guard<std::mutex> lock(inclusion_mutex_);
+  auto it = inclusions_.find(ColumnPair(relation_id, col_id, key_relation_id, key_col_id));
+  // Appended tuples have to be verified again
+  if (it == inclusions_.end() || it->second.first != size)
+    return Inclusion::Unknown;
+  return it->second.second;
+}
+
+// Claim the verification of an inclusion dependency
+bool Statistics::claimInclusion(unsigned relation_id, unsigned col_id, unsigned key_relation_id,
+                                unsigned key_col_id, uint64_t size)
+{
+  std::lock_guard<std::mutex> lock(inclusion_mutex_);
+  auto &entry = inclusions_[ColumnPair(relation_id, col_id, key_relation_id, key_col_id)];
+  if (entry.first == size && entry.second != Inclusion::Unknown)
+    return false;
+  entry = {size, Inclusion::Pending};
+  return true;
+}
+
+// Publish whether an inclusion dependency holds
+void Statistics::publishInclusion(unsigned relation_id, unsigned col_id,
+                                  unsigned key_relation_id, unsigned key_col_id,
+                                  uint64_t size, bool holds)
+{
+  std::lock_guard<std::mutex> lock(inclusion_mutex_);
+  inclusions_[ColumnPair(relation_id, col_id, key_relation_id, key_col_id)] = {
+      size, holds ? Inclusion::Holds : Inclusion::Fails};
+}
@@ -0,0 +1,188 @@
+#include "tbl.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+/// Target chunk size in bytes
+constexpr uint64_t kChunkSize = 1 << 22;
+
+// Count the newlines in [begin, end)
+uint64_t countLines(const char *begin, const char *end)
+{
+  uint64_t count = 0;
+  const char *p = begin;
+#ifdef __SSE2__
+  const __m128i newline = _mm_set1_epi8('\n');
+  for (; p + 16 <= end; p += 16)
+  {
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)));
+  }
+#endif
+  for (; p < end; ++p)
+    count += *p == '\n';
+  return count;
+}
+
+#ifdef __SSE2__
+// The number of leading digits of the 16 bytes at p
+unsigned digitRun(const char *p)
+{
+  auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+  // Unsigned "byte - '0' <= 9" with signed compares: bias by -128
+  auto biased = _mm_xor_si128(_mm_sub_epi8(bytes, _mm_set1_epi8('0')),
+                              _mm_set1_epi8(char(0x80)));
+  unsigned digits = _mm_movemask_epi8(_mm_cmplt_epi8(biased, _mm_set1_epi8(char(-118))));
+  return __builtin_ctz(~digits);
+}
+
+// Parse up to 8 digits at p (8 readable bytes), n > 0
+uint64_t parseDigits(const char *p, unsigned n)
+{
+  uint64_t chunk;
+  memcpy(&chunk, p, sizeof(chunk));
+  // Digit values, right aligned: leading bytes become zero digits
+  chunk -= 0x3030303030303030ull;
+  chunk <<= 8 * (8 - n);
+  // Combine pairs, then quadruples, then the two halves
+  chunk = (chunk * 10) + (chunk >> 8);
+  chunk = (((chunk & 0x000000ff000000ffull) * (100 + (1000000ull << 32))) +
+           (((chunk >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32)))) >> 32;
+  return chunk;
+}
+#endif
+
+// Parse an unsigned integer at p, false if there is none
+inline bool parseValue(const char *&p, const char *end, uint64_t &value)
+{
+#ifdef __SSE2__
+  if (end - p >= 16)
+  {
+    unsigned n = digitRun(p);
+    if (n == 0)
+      return false;
+    if (n <= 8)
+    {
+      value = parseDigits(p, n);
+      p += n;
+      return true;
+    }
+    if (n < 16)
+    {
+      value = parseDigits(p, n - 8) * 100000000 + parseDigits(p + n - 8, 8);
+      p += n;
+      return true;
+    }
+  }
+#endif
+  const char *start = p;
+  value = 0;
+  while (p < end && unsigned(*p - '0') <= 9)
+    value = value * 10 + (*p++ - '0');
+  return p != start;
+}
+
+} // namespace
+
+// Whether a file name has the .tbl extension
+bool TblParser::isTblFile(const std::string &file_name)
+{
+  return file_name.size() > 4 &&
+         file_name.compare(file_name.size() - 4, 4, ".tbl") == 0;
+}
+
+// Split into chunks and count the tuples
+bool TblParser::scan(ThreadPool &pool)
+{
+  // The columns of the first line
+  const char *p = data_, *end = data_ + length_;
+  num_columns_ = 0;
+  while (p < end && *p != '\n')
+  {
+    uint64_t value;
+    if (!parseValue(p, end, value))
+      return false;
+    ++num_columns_;
+    if (p < end && *p == '|')
+      ++p;
+    if (p < end && *p == '\r')
+      ++p;
+  }
+  if (num_columns_ == 0)
+    return false;
+
+  // Chunks start at line starts
+  bounds_.assign(1, 0);
+  for (uint64_t offset = kChunkSize; offset < length_; offset += kChunkSize)
+  {
+    auto newline = static_cast<const char *>(
+        memchr(data_ + std::max(offset, bounds_.back()), '\n',
+               length_ - std::max(offset, bounds_.back())));
+    if (!newline)
+      break;
+    uint64_t bound = newline - data_ + 1;
+    if (bound < length_ && bound > bounds_.back())
+      bounds_.push_back(bound);
+  }
+  bounds_.push_back(length_);
+
+  // Count the tuples of every chunk, a last line may lack its newline
+  uint64_t num_chunks = bounds_.size() - 1;
+  std::vector<uint64_t> lines(num_chunks);
+  pool.parallel_for(0, num_chunks, [&](uint64_t c) {
+    lines[c] = countLines(data_ + bounds_[c], data_ + bounds_[c + 1]);
+  }, 1);
+  if (length_ > 0 && data_[length_ - 1] != '\n')
+    ++lines.back();
+
+  first_rows_.assign(num_chunks, 0);
+  size_ = 0;
+  for (uint64_t c = 0; c < num_chunks; ++c)
+  {
+    first_rows_[c] = size_;
+    size_ += lines[c];
+  }
+  return true;
+}
+
+// Parse the lines of a chunk
+bool TblParser::parseChunk(const char *begin, const char *end,
+                           uint64_t first_row,
+                           const std::vector<uint64_t *> &columns)
+{
+  const char *p = begin;
+  for (uint64_t row = first_row; p < end; ++row)
+  {
+    for (unsigned c = 0; c < num_columns_; ++c)
+    {
+      if (!parseValue(p, end, columns[c][row]))
+        return false;
+      if (p < end && *p == '|')
+        ++p;
+      else if (c + 1 < num_columns_)
+        return false;
+    }
+    if (p < end && *p == '\r')
+      ++p;
+    if (p < end && *p++ != '\n')
+      return false;
+  }
+  return true;
+}
+
+// Parse the values into the columns
+bool TblParser::parse(ThreadPool &pool, const std::vector<uint64_t *> &columns)
+{
+  std::atomic<bool> valid{true};
+  pool.parallel_for(0, bounds_.size() - 1, [&](uint64_t c) {
+    if (!parseChunk(data_ + bounds_[c], data_ + bounds_[c + 1], first_rows_[c], columns))
+      valid = false;
+  }, 1);
+  return valid;
+}
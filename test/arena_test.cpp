@@ -0,0 +1,89 @@
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+#include "gtest/gtest.h"
+
+#include "arena.h"
+
+TEST(Arena, BlocksDoNotOverlap) {
+  Arena arena;
+  std::vector<std::vector<uint64_t *>> blocks(4);
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < blocks.size(); ++t) {
+    threads.emplace_back([&, t] {
+      for (uint64_t i = 0; i < 10000; ++i) {
+        auto block = static_cast<uint64_t *>(arena.allocate(3 * sizeof(uint64_t), alignof(uint64_t)));
+        ASSERT_EQ(reinterpret_cast<uintptr_t>(block) % alignof(uint64_t), 0u);
+        block[0] = block[1] = block[2] = t * 10000 + i;
+        blocks[t].push_back(block);
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  for (unsigned t = 0; t < blocks.size(); ++t) {
+    for (uint64_t i = 0; i < blocks[t].size(); ++i) {
+      ASSERT_EQ(blocks[t][i][0], t * 10000 + i);
+      ASSERT_EQ(blocks[t][i][2], t * 10000 + i);
+    }
+  }
+}
+
+TEST(Arena, ChunksAreRecycled) {
+  {
+    Arena arena;
+    for (int i = 0; i < 10; ++i) arena.allocate(Arena::kLargeSize, 8);
+    ASSERT_GE(arena.bytes(), 10 * Arena::kLargeSize);
+  }
+  auto pooled = Arena::pooledChunks();
+  ASSERT_GT(pooled, 0u);
+  {
+    // The next arena takes its chunk from the pool
+    Arena arena;
+    arena.allocate(64, 8);
+    ASSERT_EQ(Arena::pooledChunks(), pooled - 1);
+  }
+  ASSERT_EQ(Arena::pooledChunks(), pooled);
+}
+
+TEST(Arena, LargeBlocksAreRecycled) {
+  void *block;
+  {
+    Arena arena;
+    block = arena.allocate(3 * Arena::kLargeSize, 8);
+    // Rounded up to the size class
+    ASSERT_EQ(arena.bytes(), 4 * Arena::kLargeSize);
+    arena.deallocate(block, 3 * Arena::kLargeSize);
+    ASSERT_EQ(arena.bytes(), 0u);
+  }
+  auto pooled = Arena::pooledLargeBlocks();
+  ASSERT_GT(pooled, 0u);
+  {
+    // Another query growing to the same class takes the block
+    Arena arena;
+    ASSERT_EQ(arena.allocate(4 * Arena::kLargeSize, 8), block);
+    ASSERT_EQ(Arena::pooledLargeBlocks(), pooled - 1);
+    arena.deallocate(block, 4 * Arena::kLargeSize);
+  }
+  ASSERT_EQ(Arena::pooledLargeBlocks(), pooled);
+}
+
+TEST(Arena, Containers) {
+  Arena arena;
+  ArenaVector column{ArenaAllocator<uint64_t>(&arena)};
+  for (uint64_t i = 0; i < 100000; ++i) column.push_back(i);
+  ASSERT_EQ(column[99999], 99999u);
+  ASSERT_GT(arena.bytes(), 0u);
+
+  std::unordered_multimap<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+                          ArenaAllocator<std::pair<const uint64_t, uint64_t>>>
+      table(0, std::hash<uint64_t>(), std::equal_to<uint64_t>(), ArenaAllocator<uint64_t>(&arena));
+  for (uint64_t i = 0; i < 1000; ++i) table.emplace(i % 10, i);
+  ASSERT_EQ(table.count(3), 100u);
+
+  // Without an arena the heap is used
+  ArenaVector heap;
+  heap.assign(column.begin(), column.end());
+  ASSERT_EQ(heap.get_allocator().arena(), nullptr);
+  ASSERT_EQ(heap, column);
+}
@@ -0,0 +1,39 @@
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "batch.h"
+
+TEST(BatchContext, SharedBuildIsBuiltOnce) {
+  BatchContext batch;
+  auto key = BatchContext::buildKey("r0", 1);
+  batch.expectBuild(key);
+  ASSERT_FALSE(batch.isShared(key));
+  batch.expectBuild(key);
+  ASSERT_TRUE(batch.isShared(key));
+
+  std::atomic<int> num_builds{0};
+  auto build = [&] {
+    ++num_builds;
+    auto table = std::make_shared<BuildTable>();
+    uint64_t value = 42;
+    table->build(&value, nullptr, 1);
+    return table;
+  };
+  std::vector<std::shared_ptr<const BuildTable>> tables(4);
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < tables.size(); ++i) {
+    threads.emplace_back([&, i] { tables[i] = batch.getOrBuild(key, build); });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(num_builds, 1);
+  for (auto &table : tables) {
+    ASSERT_EQ(table, tables[0]);
+    ASSERT_EQ(table->count(42), 1u);
+  }
+
+  batch.clear();
+  ASSERT_FALSE(batch.isShared(key));
+}
@@ -0,0 +1,47 @@
+#include "gtest/gtest.h"
+
+#include "cache.h"
+
+static std::shared_ptr<CachedResult> createResult(uint64_t num_row_ids) {
+  auto result = std::make_shared<CachedResult>();
+  result->row_ids.resize(num_row_ids);
+  result->size = num_row_ids;
+  return result;
+}
+
+TEST(ResultCache, LookupAndInsert) {
+  ResultCache cache;
+  ASSERT_EQ(cache.lookup("a"), nullptr);
+
+  cache.insert("a", createResult(10), 1.0);
+  auto result = cache.lookup("a");
+  ASSERT_NE(result, nullptr);
+  ASSERT_EQ(result->size, 10u);
+  ASSERT_EQ(cache.size(), 1u);
+
+  cache.clear();
+  ASSERT_EQ(cache.lookup("a"), nullptr);
+  ASSERT_EQ(cache.usedBytes(), 0u);
+}
+
+TEST(ResultCache, EvictsCheapestPerByte) {
+  auto bytes = createResult(100)->bytes() + 1;
+  ResultCache cache(2 * bytes);
+
+  cache.insert("a", createResult(100), 1000.0);
+  cache.insert("b", createResult(100), 1.0);
+  // Needs room for one more entry: "b" is cheaper to recompute
+  cache.insert("c", createResult(100), 500.0);
+
+  ASSERT_NE(cache.lookup("a"), nullptr);
+  ASSERT_EQ(cache.lookup("b"), nullptr);
+  ASSERT_NE(cache.lookup("c"), nullptr);
+  ASSERT_LE(cache.usedBytes(), 2 * bytes);
+}
+
+TEST(ResultCache, RejectsOversizedResults) {
+  ResultCache cache(64);
+  cache.insert("a", createResult(1000), 1000.0);
+  ASSERT_EQ(cache.lookup("a"), nullptr);
+  ASSERT_EQ(cache.size(), 0u);
+}
@@ -0,0 +1,82 @@
+#include <algorithm>
+
+#include "gtest/gtest.h"
+
+#include "compression.h"
+
+namespace {
+
+// Compare the encoded filter with a plain one for some constants
+void checkFilters(const std::vector<uint64_t> &values, const EncodedColumn &column) {
+  for (char comparison : {'=', '<', '>'}) {
+    for (uint64_t constant : {0ull, 3ull, 500ull, 1000ull, 1ull << 20, 1ull << 40}) {
+      std::vector<uint64_t> expected;
+      for (uint64_t i = 0; i < values.size(); ++i) {
+        bool pass = comparison == '=' ? values[i] == constant
+                    : comparison == '<' ? values[i] < constant : values[i] > constant;
+        if (pass) expected.push_back(i);
+      }
+      std::vector<uint64_t> row_ids;
+      uint32_t lo, hi;
+      if (column.codeRange(comparison, constant, lo, hi)) {
+        column.select(0, values.size(), lo, hi, row_ids);
+      }
+      ASSERT_EQ(row_ids, expected) << comparison << constant;
+    }
+  }
+}
+
+}
+
+TEST(EncodedColumn, FrameOfReference) {
+  std::vector<uint64_t> values;
+  for (uint64_t i = 0; i < 10000; ++i) {
+    values.push_back(3 + (i * 7919) % 2000);
+  }
+  auto column = EncodedColumn::encode(values.data(), values.size(), 3, 2002, 2000);
+  ASSERT_NE(column, nullptr);
+  ASSERT_EQ(column->kind(), EncodedColumn::Kind::FrameOfReference);
+  ASSERT_EQ(column->width(), 2u);
+  checkFilters(values, *column);
+
+  std::vector<uint64_t> row_ids{0, 5, 9999}, out(3);
+  column->gather(row_ids.data(), row_ids.size(), out.data());
+  ASSERT_EQ(out, (std::vector<uint64_t>{values[0], values[5], values[9999]}));
+}
+
+TEST(EncodedColumn, Dictionary) {
+  std::vector<uint64_t> values;
+  for (uint64_t i = 0; i < 10000; ++i) {
+    values.push_back((i % 100) << 30);
+  }
+  auto column = EncodedColumn::encode(values.data(), values.size(), 0, 99ull << 30, 100);
+  ASSERT_NE(column, nullptr);
+  ASSERT_EQ(column->kind(), EncodedColumn::Kind::Dictionary);
+  ASSERT_EQ(column->width(), 1u);
+  checkFilters(values, *column);
+  for (uint64_t i = 0; i < values.size(); i += 997) {
+    ASSERT_EQ(column->get(i), values[i]);
+  }
+
+  // Refine keeps the rows before first
+  std::vector<uint64_t> row_ids{42, 0, 100, 150};
+  uint32_t lo, hi;
+  ASSERT_TRUE(column->codeRange('=', 0, lo, hi));
+  column->refine(lo, hi, row_ids, 1);
+  ASSERT_EQ(row_ids, (std::vector<uint64_t>{42, 0, 100}));
+}
+
+TEST(EncodedColumn, Incompressible) {
+  std::vector<uint64_t> values{0, 1ull << 63};
+  ASSERT_EQ(EncodedColumn::encode(values.data(), 2, 0, 1ull << 63, 2)->width(), 1u);
+  std::vector<uint64_t> wide;
+  for (uint64_t i = 0; i < 1000; ++i) {
+    wide.push_back(i << 40);
+  }
+  ASSERT_EQ(EncodedColumn::encode(wide.data(), wide.size(), 0, 999ull << 40, 1000)->width(), 2u);
+  wide[0] = 1;
+  for (uint64_t i = 0; i < 100000; ++i) {
+    wide.push_back((i + 1000) << 40);
+  }
+  ASSERT_EQ(EncodedColumn::encode(wide.data(), wide.size(), 1, 100999ull << 40, 101000), nullptr);
+}
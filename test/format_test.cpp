@@ -0,0 +1,114 @@
+#include <cstdio>
+#include <cstring>
+
+#include "gtest/gtest.h"
+
+#include "format.h"
+#include "relation.h"
+#include "runtime.h"
+#include "utils.h"
+
+namespace {
+
+class RelationFileTest : public testing::Test {
+ protected:
+  /// Remove the files the tests write
+  void TearDown() override {
+    for (auto name : {"r1.v1", "r1.v2", "r1.v2.tbl", "r1.snap"}) {
+      std::remove(name);
+      std::remove(RelationFile::snapshotName(name).c_str());
+    }
+  }
+};
+
+TEST_F(RelationFileTest, StoreAndLoad) {
+  Relation r1 = Utils::createRelation(100000, 3);
+  std::vector<StoredColumn> columns(3);
+  auto stats = ColumnStats::compute(r1.columns()[0], r1.size());
+  columns[0].stats = stats;
+  columns[0].encoded = EncodedColumn::encode(r1.columns()[0], r1.size(), stats->min,
+                                             stats->max, stats->distinct);
+  columns[2].stats = ColumnStats::compute(r1.columns()[2], r1.size());
+  RelationFile::store("r1.v2", r1, columns);
+
+  Relation r2("r1.v2");
+  ASSERT_EQ(r2.size(), r1.size());
+  ASSERT_EQ(r2.columns().size(), 3u);
+  for (unsigned c = 0; c < 3; ++c) {
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(r2.columns()[c]) % RelationFile::kPageSize, 0u);
+    ASSERT_EQ(memcmp(r1.columns()[c], r2.columns()[c], r1.size() * sizeof(uint64_t)), 0);
+  }
+
+  auto loaded = r2.storedStats(0);
+  ASSERT_NE(loaded, nullptr);
+  ASSERT_EQ(loaded->max, stats->max);
+  ASSERT_EQ(loaded->distinct, stats->distinct);
+  ASSERT_EQ(loaded->sorted, stats->sorted);
+  ASSERT_EQ(loaded->zone_max, stats->zone_max);
+  ASSERT_EQ(r2.storedStats(1), nullptr);
+  ASSERT_NE(r2.storedStats(2), nullptr);
+
+  auto encoded = r2.encoded(0);
+  ASSERT_NE(encoded, nullptr);
+  ASSERT_EQ(encoded->width(), columns[0].encoded->width());
+  for (uint64_t i = 0; i < r2.size(); i += 1001) {
+    ASSERT_EQ(encoded->get(i), r1.columns()[0][i]);
+  }
+  ASSERT_EQ(r2.encoded(1), nullptr);
+}
+
+TEST_F(RelationFileTest, DetectsFormat) {
+  Relation r1 = Utils::createRelation(10, 2);
+  r1.storeRelation("r1.v1");
+  RelationFile::store("r1.v2", r1, {});
+  std::ifstream v1("r1.v1", std::ios::binary), v2("r1.v2", std::ios::binary);
+  char header[64];
+  v1.read(header, sizeof(header));
+  ASSERT_FALSE(RelationFile::isV2(header, v1.gcount()));
+  v2.read(header, sizeof(header));
+  ASSERT_TRUE(RelationFile::isV2(header, v2.gcount()));
+  // Without metadata a v2 file still loads
+  Relation r2("r1.v2");
+  ASSERT_EQ(r2.size(), 10u);
+  ASSERT_EQ(r2.storedStats(0), nullptr);
+  // A .tbl file converted in place is still read as v2
+  RelationFile::store("r1.v2.tbl", r1, {});
+  Relation r3("r1.v2.tbl");
+  ASSERT_EQ(r3.size(), 10u);
+  ASSERT_EQ(memcmp(r1.columns()[1], r3.columns()[1], r1.size() * sizeof(uint64_t)), 0);
+}
+
+TEST_F(RelationFileTest, Snapshot) {
+  Relation r1 = Utils::createRelation(1000, 2);
+  r1.storeRelation("r1.snap");
+  std::remove(RelationFile::snapshotName("r1.snap").c_str());
+  {
+    Relation r2("r1.snap");
+    ASSERT_FALSE(r2.hasStoredMetadata());
+    std::vector<StoredColumn> columns(2);
+    for (unsigned c = 0; c < 2; ++c) {
+      auto stats = ColumnStats::compute(r2.columns()[c], r2.size());
+      columns[c].stats = stats;
+      columns[c].encoded = EncodedColumn::encode(r2.columns()[c], r2.size(), stats->min,
+                                                 stats->max, stats->distinct);
+    }
+    ASSERT_TRUE(r2.storeSnapshot(columns));
+  }
+  {
+    // Snapshots are only read when opted in (DB_SNAPSHOT=1)
+    Relation r2("r1.snap");
+    ASSERT_EQ(r2.hasStoredMetadata(), Runtime::get().snapshots());
+    if (Runtime::get().snapshots()) {
+      ASSERT_EQ(r2.storedStats(1)->max, 999u);
+      ASSERT_EQ(r2.encoded(1)->get(500), 500u);
+    }
+  }
+
+  // A changed relation file invalidates the snapshot
+  Utils::createRelation(1000, 3).storeRelation("r1.snap");
+  Relation r3("r1.snap");
+  ASSERT_FALSE(r3.hasStoredMetadata());
+  ASSERT_EQ(r3.storedStats(0), nullptr);
+}
+
+}
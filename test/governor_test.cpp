@@ -0,0 +1,45 @@
+#include "gtest/gtest.h"
+
+#include "arena.h"
+#include "governor.h"
+
+TEST(MemoryGovernor, Reservations) {
+  MemoryGovernor governor(1000, 600, "/tmp");
+  {
+    Reservation first(governor), second(governor);
+    ASSERT_TRUE(first.grow(500, nullptr));
+    // Beyond the budget of the query
+    ASSERT_FALSE(first.grow(200, nullptr));
+    ASSERT_TRUE(second.grow(400, nullptr));
+    // Beyond the budget of the process
+    ASSERT_FALSE(second.grow(200, nullptr));
+    ASSERT_EQ(governor.reserved(), 900u);
+    first.shrink(300);
+    ASSERT_TRUE(second.grow(200, nullptr));
+  }
+  ASSERT_EQ(governor.reserved(), 0u);
+}
+
+TEST(MemoryGovernor, ArenaCountsAgainstTheQuery) {
+  MemoryGovernor governor(Arena::kChunkSize * 4, Arena::kChunkSize, "/tmp");
+  Arena arena;
+  Reservation reservation(governor);
+  ASSERT_TRUE(reservation.grow(1000, &arena));
+  arena.allocate(64, alignof(uint64_t));
+  ASSERT_FALSE(reservation.grow(1000, &arena));
+}
+
+TEST(SpillFile, ResizeKeepsValues) {
+  SpillFile file("/tmp");
+  ASSERT_EQ(file.size(), 0u);
+  file.resize(1000);
+  for (uint64_t i = 0; i < 1000; ++i) file.data()[i] = i;
+  file.resize(1000000);
+  ASSERT_EQ(file.size(), 1000000u);
+  for (uint64_t i = 0; i < 1000; ++i) ASSERT_EQ(file.data()[i], i);
+  file.data()[999999] = 1;
+}
+
+TEST(SpillFile, ReportsFailures) {
+  ASSERT_THROW(SpillFile("/nonexistent-spill-dir"), SpillError);
+}
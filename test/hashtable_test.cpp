@@ -0,0 +1,69 @@
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "hashtable.h"
+
+TEST(JoinHashTable, ProbeFindsAllMatches) {
+  // Duplicates, and keys that share their low and high bits
+  std::vector<uint64_t> build_keys, probe_keys;
+  for (uint64_t i = 0; i < 5000; ++i) build_keys.push_back((i % 1000) << 20);
+  for (uint64_t i = 0; i < 3000; ++i) probe_keys.push_back((i % 1500) << 20);
+  std::multimap<uint64_t, uint64_t> expected;
+  for (uint64_t i = 0; i < build_keys.size(); ++i) expected.emplace(build_keys[i], i);
+
+  Arena arena;
+  JoinHashTable table(&arena);
+  table.build(build_keys.data(), nullptr, build_keys.size());
+  ASSERT_EQ(table.size(), build_keys.size());
+  ASSERT_EQ(table.count(0), 5u);
+  ASSERT_EQ(table.count(1), 0u);
+
+  // Probe a range that does not start at a group boundary
+  std::vector<std::pair<uint64_t, uint64_t>> matches;
+  table.probe(probe_keys.data(), nullptr, 3, probe_keys.size(),
+              [&](const uint64_t *entry, uint64_t probe_id) {
+                matches.emplace_back(JoinHashTable::tupleId(entry), probe_id);
+              });
+  uint64_t num_expected = 0;
+  for (uint64_t i = 3; i < probe_keys.size(); ++i) num_expected += expected.count(probe_keys[i]);
+  ASSERT_EQ(matches.size(), num_expected);
+  for (auto &[build_id, probe_id] : matches) ASSERT_EQ(build_keys[build_id], probe_keys[probe_id]);
+}
+
+TEST(JoinHashTable, RowIds) {
+  std::vector<uint64_t> keys = {7, 8, 7, 9, 7};
+  std::vector<uint64_t> build_ids = {0, 1, 4}, probe_ids = {2, 3};
+  JoinHashTable table;
+  table.build(keys.data(), build_ids.data(), build_ids.size());
+  std::vector<std::pair<uint64_t, uint64_t>> matches;
+  table.probe(keys.data(), probe_ids.data(), 0, probe_ids.size(),
+              [&](const uint64_t *entry, uint64_t probe_id) {
+                matches.emplace_back(JoinHashTable::tupleId(entry), probe_id);
+              });
+  std::sort(matches.begin(), matches.end());
+  ASSERT_EQ(matches, (std::vector<std::pair<uint64_t, uint64_t>>{{0, 2}, {4, 2}}));
+
+  JoinHashTable empty;
+  empty.build(keys.data(), nullptr, 0);
+  ASSERT_EQ(empty.count(7), 0u);
+}
+
+TEST(JoinHashTable, Payload) {
+  std::vector<uint64_t> keys = {1, 2, 1}, first = {10, 20, 30}, second = {11, 21, 31};
+  JoinHashTable table;
+  table.build(keys.data(), nullptr, keys.size(), {first.data(), second.data()});
+  ASSERT_EQ(table.size(), 3u);
+  uint64_t probe_key = 1;
+  std::vector<uint64_t> values;
+  table.probe(&probe_key, nullptr, 0, 1, [&](const uint64_t *entry, uint64_t) {
+    auto id = JoinHashTable::tupleId(entry);
+    ASSERT_EQ(JoinHashTable::payload(entry)[0], first[id]);
+    ASSERT_EQ(JoinHashTable::payload(entry)[1], second[id]);
+    values.push_back(JoinHashTable::payload(entry)[0]);
+  });
+  std::sort(values.begin(), values.end());
+  ASSERT_EQ(values, (std::vector<uint64_t>{10, 30}));
+}
@@ -1,5 +1,10 @@
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <numeric>
+#include <unordered_map>
+
 #include "joiner.h"
 #include "operators.h"
 #include "utils.h"
@@ -26,6 +31,30 @@ TEST_F(OperatorTest, Scan) {
   ASSERT_EQ(results[col_id_2], r1.columns()[2]);
 }
 
+TEST_F(OperatorTest, ScanAppends) {
+  unsigned rel_binding = 5;
+  auto relation = Utils::createRelation(100, 2);
+  relation.append({{100, 101}, {100, 101}});
+  auto scan = [&] {
+    Scan scan(relation, rel_binding);
+    scan.require(SelectInfo(rel_binding, 1));
+    scan.run();
+    EXPECT_EQ(scan.result_size(), relation.totalSize());
+    auto column = scan.getResults()[0];
+    for (uint64_t i = 0; i < scan.result_size(); ++i) {
+      EXPECT_EQ(column[i], i);
+    }
+    return column;
+  };
+  // The scans share the copy with the delta appended, later appends extend
+  // it by their tuples
+  auto column = scan();
+  ASSERT_NE(column, relation.columns()[1]);
+  ASSERT_EQ(scan(), column);
+  relation.append({{102}, {102}});
+  ASSERT_EQ(scan(), column);
+}
+
 TEST_F(OperatorTest, ScanWithSelection) {
   unsigned rel_id = 0;
   unsigned rel_binding = 1;
@@ -71,6 +100,84 @@ TEST_F(OperatorTest, ScanWithSelection) {
   }
 }
 
+TEST_F(OperatorTest, SharedScan) {
+  unsigned rel_binding = 1;
+  FilterInfo less(SelectInfo(0, rel_binding, 1), 4, FilterInfo::Comparison::Less);
+  FilterInfo equal(SelectInfo(0, rel_binding, 2), 7, FilterInfo::Comparison::Equal);
+  auto less_scan = std::make_shared<FilterScan>(r2, less);
+  auto equal_scan = std::make_shared<FilterScan>(r2, equal);
+
+  ResultCache cache;
+  SharedScan shared_scan(r2);
+  shared_scan.add(less_scan);
+  shared_scan.add(equal_scan);
+  shared_scan.run(cache);
+  ASSERT_EQ(cache.size(), 2u);
+
+  less_scan->setCache(&cache);
+  less_scan->require(SelectInfo(rel_binding, 0));
+  less_scan->run();
+  ASSERT_EQ(less_scan->result_size(), 4ull);
+  auto results = less_scan->getResults();
+  for (unsigned j = 0; j < less_scan->result_size(); ++j) {
+    ASSERT_EQ(results[0][j], j);
+  }
+
+  equal_scan->setCache(&cache);
+  equal_scan->require(SelectInfo(rel_binding, 3));
+  equal_scan->run();
+  ASSERT_EQ(equal_scan->result_size(), 1ull);
+  ASSERT_EQ(equal_scan->getResults()[0][0], 7u);
+}
+
+TEST_F(OperatorTest, FilterScanOnCodes) {
+  Relation r = Utils::createRelation(10000, 3);
+  for (unsigned c = 0; c < 2; ++c) {
+    r.setEncoded(c, EncodedColumn::encode(r.columns()[c], r.size(), 0, 9999, 10000));
+  }
+  unsigned rel_binding = 0;
+  std::vector<FilterInfo> filters{
+      FilterInfo(SelectInfo(0, rel_binding, 0), 100, FilterInfo::Comparison::Greater),
+      FilterInfo(SelectInfo(0, rel_binding, 2), 5000, FilterInfo::Comparison::Less)};
+
+  ResultCache cache;
+  FilterScan scan(r, filters);
+  scan.setCache(&cache);
+  scan.require(SelectInfo(rel_binding, 1));
+  scan.run();
+  ASSERT_EQ(scan.result_size(), 4899ull);
+  auto results = scan.getResults();
+  for (unsigned j = 0; j < scan.result_size(); ++j) {
+    ASSERT_EQ(results[0][j], j + 101);
+  }
+}
+
+TEST_F(OperatorTest, FilterScanSkipsZones) {
+  uint64_t size = 3 * ColumnStats::kZoneSize;
+  Relation r = Utils::createRelation(size, 2);
+  for (uint64_t i = 0; i < size; ++i) r.columns()[0][i] = i % 2;
+  // Zone maps of ascending values: the zones after the first one claim
+  // that no value is below 1, so their tuples are never looked at
+  std::vector<uint64_t> ascending(size);
+  std::iota(ascending.begin(), ascending.end(), 0);
+  auto stats = ColumnStats::compute(ascending.data(), size);
+  unsigned rel_binding = 0;
+  auto filter = [&](bool zone_maps) {
+    FilterInfo f_info(SelectInfo(0, rel_binding, 0), 1, FilterInfo::Comparison::Less);
+    FilterScan scan(r, f_info);
+    if (zone_maps) scan.addZoneMap(0, stats);
+    scan.require(SelectInfo(rel_binding, 1));
+    scan.run();
+    auto results = scan.getResults();
+    for (uint64_t j = 0; j < scan.result_size(); ++j) {
+      EXPECT_EQ(results[0][j] % 2, 0u);
+    }
+    return scan.result_size();
+  };
+  ASSERT_EQ(filter(false), size / 2);
+  ASSERT_EQ(filter(true), ColumnStats::kZoneSize / 2);
+}
+
 TEST_F(OperatorTest, Join) {
   unsigned l_rid = 0, r_rid = 1;
   unsigned r1_bind = 0, r2_bind = 1;
@@ -132,6 +239,216 @@ TEST_F(OperatorTest, Join) {
   }
 }
 
+TEST_F(OperatorTest, JoinLargeInputs) {
+  // Large enough for the partitioned join when there are several threads
+  Relation left = Utils::createRelation(8000, 2);
+  Relation right = Utils::createRelation(40000, 2);
+  PredicateInfo p_info(SelectInfo(0, 0, 0), SelectInfo(1, 1, 1));
+  Join join(std::make_shared<Scan>(left, 0), std::make_shared<Scan>(right, 1), p_info);
+  join.require(SelectInfo(0, 0, 1));
+  join.require(SelectInfo(1, 1, 0));
+  join.run();
+
+  ASSERT_EQ(join.result_size(), left.size());
+  auto results = join.getResults();
+  auto left_col = results[join.resolve(SelectInfo(0, 0, 1))];
+  auto right_col = results[join.resolve(SelectInfo(1, 1, 0))];
+  std::vector<uint64_t> values(left_col, left_col + join.result_size());
+  std::sort(values.begin(), values.end());
+  for (uint64_t i = 0; i < values.size(); ++i)
+  {
+    ASSERT_EQ(values[i], i);
+    ASSERT_EQ(left_col[i], right_col[i]);
+  }
+}
+
+TEST_F(OperatorTest, JoinSkewedKeys) {
+  // A quarter of the probe tuples share a key, the other keys share a residue
+  Relation left = Utils::createRelation(8000, 1);
+  Relation right = Utils::createRelation(40000, 1);
+  for (uint64_t i = 0; i < left.size(); ++i)
+    left.columns()[0][i] = i % 40 == 1 ? 7 : i * 64;
+  for (uint64_t i = 0; i < right.size(); ++i)
+    right.columns()[0][i] = i % 4 == 0 ? 7 : (i % 8000) * 64;
+  PredicateInfo p_info(SelectInfo(0, 0, 0), SelectInfo(1, 1, 0));
+  Join join(std::make_shared<Scan>(left, 0), std::make_shared<Scan>(right, 1), p_info);
+  join.require(SelectInfo(0, 0, 0));
+  join.require(SelectInfo(1, 1, 0));
+  join.run();
+
+  std::unordered_map<uint64_t, uint64_t> left_counts, right_counts;
+  for (uint64_t i = 0; i < left.size(); ++i) ++left_counts[left.columns()[0][i]];
+  for (uint64_t i = 0; i < right.size(); ++i) ++right_counts[right.columns()[0][i]];
+  uint64_t expected = 0;
+  for (auto &[key, count] : left_counts) expected += count * right_counts[key];
+
+  ASSERT_EQ(join.result_size(), expected);
+  auto results = join.getResults();
+  auto left_col = results[join.resolve(SelectInfo(0, 0, 0))];
+  auto right_col = results[join.resolve(SelectInfo(1, 1, 0))];
+  std::unordered_map<uint64_t, uint64_t> result_counts;
+  for (uint64_t i = 0; i < join.result_size(); ++i) {
+    ASSERT_EQ(left_col[i], right_col[i]);
+    ++result_counts[left_col[i]];
+  }
+  ASSERT_EQ(result_counts[7], left_counts[7] * right_counts[7]);
+}
+
+TEST_F(OperatorTest, JoinSpills) {
+  Relation left = Utils::createRelation(20000, 2);
+  Relation right = Utils::createRelation(40000, 2);
+  for (uint64_t budget : {uint64_t(1) << 19, uint64_t(1) << 20}) {
+    // The build side is beyond the first budget, the result beyond both
+    MemoryGovernor governor(budget, budget, "/tmp");
+    PredicateInfo p_info(SelectInfo(0, 0, 0), SelectInfo(1, 1, 1));
+    Join join(std::make_shared<Scan>(left, 0), std::make_shared<Scan>(right, 1), p_info);
+    join.setGovernor(&governor);
+    for (unsigned col = 0; col < 2; ++col) {
+      join.require(SelectInfo(0, 0, col));
+      join.require(SelectInfo(1, 1, col));
+    }
+    join.run();
+    ASSERT_GT(governor.spills(), 0u);
+
+    ASSERT_EQ(join.result_size(), left.size());
+    auto results = join.getResults();
+    auto left_col = results[join.resolve(SelectInfo(0, 0, 1))];
+    auto right_col = results[join.resolve(SelectInfo(1, 1, 0))];
+    std::vector<uint64_t> values(left_col, left_col + join.result_size());
+    std::sort(values.begin(), values.end());
+    for (uint64_t i = 0; i < values.size(); ++i) {
+      ASSERT_EQ(values[i], i);
+      ASSERT_EQ(left_col[i], right_col[i]);
+    }
+  }
+}
+
+TEST_F(OperatorTest, JoinSpillsSkewedKeys) {
+  // A quarter of the build tuples share a key, it is joined on its own. A
+  // few other keys still overload their partitions, which are split again
+  Relation left = Utils::createRelation(200000, 1);
+  Relation right = Utils::createRelation(250000, 1);
+  for (uint64_t i = 0; i < left.size(); ++i)
+    left.columns()[0][i] = i % 4 == 0 ? 7 : ((i / 4) % 16 + 1) * 64;
+  for (uint64_t i = 0; i < right.size(); ++i)
+    right.columns()[0][i] = i % 50000 == 0 ? 7 : i % 4000 == 1 ? ((i / 4000) % 16 + 1) * 64 : i * 64 + 3;
+  MemoryGovernor governor(uint64_t(1) << 19, uint64_t(1) << 19, "/tmp");
+  PredicateInfo p_info(SelectInfo(0, 0, 0), SelectInfo(1, 1, 0));
+  Join join(std::make_shared<Scan>(left, 0), std::make_shared<Scan>(right, 1), p_info);
+  join.setGovernor(&governor);
+  join.require(SelectInfo(0, 0, 0));
+  join.require(SelectInfo(1, 1, 0));
+  join.run();
+  ASSERT_GT(governor.spills(), 0u);
+
+  std::unordered_map<uint64_t, uint64_t> left_counts, right_counts;
+  for (uint64_t i = 0; i < left.size(); ++i) ++left_counts[left.columns()[0][i]];
+  for (uint64_t i = 0; i < right.size(); ++i) ++right_counts[right.columns()[0][i]];
+  uint64_t expected = 0;
+  for (auto &[key, count] : left_counts) expected += count * right_counts[key];
+
+  ASSERT_EQ(join.result_size(), expected);
+  auto results = join.getResults();
+  auto left_col = results[join.resolve(SelectInfo(0, 0, 0))];
+  auto right_col = results[join.resolve(SelectInfo(1, 1, 0))];
+  std::unordered_map<uint64_t, uint64_t> result_counts;
+  for (uint64_t i = 0; i < join.result_size(); ++i) {
+    ASSERT_EQ(left_col[i], right_col[i]);
+    ++result_counts[left_col[i]];
+  }
+  ASSERT_EQ(result_counts[7], left_counts[7] * right_counts[7]);
+}
+
+TEST_F(OperatorTest, SharedBuildOverBudget) {
+  Relation left = Utils::createRelation(20000, 2);
+  Relation right = Utils::createRelation(40000, 2);
+  MemoryGovernor governor(uint64_t(1) << 19, uint64_t(1) << 19, "/tmp");
+  BatchContext batch;
+  auto left_scan = std::make_shared<Scan>(left, 0);
+  auto key = BatchContext::buildKey(left_scan->signature(), 0);
+  batch.expectBuild(key);
+  batch.expectBuild(key);
+  PredicateInfo p_info(SelectInfo(0, 0, 0), SelectInfo(1, 1, 1));
+  Join join(left_scan, std::make_shared<Scan>(right, 1), p_info);
+  join.setGovernor(&governor);
+  join.setBatch(&batch);
+  join.require(SelectInfo(0, 0, 1));
+  join.require(SelectInfo(1, 1, 0));
+  join.run();
+  // The shared table does not fit, the join spills instead
+  ASSERT_GT(governor.spills(), 0u);
+  ASSERT_EQ(join.result_size(), left.size());
+  batch.clear();
+  ASSERT_EQ(governor.reserved(), 0u);
+}
+
+TEST_F(OperatorTest, MergeJoin) {
+  // The left input is declared sorted, the right one is sorted by the join
+  Relation left = Utils::createRelation(3000, 2);
+  Relation right = Utils::createRelation(5000, 1);
+  for (uint64_t i = 0; i < left.size(); ++i) left.columns()[0][i] = i / 3;
+  for (uint64_t i = 0; i < right.size(); ++i) right.columns()[0][i] = (i * 7919) % 1200;
+  auto left_scan = std::make_shared<Scan>(left, 0);
+  left_scan->addSortedOn(SelectInfo(0, 0, 0));
+  PredicateInfo p_info(SelectInfo(0, 0, 0), SelectInfo(1, 1, 0));
+  MergeJoin join(left_scan, std::make_shared<Scan>(right, 1), p_info);
+  join.require(SelectInfo(0, 0, 1));
+  join.require(SelectInfo(1, 1, 0));
+  join.run();
+
+  std::unordered_map<uint64_t, uint64_t> right_counts;
+  for (uint64_t i = 0; i < right.size(); ++i) ++right_counts[right.columns()[0][i]];
+  uint64_t expected = 0;
+  for (uint64_t i = 0; i < left.size(); ++i) expected += right_counts[left.columns()[0][i]];
+
+  ASSERT_EQ(join.result_size(), expected);
+  ASSERT_TRUE(join.sortedOn(SelectInfo(0, 0, 0)));
+  ASSERT_TRUE(join.sortedOn(SelectInfo(1, 1, 0)));
+  auto results = join.getResults();
+  auto left_col = results[join.resolve(SelectInfo(0, 0, 1))];
+  auto right_col = results[join.resolve(SelectInfo(1, 1, 0))];
+  ASSERT_TRUE(std::is_sorted(right_col, right_col + join.result_size()));
+  for (uint64_t i = 0; i < join.result_size(); ++i) {
+    // The second left column holds the tuple id
+    ASSERT_EQ(left_col[i] / 3, right_col[i]);
+  }
+}
+
+TEST_F(OperatorTest, FactorizedJoin) {
+  // Three inputs on one key with many duplicates on every side
+  std::vector<Relation> relations;
+  for (uint64_t size : {600, 900, 400}) {
+    relations.push_back(Utils::createRelation(size, 2));
+    for (uint64_t i = 0; i < size; ++i) relations.back().columns()[0][i] = (i * 31) % 50;
+  }
+  FactorizedJoin join(std::make_shared<Scan>(relations[0], 0), std::make_shared<Scan>(relations[1], 1),
+                      PredicateInfo(SelectInfo(0, 0, 0), SelectInfo(1, 1, 0)));
+  ASSERT_TRUE(join.joinsOn(SelectInfo(1, 1, 0)));
+  join.addInput(std::make_shared<Scan>(relations[2], 2), SelectInfo(2, 2, 0));
+  for (unsigned binding = 0; binding < 3; ++binding) join.require(SelectInfo(binding, binding, 1));
+  join.run();
+
+  // Every key has 12, 18 and 8 tuples
+  ASSERT_EQ(join.result_size(), 50u * 12 * 18 * 8);
+  std::vector<uint64_t> sums;
+  for (unsigned binding = 0; binding < 3; ++binding)
+    sums.push_back(join.sum(SelectInfo(binding, binding, 1)));
+  ASSERT_EQ(sums[0], (599u * 600 / 2) * 18 * 8);
+
+  // The flat result has the same sums
+  auto results = join.getResults();
+  for (unsigned binding = 0; binding < 3; ++binding) {
+    auto column = results[join.resolve(SelectInfo(binding, binding, 1))];
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < join.result_size(); ++i) sum += column[i];
+    ASSERT_EQ(sum, sums[binding]);
+    ASSERT_EQ(join.sum(SelectInfo(binding, binding, 1)), sums[binding]);
+  }
+  auto first = results[join.resolve(SelectInfo(0, 0, 1))];
+  auto last = results[join.resolve(SelectInfo(2, 2, 1))];
+  for (uint64_t i = 0; i < join.result_size(); ++i) ASSERT_EQ((first[i] * 31) % 50, (last[i] * 31) % 50);
+}
+
 TEST_F(OperatorTest, Checksum) {
   unsigned rel_binding = 5;
   Scan r1_scan(r1, rel_binding);
@@ -196,6 +513,16 @@ TEST_F(OperatorTest, SelfJoin) {
     auto results = selfjoin.getResults();
     ASSERT_EQ(results.size(), 1ull);
   }
+  {
+    // Keys the input declares after construction are seen
+    auto input = std::make_shared<Scan>(r1_scan);
+    PredicateInfo
+        p_info(SelectInfo(1, rel_binding, 1), SelectInfo(1, rel_binding, 2));
+    SelfJoin selfjoin(std::shared_ptr<Operator>(input), p_info);
+    ASSERT_FALSE(selfjoin.sortedOn(SelectInfo(rel_binding, 0)));
+    input->addSortedOn(SelectInfo(rel_binding, 0));
+    ASSERT_TRUE(selfjoin.sortedOn(SelectInfo(rel_binding, 0)));
+  }
 }
 
 TEST_F(OperatorTest, Joiner) {
@@ -289,4 +616,107 @@ TEST_F(OperatorTest, Joiner) {
   }
 }
 
+TEST_F(OperatorTest, JoinerAppends) {
+  Joiner joiner;
+  joiner.addRelation(Utils::createRelation(10, 3));
+  joiner.addRelation(Utils::createRelation(10, 3));
+  std::vector<std::string> batch{"0 1|0.0=1.1|1.0", "0 1|0.0=1.1&0.0>7|1.0",
+                                 "0 1|0.0=1.1&0.2<9&0.0>7|1.0"};
+  ASSERT_EQ(joiner.runBatch(batch),
+            (std::vector<std::string>{"45\n", "17\n", "8\n"}));
+
+  // Cached results of the old version are not reused
+  joiner.append(0, {{10, 11}, {10, 11}, {10, 11}});
+  joiner.append(1, {{10}, {10}, {10}});
+  std::vector<std::string> expected{"55\n", "27\n", "8\n"};
+  ASSERT_EQ(joiner.runBatch(batch), expected);
+  ASSERT_EQ(joiner.relations()[0].size(), 10u);
+  ASSERT_EQ(joiner.relations()[0].totalSize(), 12u);
+
+  // The merges run with the preparation work and are installed by the
+  // next batch
+  joiner.startPreparation(std::chrono::milliseconds(0));
+  joiner.finishPreparation();
+  auto stats = joiner.statistics().get(0, 0);
+  ASSERT_EQ(stats->size, 12u);
+  ASSERT_EQ(stats->max, 11u);
+  ASSERT_TRUE(stats->keys_checked && stats->unique);
+  ASSERT_EQ(joiner.runBatch(batch), expected);
+  ASSERT_EQ(joiner.relations()[0].size(), 12u);
+  ASSERT_EQ(joiner.relations()[0].delta(), nullptr);
+  ASSERT_EQ(joiner.relations()[0].columns()[2][11], 11u);
+}
+
+TEST_F(OperatorTest, JoinerEliminatesKeyChecks) {
+  // Relation 0 has the keys, relation 1 references existing keys only,
+  // relation 2 some missing ones as well
+  Joiner joiner;
+  joiner.addRelation(Utils::createRelation(10, 2));
+  for (uint64_t modulo : {10, 12}) {
+    auto relation = Utils::createRelation(30, 2);
+    for (uint64_t i = 0; i < 30; ++i) relation.columns()[1][i] = i % modulo;
+    joiner.addRelation(std::move(relation));
+  }
+  joiner.startPreparation(std::chrono::milliseconds(0));
+  joiner.finishPreparation();
+  std::vector<std::string> batch{"0 1|0.0=1.1|1.0", "0 1|0.0=1.1|0.0 1.0", "2 0|0.1=1.0|0.0"};
+  std::vector<std::string> expected{"435\n", "135 435\n", "369\n"};
+  ASSERT_EQ(joiner.runBatch(batch), expected);
+
+  // The inclusions are verified on demand
+  joiner.finishPreparation();
+  ASSERT_EQ(joiner.statistics().inclusion(1, 1, 0, 0, 30), Statistics::Inclusion::Holds);
+  ASSERT_EQ(joiner.statistics().inclusion(2, 1, 0, 0, 30), Statistics::Inclusion::Fails);
+  batch = {"0 1|0.0=1.1|1.0 1.0", "1 0|0.1=1.0|1.0 0.0", "2 0|0.1=1.0|0.0 0.0"};
+  expected = {"435 435\n", "135 435\n", "369 369\n"};
+  ASSERT_EQ(joiner.runBatch(batch), expected);
+}
+
+TEST_F(OperatorTest, JoinerFactorizesWithStatistics) {
+  // Relation 1 references the keys of relation 0, relation 2 has one value
+  Joiner joiner;
+  joiner.addRelation(Utils::createRelation(10, 2));
+  for (uint64_t modulo : {10, 1}) {
+    auto relation = Utils::createRelation(30, 2);
+    for (uint64_t i = 0; i < 30; ++i) relation.columns()[1][i] = i % modulo;
+    joiner.addRelation(std::move(relation));
+  }
+  PredicateInfo key_join(SelectInfo(0, 0, 0), SelectInfo(1, 1, 1));
+  PredicateInfo skewed_join(SelectInfo(2, 0, 1), SelectInfo(2, 1, 1));
+
+  // Without distinct counts nothing is planned as many-to-many
+  ASSERT_FALSE(joiner.factorizes(10, 30, key_join));
+  ASSERT_FALSE(joiner.factorizes(30, 30, skewed_join));
+  std::vector<std::string> batch{"0 1|0.0=1.1|1.0", "2 2|0.1=1.1|0.0"};
+  std::vector<std::string> expected{"435\n", "13050\n"};
+  ASSERT_EQ(joiner.runBatch(batch), expected);
+
+  joiner.startPreparation(std::chrono::milliseconds(0));
+  joiner.finishPreparation();
+  ASSERT_FALSE(joiner.factorizes(10, 30, key_join));
+  ASSERT_TRUE(joiner.factorizes(30, 30, skewed_join));
+  ASSERT_EQ(joiner.runBatch(batch), expected);
+}
+
+TEST_F(OperatorTest, JoinerLoadsInBackground) {
+  for (unsigned i = 0; i < 4; ++i) {
+    Utils::createRelation(100 * (i + 1), i + 1).storeRelation("load" + std::to_string(i));
+  }
+  Joiner joiner;
+  for (unsigned i = 0; i < 4; ++i) {
+    joiner.addRelation(("load" + std::to_string(i)).c_str());
+  }
+  joiner.finishLoading();
+
+  // Registration order is kept
+  ASSERT_EQ(joiner.relations().size(), 4u);
+  for (unsigned i = 0; i < 4; ++i) {
+    ASSERT_EQ(joiner.relations()[i].size(), 100u * (i + 1));
+    ASSERT_EQ(joiner.relations()[i].columns().size(), i + 1);
+  }
+  for (unsigned i = 0; i < 4; ++i) {
+    std::remove(("load" + std::to_string(i)).c_str());
+  }
+}
+
 }
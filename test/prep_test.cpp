@@ -0,0 +1,35 @@
+#include <atomic>
+
+#include "gtest/gtest.h"
+
+#include "prep.h"
+
+TEST(PrepScheduler, RunsEverything) {
+  ThreadPool pool(2);
+  std::atomic<int> done{0};
+  PrepScheduler prep;
+  for (int i = 0; i < 20; ++i) {
+    prep.add(i % 3, [&done] { ++done; });
+  }
+  prep.start(pool, std::chrono::milliseconds(1000));
+  prep.wait();
+  ASSERT_EQ(done, 20);
+  ASSERT_EQ(prep.pending(), 0u);
+}
+
+TEST(PrepScheduler, ContinuesInBackground) {
+  ThreadPool pool(2);
+  std::atomic<int> done{0};
+  PrepScheduler prep;
+  for (int i = 0; i < 5; ++i) {
+    prep.add(PrepScheduler::Stats, [&done] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      ++done;
+    });
+  }
+  // A zero budget leaves everything to the background thread
+  prep.start(pool, std::chrono::milliseconds(0));
+  prep.yield();
+  prep.wait();
+  ASSERT_EQ(done, 5);
+}
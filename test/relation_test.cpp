@@ -54,6 +54,16 @@ TEST(Relation, StoreCsv) {
   }
 }
 
+TEST(Relation, LoadCsv) {
+  Relation r1 = Utils::createRelation(100000, 3);
+
+  r1.storeRelationCSV("r1");
+
+  Relation r2("r1.tbl");
+
+  ASSERT_RELATION_EQ(r1, r2);
+}
+
 TEST(Relation, CreateSQL) {
   Relation r1 = Utils::createRelation(1, 5);
 
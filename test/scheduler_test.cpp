@@ -0,0 +1,94 @@
+#include <chrono>
+#include <future>
+#include <mutex>
+
+#include "gtest/gtest.h"
+
+#include "runtime.h"
+#include "scheduler.h"
+
+namespace {
+
+// Occupies the only worker until the returned promise is set
+std::promise<void> blockWorker(QueryScheduler &scheduler) {
+  std::promise<void> release;
+  std::promise<void> started;
+  auto released = release.get_future().share();
+  scheduler.submit(0, [&started, released] {
+    started.set_value();
+    released.wait();
+  });
+  started.get_future().wait();
+  return release;
+}
+
+}
+
+TEST(QueryScheduler, ShortestFirst) {
+  QueryScheduler scheduler(1, 4);
+  auto release = blockWorker(scheduler);
+
+  std::vector<int> order;
+  for (int cost : {5, 1, 3}) {
+    scheduler.submit(cost, [&order, cost] { order.push_back(cost); });
+  }
+  release.set_value();
+  scheduler.wait();
+
+  ASSERT_EQ(order, (std::vector<int>{1, 3, 5}));
+}
+
+TEST(QueryScheduler, AgingGuard) {
+  // One worker: a query is passed over at most twice
+  QueryScheduler scheduler(1, 4);
+  auto release = blockWorker(scheduler);
+
+  std::vector<int> order;
+  scheduler.submit(100, [&order] { order.push_back(100); });
+  for (int cost : {1, 2, 3, 4}) {
+    scheduler.submit(cost, [&order, cost] { order.push_back(cost); });
+  }
+  release.set_value();
+  scheduler.wait();
+
+  ASSERT_EQ(order, (std::vector<int>{1, 2, 100, 3, 4}));
+}
+
+TEST(QueryScheduler, ParallelismFollowsLoad) {
+  QueryScheduler scheduler(2, 8);
+  std::atomic<int> parallelism{0};
+  scheduler.submit(1, [&parallelism] {
+    parallelism = QueryScheduler::parallelism();
+  });
+  scheduler.wait();
+  ASSERT_EQ(parallelism, 8);
+  ASSERT_EQ(QueryScheduler::parallelism(), (int)Runtime::get().numThreads());
+}
+
+TEST(QueryScheduler, MemoryAdmission) {
+  // Two workers, but the two big queries do not fit next to each other
+  QueryScheduler scheduler(2, 2, 100);
+  std::mutex mutex;
+  int running = 0, peak = 0;
+  auto query = [&] {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      peak = std::max(peak, ++running);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::lock_guard<std::mutex> lock(mutex);
+    --running;
+  };
+  scheduler.submit(1, query, 60);
+  scheduler.submit(1, query, 60);
+  // Beyond the whole budget: runs alone
+  scheduler.submit(1, query, 1000);
+  scheduler.wait();
+  ASSERT_EQ(peak, 1);
+
+  // Small queries run side by side
+  for (int i = 0; i < 4; ++i)
+    scheduler.submit(1, query, 40);
+  scheduler.wait();
+  ASSERT_EQ(peak, 2);
+}
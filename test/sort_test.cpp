@@ -0,0 +1,51 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "sort.h"
+
+TEST(RadixSort, SortsStably) {
+  // Few distinct keys that differ in their high bytes only
+  ThreadPool pool(4);
+  std::mt19937_64 rng(42);
+  ArenaVector keys, ids;
+  for (uint64_t i = 0; i < 5000; ++i) {
+    keys.push_back((rng() % 50) << 40);
+    ids.push_back(i);
+  }
+  std::vector<std::pair<uint64_t, uint64_t>> expected;
+  for (uint64_t i = 0; i < keys.size(); ++i) expected.emplace_back(keys[i], ids[i]);
+  std::stable_sort(expected.begin(), expected.end(),
+                   [](auto &a, auto &b) { return a.first < b.first; });
+
+  RadixSort::sort(pool, 4, keys, ids);
+  ASSERT_EQ(keys.size(), expected.size());
+  for (uint64_t i = 0; i < keys.size(); ++i) {
+    ASSERT_EQ(keys[i], expected[i].first);
+    ASSERT_EQ(ids[i], expected[i].second);
+  }
+}
+
+TEST(RadixSort, Parallel) {
+  ThreadPool pool(4);
+  std::mt19937_64 rng(7);
+  ArenaVector keys, ids;
+  for (uint64_t i = 0; i < 4 * RadixSort::kParallelSize + 3; ++i) {
+    keys.push_back(rng());
+    ids.push_back(i);
+  }
+  ArenaVector original(keys);
+
+  RadixSort::sort(pool, 4, keys, ids);
+  ASSERT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+  for (uint64_t i = 0; i < keys.size(); ++i) ASSERT_EQ(original[ids[i]], keys[i]);
+}
+
+TEST(RadixSort, ZeroKeys) {
+  ThreadPool pool(1);
+  ArenaVector keys(3, 0), ids = {2, 0, 1};
+  RadixSort::sort(pool, 1, keys, ids);
+  ASSERT_EQ(ids, (ArenaVector{2, 0, 1}));
+}
@@ -0,0 +1,81 @@
+#include "gtest/gtest.h"
+
+#include "stats.h"
+
+TEST(ColumnStats, Compute) {
+  std::vector<uint64_t> values;
+  for (uint64_t i = 0; i < 200000; ++i) {
+    values.push_back(10 + i % 50000);
+  }
+  auto stats = ColumnStats::compute(values.data(), values.size());
+  ASSERT_EQ(stats->min, 10u);
+  ASSERT_EQ(stats->max, 50009u);
+  ASSERT_FALSE(stats->sorted);
+  ASSERT_FALSE(stats->keys_checked);
+  // HyperLogLog is within a few percent
+  ASSERT_NEAR(stats->distinct, 50000.0, 2500.0);
+  ASSERT_EQ(stats->zone_min.size(), (values.size() + ColumnStats::kZoneSize - 1) / ColumnStats::kZoneSize);
+  ASSERT_FALSE(ColumnStats::isUnique(values.data(), *stats));
+
+  ASSERT_EQ(stats->selectivity('=', 5), 0.0);
+  ASSERT_NEAR(stats->selectivity('<', 25010), 0.5, 0.01);
+  ASSERT_EQ(stats->selectivity('>', 50009), 0.0);
+}
+
+TEST(ColumnStats, Keys) {
+  std::vector<uint64_t> sorted{1, 2, 5, 9};
+  auto stats = ColumnStats::compute(sorted.data(), sorted.size());
+  ASSERT_TRUE(stats->sorted);
+  ASSERT_TRUE(stats->keys_checked);
+  ASSERT_TRUE(stats->unique);
+
+  // Dense and sparse domains
+  std::vector<uint64_t> dense{3, 1, 2, 0}, sparse{1ull << 40, 7, 1ull << 50, 3};
+  ASSERT_TRUE(ColumnStats::isUnique(dense.data(), *ColumnStats::compute(dense.data(), 4)));
+  ASSERT_TRUE(ColumnStats::isUnique(sparse.data(), *ColumnStats::compute(sparse.data(), 4)));
+  sparse[3] = 7;
+  ASSERT_FALSE(ColumnStats::isUnique(sparse.data(), *ColumnStats::compute(sparse.data(), 4)));
+}
+
+TEST(ColumnStats, Inclusion) {
+  // Dense keys with a gap, sparse keys
+  std::vector<uint64_t> dense{4, 0, 1, 2, 5}, sparse{1ull << 40, 7, 1ull << 50, 3};
+  auto dense_stats = ColumnStats::compute(dense.data(), dense.size());
+  auto sparse_stats = ColumnStats::compute(sparse.data(), sparse.size());
+  std::vector<uint64_t> values{1, 5, 1, 0}, missing{1, 3, 5}, sparse_values{7, 1ull << 50, 7};
+  auto values_stats = ColumnStats::compute(values.data(), values.size());
+  auto missing_stats = ColumnStats::compute(missing.data(), missing.size());
+  auto sparse_values_stats = ColumnStats::compute(sparse_values.data(), sparse_values.size());
+
+  ASSERT_TRUE(ColumnStats::isIncluded(values.data(), *values_stats, dense.data(), *dense_stats));
+  ASSERT_TRUE(ColumnStats::mayBeIncluded(*missing_stats, *dense_stats));
+  ASSERT_FALSE(ColumnStats::isIncluded(missing.data(), *missing_stats, dense.data(), *dense_stats));
+  ASSERT_TRUE(ColumnStats::isIncluded(sparse_values.data(), *sparse_values_stats, sparse.data(),
+                                      *sparse_stats));
+  ASSERT_FALSE(ColumnStats::mayBeIncluded(*values_stats, *sparse_stats));
+}
+
+TEST(ColumnStats, Extend) {
+  std::vector<uint64_t> values;
+  for (uint64_t i = 0; i < ColumnStats::kZoneSize + 10; ++i) {
+    values.push_back(i);
+  }
+  auto stats = ColumnStats::compute(values.data(), values.size());
+
+  // Ascending keys stay keys, the partial zone grows
+  std::vector<uint64_t> more{ColumnStats::kZoneSize + 10, ColumnStats::kZoneSize + 20};
+  auto extended = ColumnStats::extend(*stats, values.back(), more.data(), more.size());
+  ASSERT_EQ(extended->size, values.size() + 2);
+  ASSERT_EQ(extended->max, ColumnStats::kZoneSize + 20);
+  ASSERT_TRUE(extended->sorted);
+  ASSERT_TRUE(extended->keys_checked && extended->unique);
+  ASSERT_EQ(extended->zone_max.size(), 2u);
+  ASSERT_EQ(extended->zone_max[1], ColumnStats::kZoneSize + 20);
+
+  // A repeated value may be a duplicate
+  std::vector<uint64_t> repeated{5};
+  extended = ColumnStats::extend(*extended, more.back(), repeated.data(), repeated.size());
+  ASSERT_FALSE(extended->sorted);
+  ASSERT_FALSE(extended->keys_checked);
+  ASSERT_EQ(extended->min, 0u);
+}
@@ -0,0 +1,64 @@
+#include <random>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "tbl.h"
+
+namespace {
+
+// Parse a text, false if it is malformed
+bool parse(const std::string &text, std::vector<std::vector<uint64_t>> &columns) {
+  ThreadPool pool(2);
+  TblParser parser(text.data(), text.size());
+  if (!parser.scan(pool)) return false;
+  columns.assign(parser.numColumns(), std::vector<uint64_t>(parser.size()));
+  std::vector<uint64_t *> pointers;
+  for (auto &column : columns) pointers.push_back(column.data());
+  return parser.parse(pool, pointers);
+}
+
+}
+
+TEST(Tbl, ParsesValuesOfAnyLength) {
+  // Values of every digit count, so the vector and the scalar paths are hit
+  std::mt19937_64 rng(7);
+  std::vector<uint64_t> values;
+  for (unsigned digits = 1; digits <= 20; ++digits) {
+    for (int i = 0; i < 50; ++i) {
+      uint64_t value = rng();
+      std::string text = std::to_string(value);
+      values.push_back(std::stoull(text.substr(0, std::min<size_t>(digits, text.size()))));
+    }
+  }
+  values.push_back(UINT64_MAX);
+  values.push_back(0);
+  std::string text;
+  for (uint64_t i = 0; i + 1 < values.size(); i += 2)
+    text += std::to_string(values[i]) + "|" + std::to_string(values[i + 1]) + "|\n";
+
+  std::vector<std::vector<uint64_t>> columns;
+  ASSERT_TRUE(parse(text, columns));
+  ASSERT_EQ(columns.size(), 2u);
+  ASSERT_EQ(columns[0].size(), values.size() / 2);
+  for (uint64_t i = 0; i < columns[0].size(); ++i) {
+    ASSERT_EQ(columns[0][i], values[2 * i]);
+    ASSERT_EQ(columns[1][i], values[2 * i + 1]);
+  }
+}
+
+TEST(Tbl, LineEndings) {
+  std::vector<std::vector<uint64_t>> columns;
+  // No trailing delimiter, CRLF and no newline after the last line
+  ASSERT_TRUE(parse("1|2\r\n3|4\n5|6", columns));
+  ASSERT_EQ(columns[0], (std::vector<uint64_t>{1, 3, 5}));
+  ASSERT_EQ(columns[1], (std::vector<uint64_t>{2, 4, 6}));
+}
+
+TEST(Tbl, Malformed) {
+  std::vector<std::vector<uint64_t>> columns;
+  ASSERT_FALSE(parse("", columns));
+  ASSERT_FALSE(parse("1|2|\n3|\n", columns));
+  ASSERT_FALSE(parse("1|2|\n3|x|\n", columns));
+  ASSERT_FALSE(parse("1|2|\n3|4|5|\n", columns));
+}
@@ -0,0 +1,96 @@
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+
+#include "gtest/gtest.h"
+
+#include "ThreadPool.h"
+#include "runtime.h"
+
+TEST(ThreadPool, ParallelFor) {
+  ThreadPool pool(4);
+  std::vector<uint64_t> values(100000, 0);
+  pool.parallel_for(0, values.size(), [&](uint64_t i) { values[i] = i; });
+  for (uint64_t i = 0; i < values.size(); ++i) {
+    ASSERT_EQ(values[i], i);
+  }
+  // Empty ranges are fine
+  pool.parallel_for(5, 5, [&](uint64_t i) { values[i] = 0; });
+  ASSERT_EQ(values[5], 5u);
+}
+
+TEST(ThreadPool, NestedParallelFor) {
+  ThreadPool pool(4);
+  std::atomic<uint64_t> sum{0};
+  pool.parallel_for(0, 64, [&](uint64_t i) {
+    pool.parallel_for(0, 1000, [&](uint64_t j) { sum += j; }, 10);
+  }, 1);
+  ASSERT_EQ(sum, 64u * (999u * 1000u / 2));
+}
+
+TEST(ThreadPool, SpawnAndWait) {
+  ThreadPool pool(2);
+  TaskGroup group;
+  std::atomic<int> counter{0};
+  auto task = [&] { ++counter; };
+  for (int i = 0; i < 100; ++i) {
+    pool.spawn(group, task);
+  }
+  pool.wait(group);
+  ASSERT_TRUE(group.done());
+  ASSERT_EQ(counter, 100);
+}
+
+TEST(ThreadPool, PropagatesExceptions) {
+  ThreadPool pool(4);
+  ASSERT_THROW(pool.parallel_for(0, 100000, [](uint64_t i) {
+    if (i == 4242) throw std::runtime_error("task failed");
+  }, 16), std::runtime_error);
+  TaskGroup group;
+  auto task = [] { throw std::runtime_error("task failed"); };
+  pool.spawn(group, task);
+  ASSERT_THROW(pool.wait(group), std::runtime_error);
+  ASSERT_TRUE(group.done());
+  // The pool is still usable afterwards
+  std::atomic<uint64_t> sum{0};
+  pool.parallel_for(0, 1000, [&](uint64_t i) { sum += i; });
+  ASSERT_EQ(sum, 999u * 1000u / 2);
+}
+
+TEST(Runtime, Topology) {
+  auto topology = Topology::discover();
+  ASSERT_FALSE(topology.cpus.empty());
+  ASSERT_GE(topology.num_cores, 1u);
+  ASSERT_LE(topology.num_cores, topology.cpus.size());
+  ASSERT_GE(topology.num_nodes, 1u);
+  // Physical cores come before their hyperthread siblings
+  for (unsigned i = 0; i < topology.num_cores; ++i) {
+    ASSERT_EQ(topology.cpus[i].smt_rank, 0u);
+  }
+  ASSERT_GE(Runtime::get().numThreads(), 1u);
+  ASSERT_EQ(Runtime::get().pool().size(), Runtime::get().numThreads());
+}
+
+TEST(Runtime, Interleave) {
+  uint64_t length = 1 << 20;
+  void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(mapping, MAP_FAILED);
+  ASSERT_TRUE(Runtime::get().interleave(mapping, length));
+  memset(mapping, 1, length);
+  munmap(mapping, length);
+}
+
+TEST(Runtime, PlaceOnNode) {
+  auto &runtime = Runtime::get();
+  auto node = runtime.currentNode();
+  ASSERT_LT(node, runtime.topology().num_nodes);
+  uint64_t length = 1 << 20;
+  void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(mapping, MAP_FAILED);
+  ASSERT_TRUE(runtime.placeOnNode(mapping, length, node));
+  memset(mapping, 1, length);
+  munmap(mapping, length);
+}